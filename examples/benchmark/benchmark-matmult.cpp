@@ -14,6 +14,7 @@
 #include <string>
 #include <iterator>
 #include <algorithm>
+#include <vector>
 
 float tensor_sum_elements(struct ggml_tensor * tensor) {
     float sum = 0;
@@ -104,11 +105,13 @@ int main(int argc, char ** argv)  {
     const int sizey = 4096;
     const int sizex = 11008;
     const int sizez = 128;
+    const int sizeb = 512; // prompt batch size
 #else
     /* Working - let's increase size */
     const int sizey = 1;
     const int sizex = (8*32);
     const int sizez = 1;
+    const int sizeb = 1;
 
     /*const int sizey = 1;
     const int sizex = 3*(8*32);
@@ -125,6 +128,12 @@ int main(int argc, char ** argv)  {
     ctx_size += sizex*sizey*ggml_type_sizef(GGML_TYPE_Q4_0);
     ctx_size += sizex*sizey*ggml_type_sizef(GGML_TYPE_F32); // BLAS
     ctx_size += sizex*sizey*ggml_type_sizef(GGML_TYPE_F32); // BLAS
+    ctx_size += sizex*sizeb*ggml_type_sizef(GGML_TYPE_F32);  // Test 3 - src1
+    ctx_size += sizey*sizeb*ggml_type_sizef(GGML_TYPE_F32);  // Test 3 - dst
+    ctx_size += 2*sizex*sizey*ggml_type_sizef(GGML_TYPE_Q4_0); // Test 4 - w1, w3
+    ctx_size += (1 + sizeb)*sizey*ggml_type_sizef(GGML_TYPE_F32); // Test 4 - src1
+    ctx_size += 5*(1 + sizeb)*sizex*ggml_type_sizef(GGML_TYPE_F32); // Test 4 - dst and intermediate results
+    ctx_size += sizeb*sizey*ggml_type_sizef(GGML_TYPE_Q8_0); // Test 4 - quantized src1
     ctx_size += 1024*1024*16;
 
     printf("Allocating Memory of size %li bytes, %li MB\n",ctx_size, (ctx_size/1024/1024));
@@ -259,4 +268,93 @@ int main(int argc, char ** argv)  {
 
     }
 
+    printf("\n------ Test 3 - Matrix Mult via Q4_0 code with a prompt-sized batch -----------------------------------------------------\n");
+
+    // before the multiplication, the GGML_TASK_INIT phase quantizes every row of the batch to the vec_dot type of Q4_0
+    // this used to run on a single thread while the others were waiting - it is now split over all threads
+    // the serial quantization of the batch is timed on its own, next to the whole node with the split INIT phase
+    struct ggml_tensor * m3 = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, sizex, sizeb);
+    ggml_set_f32(m3, 2.0f);
+
+    struct ggml_tensor * q33 = ggml_mul_mat(ctx, q11, m3);
+
+    struct ggml_cgraph gf33 = ggml_build_forward(q33);
+    gf33.n_threads=benchmark_params.n_threads;
+
+    const quantize_fns_t q4_0_fns = ggml_internal_get_quantize_fn(GGML_TYPE_Q4_0);
+    const size_t q8_row_size = ggml_type_size(q4_0_fns.vec_dot_type)*sizex/ggml_blck_size(q4_0_fns.vec_dot_type);
+    std::vector<uint8_t> q8_batch(q8_row_size*sizeb);
+
+    long long int flops_per_batch = flops_per_dot_product * dimx * sizeb;
+    printf("Matrix Multiplication of (%i,%i,%i) x (%i,%i,%i) - about %6.2f gFLOPS\n\n", sizex, sizey, 1, sizex, sizeb, 1, 1.0f*flops_per_batch / 1000 / 1000 / 1000);
+
+    printf("Iteration;NThreads; SizeX; SizeY; SizeB; Serial_Quantize_u_Seconds; Elapsed_u_Seconds; FLOPS_per_u_Second\n");
+    printf("==========================================================================================================\n");
+
+    for (int i=0;i<benchmark_params.n_iterations ;i++) {
+
+        long long int start = ggml_time_us();
+        for (int ib = 0; ib < sizeb; ++ib) {
+            q4_0_fns.quantize_row_q_dot((const float *) ((const char *) m3->data + ib*m3->nb[1]), q8_batch.data() + ib*q8_row_size, sizex);
+        }
+        long long int usec_quantize = ggml_time_us() - start;
+
+        start = ggml_time_us();
+        ggml_graph_compute(ctx, &gf33);
+        long long int usec = ggml_time_us() - start;
+
+        float flops_per_usec = (1.0f*flops_per_batch)/usec;
+        printf("%9i;%8i;%6i;%6i;%6i;%26lli;%18lli;%19.2f\n",
+            i,
+            gf33.n_threads,
+            sizex, sizey, sizeb,
+            usec_quantize, usec, flops_per_usec);
+    }
+
+    printf("\n------ Test 4 - SwiGLU feed-forward via Q4_0 code, separate nodes vs ggml_mul_mat_swiglu ----------------------------------\n");
+
+    // silu(w1*x) * (w3*x) with the shapes of the 7B feed-forward: the separate nodes store both products and run
+    // silu and mul over them, the fused op quantizes x once and combines the two dot products directly
+    struct ggml_tensor * w1 = ggml_new_tensor_2d(ctx, GGML_TYPE_Q4_0, sizey, sizex);
+    struct ggml_tensor * w3 = ggml_new_tensor_2d(ctx, GGML_TYPE_Q4_0, sizey, sizex);
+    ggml_quantize_q4_0((const float *) m11->data, w1->data, nelements, sizey, hist_cur.data());
+    ggml_quantize_q4_0((const float *) m12->data, w3->data, nelements, sizey, hist_cur.data());
+
+    printf("Iteration;NThreads; SizeX; SizeY; SizeB; Separate_u_Seconds; Fused_u_Seconds; Speedup\n");
+    printf("===================================================================================\n");
+
+    for (int nb : { 1, sizeb }) {
+        struct ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, sizey, nb);
+        ggml_set_f32(x, 0.5f);
+
+        struct ggml_tensor * ffn_sep = ggml_mul(ctx, ggml_silu(ctx, ggml_mul_mat(ctx, w1, x)), ggml_mul_mat(ctx, w3, x));
+        struct ggml_tensor * ffn_fus = ggml_mul_mat_swiglu(ctx, w1, w3, x);
+
+        struct ggml_cgraph gf_sep = ggml_build_forward(ffn_sep);
+        struct ggml_cgraph gf_fus = ggml_build_forward(ffn_fus);
+        gf_sep.n_threads = benchmark_params.n_threads;
+        gf_fus.n_threads = benchmark_params.n_threads;
+
+        for (int i=0;i<benchmark_params.n_iterations ;i++) {
+            long long int start = ggml_time_us();
+            ggml_graph_compute(ctx, &gf_sep);
+            long long int usec_sep = ggml_time_us() - start;
+
+            start = ggml_time_us();
+            ggml_graph_compute(ctx, &gf_fus);
+            long long int usec_fus = ggml_time_us() - start;
+
+            printf("%9i;%8i;%6i;%6i;%6i;%19lli;%16lli;%8.2f\n",
+                i,
+                gf_fus.n_threads,
+                sizex, sizey, nb,
+                usec_sep, usec_fus, (double) usec_sep/usec_fus);
+        }
+
+        if (memcmp(ffn_sep->data, ffn_fus->data, ggml_nbytes(ffn_fus)) != 0) {
+            printf("\nABORT - ERROR in the fused SwiGLU result for a batch of %d\n", nb);
+            exit(0);
+        }
+    }
+
 }
@@ -160,6 +160,16 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
             params.n_ctx = std::stoi(argv[i]);
         } else if (arg == "--memory_f32") {
             params.memory_f16 = false;
+        } else if (arg == "--memory_k_type") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.memory_k_type = argv[i];
+            if (params.memory_k_type != "q8_0" && params.memory_k_type != "q4_0") {
+                invalid_param = true;
+                break;
+            }
         } else if (arg == "--top_p") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -245,6 +255,18 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
                 break;
             }
             params.model = argv[i];
+        } else if (arg == "-md" || arg == "--model-draft") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.model_draft = argv[i];
+        } else if (arg == "--draft") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_draft = std::stoi(argv[i]);
         } else if (arg == "--lora") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -272,6 +294,8 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
             params.use_mlock = true;
         } else if (arg == "--no-mmap") {
             params.use_mmap = false;
+        } else if (arg == "--numa") {
+            params.numa = true;
         } else if (arg == "--mtest") {
             params.mem_test = true;
         } else if (arg == "--verbose-prompt") {
@@ -382,6 +406,7 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     fprintf(stderr, "  --ignore-eos          ignore end of stream token and continue generating (implies --logit-bias 2-inf)\n");
     fprintf(stderr, "  --no-penalize-nl      do not penalize newline token\n");
     fprintf(stderr, "  --memory_f32          use f32 instead of f16 for memory key+value\n");
+    fprintf(stderr, "  --memory_k_type TYPE  quantize memory keys to q8_0 or q4_0 (head size must be a multiple of 32)\n");
     fprintf(stderr, "  --temp N              temperature (default: %.1f)\n", (double)params.temp);
     fprintf(stderr, "  --n_parts N           number of model parts (default: -1 = determine from dimensions)\n");
     fprintf(stderr, "  -b N, --batch_size N  batch size for prompt processing (default: %d)\n", params.n_batch);
@@ -393,12 +418,17 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     if (llama_mmap_supported()) {
         fprintf(stderr, "  --no-mmap             do not memory-map model (slower load but may reduce pageouts if not using mlock)\n");
     }
+    fprintf(stderr, "  --numa                spread the threads and the weights over the NUMA nodes, drop the page cache\n");
+    fprintf(stderr, "                        (echo 3 > /proc/sys/vm/drop_caches) after a run without it\n");
     fprintf(stderr, "  --mtest               compute maximum memory usage\n");
     fprintf(stderr, "  --verbose-prompt      print prompt before generation\n");
     fprintf(stderr, "  --lora FNAME          apply LoRA adapter (implies --no-mmap)\n");
     fprintf(stderr, "  --lora-base FNAME     optional model to use as a base for the layers modified by the LoRA adapter\n");
     fprintf(stderr, "  -m FNAME, --model FNAME\n");
     fprintf(stderr, "                        model path (default: %s)\n", params.model.c_str());
+    fprintf(stderr, "  -md FNAME, --model-draft FNAME\n");
+    fprintf(stderr, "                        draft model for speculative decoding (default: none)\n");
+    fprintf(stderr, "  --draft N             number of tokens to draft for speculative decoding (default: %d)\n", params.n_draft);
     fprintf(stderr, "\n");
 }
 
@@ -432,6 +462,28 @@ std::vector<llama_token> llama_tokenize(struct llama_context * ctx, const std::s
     return res;
 }
 
+std::vector<std::vector<llama_token>> llama_tokenize_batch(struct llama_context * ctx, const std::vector<std::string> & texts, bool add_bos, int n_threads) {
+    std::vector<const char *> ptrs;
+    size_t n_max = 0;
+    for (const auto & text : texts) {
+        ptrs.push_back(text.c_str());
+        n_max += text.size() + (int)add_bos;
+    }
+
+    std::vector<llama_token> tokens(n_max);
+    std::vector<int> offsets(texts.size() + 1);
+    int n = llama_tokenize_batch(ctx, ptrs.data(), ptrs.size(), tokens.data(), tokens.size(), offsets.data(), add_bos, n_threads);
+    assert(n >= 0);
+    (void) n;
+
+    std::vector<std::vector<llama_token>> res(texts.size());
+    for (size_t i = 0; i < texts.size(); i++) {
+        res[i].assign(tokens.begin() + offsets[i], tokens.begin() + offsets[i + 1]);
+    }
+
+    return res;
+}
+
 struct llama_context * llama_init_from_gpt_params(const gpt_params & params) {
     auto lparams = llama_context_default_params();
 
@@ -439,8 +491,14 @@ struct llama_context * llama_init_from_gpt_params(const gpt_params & params) {
     lparams.n_parts    = params.n_parts;
     lparams.seed       = params.seed;
     lparams.f16_kv     = params.memory_f16;
+    if (params.memory_k_type == "q8_0") {
+        lparams.kv_type_k = LLAMA_KV_TYPE_Q8_0;
+    } else if (params.memory_k_type == "q4_0") {
+        lparams.kv_type_k = LLAMA_KV_TYPE_Q4_0;
+    }
     lparams.use_mmap   = params.use_mmap;
     lparams.use_mlock  = params.use_mlock;
+    lparams.numa       = params.numa;
     lparams.logits_all = params.perplexity;
     lparams.embedding  = params.embedding;
 
@@ -23,6 +23,7 @@ struct gpt_params {
     int32_t n_ctx         = 512;  // context size
     int32_t n_batch       = 512;  // batch size for prompt processing (must be >=32 to use BLAS)
     int32_t n_keep        = 0;    // number of tokens to keep from initial prompt
+    int32_t n_draft       = 8;    // number of tokens to draft for speculative decoding
 
     // sampling parameters
     std::unordered_map<llama_token, float> logit_bias; // logit bias for specific tokens
@@ -40,6 +41,7 @@ struct gpt_params {
     float   mirostat_eta      = 0.10f; // learning rate
 
     std::string model  = "models/lamma-7B/ggml-model.bin"; // model path
+    std::string model_draft = "";  // draft model for speculative decoding
     std::string prompt = "";
     std::string path_session = "";       // path to file for saving/loading model eval state
     std::string input_prefix = "";       // string to prefix user inputs with
@@ -49,6 +51,7 @@ struct gpt_params {
     std::string lora_base = "";     // base model path for the lora adapter
 
     bool memory_f16        = true;  // use f16 instead of f32 for memory kv
+    std::string memory_k_type = "";  // quantize the memory keys: q8_0 or q4_0
     bool random_prompt     = false; // do not randomize prompt if none provided
     bool use_color         = false; // use color to distinguish generations and inputs
     bool interactive       = false; // interactive mode
@@ -61,6 +64,7 @@ struct gpt_params {
     bool perplexity        = false; // compute perplexity over the prompt
     bool use_mmap          = true;  // use mmap for faster loads
     bool use_mlock         = false; // use mlock to keep model in memory
+    bool numa              = false; // spread the threads and the weights over the NUMA nodes
     bool mem_test          = false; // compute maximum memory usage
     bool verbose_prompt    = false; // print prompt tokens before generation
 };
@@ -77,6 +81,8 @@ std::string gpt_random_prompt(std::mt19937 & rng);
 
 std::vector<llama_token> llama_tokenize(struct llama_context * ctx, const std::string & text, bool add_bos);
 
+std::vector<std::vector<llama_token>> llama_tokenize_batch(struct llama_context * ctx, const std::vector<std::string> & texts, bool add_bos, int n_threads);
+
 //
 // Model utils
 //
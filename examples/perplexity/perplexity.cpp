@@ -2,8 +2,10 @@
 #include "llama.h"
 #include "build-info.h"
 
+#include <algorithm>
 #include <cmath>
 #include <ctime>
+#include <memory>
 
 std::vector<float> softmax(const std::vector<float>& logits) {
     std::vector<float> probs(logits.size());
@@ -25,12 +27,20 @@ void perplexity(llama_context * ctx, const gpt_params & params) {
     // Download: https://s3.amazonaws.com/research.metamind.io/wikitext/wikitext-2-raw-v1.zip?ref=salesforce-research
     // Run `./perplexity -m models/7B/ggml-model-q4_0.bin -f wiki.test.raw`
     // Output: `perplexity: 13.5106 [114/114]`
-    auto tokens = ::llama_tokenize(ctx, params.prompt, true);
+    auto tokens = ::llama_tokenize_batch(ctx, { params.prompt }, true, params.n_threads)[0];
 
     int count = 0;
     int seq_count = tokens.size() / params.n_ctx;
     int n_vocab = llama_n_vocab(ctx);
 
+    // only the tokens in the second half of the window are scored, the logits of the others are not computed
+    const int first = std::min(512, params.n_ctx / 2);
+
+    std::unique_ptr<bool[]> need_logits(new bool[params.n_ctx]);
+    for (int j = 0; j < params.n_ctx; ++j) {
+        need_logits[j] = j >= first && j < params.n_ctx - 1;
+    }
+
     double nll = 0.0;
     fprintf(stderr, "%s : calculating perplexity over %d chunks, batch_size=%d\n", __func__, seq_count, params.n_batch);
 
@@ -44,12 +54,14 @@ void perplexity(llama_context * ctx, const gpt_params & params) {
         for (int j = 0; j < num_batches; ++j) {
             int batch_start = start + j * params.n_batch;
             int batch_size = std::min(end - batch_start, params.n_batch);
-            if (llama_eval(ctx, tokens.data() + batch_start, batch_size, j * params.n_batch, params.n_threads)) {
+            const bool * batch_need = need_logits.get() + j * params.n_batch;
+            if (llama_eval_masked(ctx, tokens.data() + batch_start, batch_size, j * params.n_batch, params.n_threads, batch_need)) {
                 fprintf(stderr, "%s : failed to eval\n", __func__);
                 return;
             }
+            const int n_outputs = std::count(batch_need, batch_need + batch_size, true);
             auto batch_logits = llama_get_logits(ctx);
-            logits.insert(logits.end(), batch_logits, batch_logits + batch_size * n_vocab);
+            logits.insert(logits.end(), batch_logits, batch_logits + n_outputs * n_vocab);
         }
         auto end_t = std::chrono::high_resolution_clock::now();
         if (i == 0) {
@@ -62,8 +74,8 @@ void perplexity(llama_context * ctx, const gpt_params & params) {
             }
             printf("%d minutes\n", total_seconds / 60);
         }
-        // We get the logits for all the tokens in the context window (params.n_ctx)
-        // from llama_eval above.  Now, based on https://huggingface.co/docs/transformers/perplexity,
+        // We get the logits for the scored tokens in the context window (params.n_ctx)
+        // from llama_eval_masked above, row j - first for token j.  Now, based on https://huggingface.co/docs/transformers/perplexity,
         // calculate the perplexity over the last half the window (so the model always has
         // some context to predict the token).
         //
@@ -74,11 +86,11 @@ void perplexity(llama_context * ctx, const gpt_params & params) {
         // Example, we have a context window of 512, we will compute perplexity for each of the
         // last 256 tokens.  Then, we split the input up into context window size chunks to
         // process the entire prompt.
-        for (int j = std::min(512, params.n_ctx / 2); j < params.n_ctx - 1; ++j) {
+        for (int j = first; j < params.n_ctx - 1; ++j) {
             // Calculate probability of next token, given the previous ones.
             std::vector<float> tok_logits(
-                logits.begin() + j * n_vocab,
-                logits.begin() + (j + 1) * n_vocab);
+                logits.begin() + (j - first) * n_vocab,
+                logits.begin() + (j - first + 1) * n_vocab);
             float prob = softmax(tok_logits)[tokens[start + j + 1]];
             nll += -std::log(prob);
             ++count;
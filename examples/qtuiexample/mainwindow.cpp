@@ -272,10 +272,8 @@ void MainWindow::initializeLLaMA() {
     is_antiprompt = false;
     input_noecho  = false;
 
-    // HACK - because session saving incurs a non-negligible delay, for now skip re-saving session
-    // if we loaded a session with at least 75% similarity. It's currently just used to speed up the
-    // initial prompt so it doesn't need to be an exact match.
-    need_to_save_session = !path_session.empty() && n_matching_session_tokens < (embd_inp.size() * 3 / 4);
+    // the session is appended to, saving it only writes the tokens evaluated since it was last saved
+    need_to_save_session = !path_session.empty();
 
 
     n_past     = 0;
@@ -378,7 +376,7 @@ int MainWindow::interactivePrompt(){
             // optionally save the session on first sample (for faster prompt loading next time)
             if (!path_session.empty() && need_to_save_session) {
                 need_to_save_session = false;
-                llama_save_session_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
+                llama_append_session_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
             }
 
             llama_token id = 0;
@@ -392,32 +390,45 @@ int MainWindow::interactivePrompt(){
                     logits[it->first] += it->second;
                 }
 
-                std::vector<llama_token_data> candidates;
-                candidates.reserve(n_vocab);
-                for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-                    candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
-                }
+                auto last_n_repeat = std::min(std::min((int)last_n_tokens.size(), repeat_last_n), n_ctx);
+                const llama_token * last_repeat = last_n_tokens.data() + last_n_tokens.size() - last_n_repeat;
+
+                if (mirostat != 1 && mirostat != 2) {
+                    // penalties, top-k, tail free, typical, top-p and temperature straight from the logits
+                    // (also for an unknown mirostat version, as the temperature sampling did before)
+                    llama_sampling_params sparams = llama_sampling_default_params();
+                    sparams.temp            = temp;
+                    sparams.top_k           = top_k;
+                    sparams.top_p           = top_p;
+                    sparams.tfs_z           = tfs_z;
+                    sparams.typical_p       = typical_p;
+                    sparams.repeat_penalty  = repeat_penalty;
+                    sparams.alpha_frequency = alpha_frequency;
+                    sparams.alpha_presence  = alpha_presence;
+                    sparams.penalize_nl     = penalize_nl;
+
+                    id = llama_sample_chain(ctx, logits, &sparams, last_repeat, last_n_repeat);
+                } else {
+                    std::vector<llama_token_data> candidates;
+                    candidates.reserve(n_vocab);
+                    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+                        candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+                    }
 
-                llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
+                    llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
 
-                // Apply penalties
-                float nl_logit = logits[llama_token_nl()];
-                auto last_n_repeat = std::min(std::min((int)last_n_tokens.size(), repeat_last_n), n_ctx);
-                llama_sample_repetition_penalty(ctx, &candidates_p,
-                    last_n_tokens.data() + last_n_tokens.size() - last_n_repeat,
-                    last_n_repeat, repeat_penalty);
-                llama_sample_frequency_and_presence_penalties(ctx, &candidates_p,
-                    last_n_tokens.data() + last_n_tokens.size() - last_n_repeat,
-                    last_n_repeat, alpha_frequency, alpha_presence);
-                if (!penalize_nl) {
-                    logits[llama_token_nl()] = nl_logit;
-                }
+                    // Apply penalties
+                    float nl_logit = logits[llama_token_nl()];
+                    llama_sample_repetition_penalty(ctx, &candidates_p, last_repeat, last_n_repeat, repeat_penalty);
+                    llama_sample_frequency_and_presence_penalties(ctx, &candidates_p, last_repeat, last_n_repeat, alpha_frequency, alpha_presence);
+                    if (!penalize_nl) {
+                        logits[llama_token_nl()] = nl_logit;
+                    }
 
-                if (temp <= 0) {
-                    // Greedy sampling
-                    id = llama_sample_token_greedy(ctx, &candidates_p);
-                } else {
-                    if (mirostat == 1) {
+                    if (temp <= 0) {
+                        // Greedy sampling
+                        id = llama_sample_token_greedy(ctx, &candidates_p);
+                    } else if (mirostat == 1) {
                         static float mirostat_mu = 2.0f * mirostat_tau;
                         const int mirostat_m = 100;
                         llama_sample_temperature(ctx, &candidates_p, temp);
@@ -426,17 +437,8 @@ int MainWindow::interactivePrompt(){
                         static float mirostat_mu = 2.0f * mirostat_tau;
                         llama_sample_temperature(ctx, &candidates_p, temp);
                         id = llama_sample_token_mirostat_v2(ctx, &candidates_p, mirostat_tau, mirostat_eta, &mirostat_mu);
-                    } else {
-                        // Temperature sampling
-                        llama_sample_top_k(ctx, &candidates_p, top_k);
-                        llama_sample_tail_free(ctx, &candidates_p, tfs_z);
-                        llama_sample_typical(ctx, &candidates_p, typical_p);
-                        llama_sample_top_p(ctx, &candidates_p, top_p);
-                        llama_sample_temperature(ctx, &candidates_p, temp);
-                        id = llama_sample_token(ctx, &candidates_p);
                     }
                 }
-                // printf("`%d`", candidates_p.size);
 
                 last_n_tokens.erase(last_n_tokens.begin());
                 last_n_tokens.push_back(id);
@@ -102,10 +102,6 @@ int main(int argc, char ** argv) {
     // Load state (rng, logits, embedding and kv_cache) from file
     {
         FILE *fp_read = fopen("dump_state.bin", "rb");
-        if (state_size != llama_get_state_size(ctx2)) {
-            fprintf(stderr, "\n%s : failed to validate state size\n", __func__);
-            return 1;
-        }
 
         const size_t ret = fread(state_mem, 1, state_size, fp_read);
         if (ret != state_size) {
@@ -113,7 +109,10 @@ int main(int argc, char ** argv) {
             return 1;
         }
 
-        llama_set_state_data(ctx2, state_mem);  // could also read directly from memory mapped file
+        if (llama_set_state_data(ctx2, state_mem) != state_size) {  // could also read directly from memory mapped file
+            fprintf(stderr, "\n%s : failed to validate state size\n", __func__);
+            return 1;
+        }
         fclose(fp_read);
     }
 
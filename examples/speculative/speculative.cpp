@@ -0,0 +1,253 @@
+// Speculative decoding: a small draft model proposes n_draft tokens, the target model evaluates all of them in one
+// batch and keeps those that match its own greedy choice, so several tokens can be accepted per pass over the weights
+// of the target model. The rejected tokens are removed from the KV caches of both models.
+// The output is the one of greedy decoding with the target model, up to the small numerical differences between
+// batched and single-token evals that can flip near ties - it is also run without a draft for comparison.
+
+#include "common.h"
+#include "llama.h"
+#include "build-info.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+static llama_token argmax(const float * logits, int n_vocab) {
+    return std::max_element(logits, logits + n_vocab) - logits;
+}
+
+static double time_s() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// greedy decoding with the target model only
+static bool decode_plain(
+        llama_context * ctx,
+        const std::vector<llama_token> & prompt,
+        int n_predict,
+        int n_threads,
+        std::vector<llama_token> & out) {
+    const int n_vocab = llama_n_vocab(ctx);
+
+    if (llama_eval(ctx, prompt.data(), prompt.size(), 0, n_threads)) {
+        return false;
+    }
+
+    int n_past = prompt.size();
+    const float * logits = llama_get_logits(ctx);
+
+    while ((int) out.size() < n_predict) {
+        llama_token id = argmax(logits, n_vocab);
+        out.push_back(id);
+
+        if (id == llama_token_eos() || (int) out.size() == n_predict) {
+            break;
+        }
+
+        if (llama_eval(ctx, &id, 1, n_past, n_threads)) {
+            return false;
+        }
+        n_past += 1;
+        logits = llama_get_logits(ctx);
+    }
+
+    return true;
+}
+
+static bool decode_speculative(
+        llama_context * ctx_tgt,
+        llama_context * ctx_dft,
+        const std::vector<llama_token> & prompt,
+        int n_predict,
+        int n_draft,
+        int n_threads,
+        std::vector<llama_token> & out,
+        int & n_drafted,
+        int & n_accepted) {
+    const int n_vocab = llama_n_vocab(ctx_tgt);
+    const int n_ctx   = llama_n_ctx(ctx_tgt);
+
+    // the prompt and the generated tokens, the target has all of them but the last one in its KV cache
+    std::vector<llama_token> inp = prompt;
+
+    if (llama_eval(ctx_tgt, inp.data(), inp.size(), 0, n_threads)) {
+        return false;
+    }
+
+    inp.push_back(argmax(llama_get_logits(ctx_tgt), n_vocab));
+    out.push_back(inp.back());
+
+    // number of tokens of inp in the KV cache of the draft model
+    int n_past_dft = 0;
+
+    std::vector<llama_token> drafted;
+    std::vector<llama_token> batch;
+
+    // the target returns the logits of every token of the batch
+    std::unique_ptr<bool[]> need_logits(new bool[n_draft + 1]);
+    std::fill(need_logits.get(), need_logits.get() + n_draft + 1, true);
+
+    while ((int) out.size() < n_predict && inp.back() != llama_token_eos()) {
+        if ((int) inp.size() + n_draft > n_ctx) {
+            fprintf(stderr, "%s: out of context\n", __func__);
+            break;
+        }
+
+        // the draft model catches up with the accepted tokens and drafts the next ones greedily
+        if (llama_eval(ctx_dft, inp.data() + n_past_dft, inp.size() - n_past_dft, n_past_dft, n_threads)) {
+            return false;
+        }
+        n_past_dft = inp.size();
+
+        drafted.clear();
+        for (int i = 0; i < n_draft; ++i) {
+            drafted.push_back(argmax(llama_get_logits(ctx_dft), n_vocab));
+
+            if (i + 1 < n_draft && llama_eval(ctx_dft, &drafted.back(), 1, n_past_dft + i, n_threads)) {
+                return false;
+            }
+        }
+
+        // the target model evaluates the last token and the drafted ones at once,
+        // row i of its logits is its choice for the token after batch[i]
+        const int n_past_tgt = inp.size() - 1;
+
+        batch.assign(1, inp.back());
+        batch.insert(batch.end(), drafted.begin(), drafted.end());
+
+        if (llama_eval_masked(ctx_tgt, batch.data(), batch.size(), n_past_tgt, n_threads, need_logits.get())) {
+            return false;
+        }
+
+        const float * logits = llama_get_logits(ctx_tgt);
+
+        // keep the drafted tokens up to the first one the target disagrees with, then the choice of the target
+        int n_accept = 0;
+        for (int i = 0; i <= n_draft; ++i) {
+            const llama_token id = argmax(logits + i*n_vocab, n_vocab);
+
+            inp.push_back(id);
+            out.push_back(id);
+
+            if (id == llama_token_eos() || (int) out.size() == n_predict) {
+                break;
+            }
+
+            if (i == n_draft || id != drafted[i]) {
+                break;
+            }
+
+            n_accept++;
+        }
+
+        n_drafted  += n_draft;
+        n_accepted += n_accept;
+
+        // roll back the rejected tokens: the target keeps the last token and the accepted ones,
+        // the draft the accepted ones it has evaluated (it did not evaluate its last draft)
+        llama_kv_cache_seq_rm(ctx_tgt, 0, n_past_tgt + 1 + n_accept);
+
+        n_past_dft += std::min(n_accept, n_draft - 1);
+        llama_kv_cache_seq_rm(ctx_dft, 0, n_past_dft);
+    }
+
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    gpt_params params;
+    params.n_threads = 4;
+    params.prompt = "The quick brown fox";
+
+    if (gpt_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    fprintf(stderr, "%s: build = %d (%s)\n", __func__, BUILD_NUMBER, BUILD_COMMIT);
+
+    if (params.model_draft.empty()) {
+        fprintf(stderr, "%s: error: a draft model is required (--model-draft)\n", __func__);
+        return 1;
+    }
+
+    if (params.n_predict < 0) {
+        params.n_predict = 128;
+    }
+
+    if (params.n_draft < 1) {
+        params.n_draft = 1;
+    }
+
+    auto lparams = llama_context_default_params();
+
+    lparams.n_ctx     = params.n_ctx;
+    lparams.n_parts   = params.n_parts;
+    lparams.seed      = params.seed;
+    lparams.f16_kv    = params.memory_f16;
+    lparams.use_mmap  = params.use_mmap;
+    lparams.use_mlock = params.use_mlock;
+    lparams.numa      = params.numa;
+
+    llama_context * ctx_tgt = llama_init_from_file(params.model.c_str(), lparams);
+    llama_context * ctx_dft = llama_init_from_file(params.model_draft.c_str(), lparams);
+
+    if (ctx_tgt == NULL || ctx_dft == NULL) {
+        fprintf(stderr, "%s: error: failed to load the models\n", __func__);
+        return 1;
+    }
+
+    if (llama_n_vocab(ctx_tgt) != llama_n_vocab(ctx_dft)) {
+        fprintf(stderr, "%s: error: the draft model has a different vocabulary (%d vs %d tokens)\n",
+                __func__, llama_n_vocab(ctx_dft), llama_n_vocab(ctx_tgt));
+        return 1;
+    }
+
+    const std::vector<llama_token> prompt = ::llama_tokenize(ctx_tgt, params.prompt, true);
+
+    if ((int) prompt.size() + params.n_predict + params.n_draft > params.n_ctx) {
+        fprintf(stderr, "%s: error: the prompt (%d tokens) and %d new tokens do not fit in the context\n",
+                __func__, (int) prompt.size(), params.n_predict);
+        return 1;
+    }
+
+    std::vector<llama_token> out_spec;
+    std::vector<llama_token> out_plain;
+
+    int n_drafted  = 0;
+    int n_accepted = 0;
+
+    const double t_spec_start = time_s();
+    if (!decode_speculative(ctx_tgt, ctx_dft, prompt, params.n_predict, params.n_draft, params.n_threads, out_spec, n_drafted, n_accepted)) {
+        fprintf(stderr, "%s: error: failed to eval\n", __func__);
+        return 1;
+    }
+    const double t_spec = time_s() - t_spec_start;
+
+    const double t_plain_start = time_s();
+    if (!decode_plain(ctx_tgt, prompt, params.n_predict, params.n_threads, out_plain)) {
+        fprintf(stderr, "%s: error: failed to eval\n", __func__);
+        return 1;
+    }
+    const double t_plain = time_s() - t_plain_start;
+
+    printf("%s", params.prompt.c_str());
+    for (auto id : out_spec) {
+        printf("%s", llama_token_to_str(ctx_tgt, id));
+    }
+    printf("\n\n");
+
+    fprintf(stderr, "%s: speculative: %4d tokens in %6.2f s, %6.2f t/s, drafted %d, accepted %d (%.1f%%)\n", __func__,
+            (int) out_spec.size(), t_spec, out_spec.size()/t_spec, n_drafted, n_accepted, n_drafted ? 100.0*n_accepted/n_drafted : 0.0);
+    fprintf(stderr, "%s: plain:       %4d tokens in %6.2f s, %6.2f t/s\n", __func__,
+            (int) out_plain.size(), t_plain, out_plain.size()/t_plain);
+    fprintf(stderr, "%s: speedup %.2fx, same output as plain decoding: %s\n", __func__,
+            (t_plain/out_plain.size())/(t_spec/out_spec.size()), out_spec == out_plain ? "yes" : "no");
+
+    llama_free(ctx_dft);
+    llama_free(ctx_tgt);
+
+    return 0;
+}
@@ -71,6 +71,50 @@ static int sched_yield (void) {
     Sleep (0);
     return 0;
 }
+
+typedef CRITICAL_SECTION   pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+
+static int pthread_mutex_init(pthread_mutex_t * mutex, void * unused) {
+    (void) unused;
+    InitializeCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_mutex_destroy(pthread_mutex_t * mutex) {
+    DeleteCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_mutex_lock(pthread_mutex_t * mutex) {
+    EnterCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_mutex_unlock(pthread_mutex_t * mutex) {
+    LeaveCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_cond_init(pthread_cond_t * cond, void * unused) {
+    (void) unused;
+    InitializeConditionVariable(cond);
+    return 0;
+}
+
+static int pthread_cond_destroy(pthread_cond_t * cond) {
+    (void) cond;
+    return 0;
+}
+
+static int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex) {
+    return SleepConditionVariableCS(cond, mutex, INFINITE) ? 0 : EINVAL;
+}
+
+static int pthread_cond_broadcast(pthread_cond_t * cond) {
+    WakeAllConditionVariable(cond);
+    return 0;
+}
 #else
 #include <pthread.h>
 #include <stdatomic.h>
@@ -78,6 +122,13 @@ static int sched_yield (void) {
 typedef void* thread_ret_t;
 #endif
 
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#endif
+
 // __FMA__ and __F16C__ are not defined in MSVC, however they are implied with AVX2/AVX512
 #if defined(_MSC_VER) && (defined(__AVX2__) || defined(__AVX512F__))
 #ifndef __FMA__
@@ -102,6 +153,30 @@ typedef void* thread_ret_t;
 
 #define GGML_SOFT_MAX_UNROLL 4
 #define GGML_VEC_DOT_UNROLL  2
+#define GGML_VEC_DOT_Q_UNROLL 4
+
+// tile size of the quantized mul_mat, in src0 rows and src1 columns
+// the quantized rows of one tile should fit in the L2 cache
+#define GGML_MUL_MAT_Q_BLCK_ROWS 16
+#define GGML_MUL_MAT_Q_BLCK_COLS 16
+
+// smallest number of src1 columns the quantized mul_mat is tiled for, smaller batches go row by row:
+// with fewer columns than GGML_VEC_DOT_Q_UNROLL the unrolled dot products are not used and the tiles gain nothing
+#define GGML_MUL_MAT_Q_TILE_MIN_COLS 4
+
+// tile size of ggml_flash_attn_ext, in queries of a head and in keys
+// the K and V rows of a block of keys should fit in the L2 cache, they are reused for all queries of the tile
+#define GGML_FLASH_ATTN_EXT_BLCK_Q 8
+#define GGML_FLASH_ATTN_EXT_BLCK_K 256
+
+// number of keys whose values ggml_flash_attn_ext converts to F32 at once, they should stay in the L1 cache
+#define GGML_FLASH_ATTN_EXT_BLCK_V 32
+
+// number of work chunks per thread handed out by the dynamic scheduler
+#define GGML_SCHED_CHUNKS_PER_THREAD 8
+
+// number of busy-wait iterations in a barrier before yielding the time slice
+#define GGML_BARRIER_SPIN_COUNT 1024
 
 #ifdef GGML_USE_ACCELERATE
 // uncomment to use vDSP for soft max computation
@@ -363,7 +438,20 @@ ggml_fp16_t ggml_fp32_to_fp16(float x) {
 }
 
 void ggml_fp16_to_fp32_row(const ggml_fp16_t * x, float * y, size_t n) {
-    for (size_t i = 0; i < n; i++) {
+    size_t i = 0;
+#if defined(__F16C__)
+    for (; i + 7 < n; i += 8) {
+        __m128i x_vec = _mm_loadu_si128((const __m128i *)(x + i));
+        __m256 y_vec = _mm256_cvtph_ps(x_vec);
+        _mm256_storeu_ps(y + i, y_vec);
+    }
+    for (; i + 3 < n; i += 4) {
+        __m128i x_vec = _mm_loadl_epi64((const __m128i *)(x + i));
+        __m128 y_vec = _mm_cvtph_ps(x_vec);
+        _mm_storeu_ps(y + i, y_vec);
+    }
+#endif
+    for (; i < n; i++) {
         y[i] = GGML_FP16_TO_FP32(x[i]);
     }
 }
@@ -550,12 +638,8 @@ static inline __m256 sum_i16_pairs_float(const __m256i x) {
     return _mm256_cvtepi32_ps(summed_pairs);
 }
 
-// multiply int8_t, add results pairwise twice and return as float vector
-static inline __m256 mul_sum_i8_pairs_float(const __m256i x, const __m256i y) {
-    // Get absolute values of x vectors
-    const __m256i ax = _mm256_sign_epi8(x, x);
-    // Sign the values of the y vectors
-    const __m256i sy = _mm256_sign_epi8(y, x);
+// multiply uint8_t with int8_t, add results pairwise twice and return as float vector
+static inline __m256 mul_sum_us8_pairs_float(const __m256i ax, const __m256i sy) {
 #if __AVXVNNI__
     const __m256i zero = _mm256_setzero_si256();
     const __m256i summed_pairs = _mm256_dpbusd_epi32(zero, ax, sy);
@@ -567,6 +651,15 @@ static inline __m256 mul_sum_i8_pairs_float(const __m256i x, const __m256i y) {
 #endif
 }
 
+// multiply int8_t, add results pairwise twice and return as float vector
+static inline __m256 mul_sum_i8_pairs_float(const __m256i x, const __m256i y) {
+    // Get absolute values of x vectors
+    const __m256i ax = _mm256_sign_epi8(x, x);
+    // Sign the values of the y vectors
+    const __m256i sy = _mm256_sign_epi8(y, x);
+    return mul_sum_us8_pairs_float(ax, sy);
+}
+
 static inline __m128i packNibbles( __m256i bytes )
 {
     // Move bits within 16-bit lanes from 0000_abcd_0000_efgh into 0000_0000_abcd_efgh
@@ -3689,6 +3782,225 @@ static void ggml_vec_dot_q8_0_q8_0(const int n, float * restrict s, const void *
 #endif
 }
 
+// compute the dot products of one row of x with GGML_VEC_DOT_Q_UNROLL rows of y at once
+// the unpacked x blocks are reused for all rows of y
+// by - y row stride in bytes
+// bs - s stride in floats
+typedef void (*vec_dot_q_unroll_t)(const int n, float * restrict s, const int bs, const void * restrict vx, const void * restrict vy, const size_t by);
+
+#if defined(__AVX2__)
+static void ggml_vec_dot_q4_0_q8_0_unroll(const int n, float * restrict s, const int bs, const void * restrict vx, const void * restrict vy, const size_t by) {
+    const int nb = n / QK8_0;
+
+    assert(n % QK8_0 == 0);
+
+    const block_q4_0 * restrict x = vx;
+    const block_q8_0 * restrict y[GGML_VEC_DOT_Q_UNROLL];
+
+    __m256 acc[GGML_VEC_DOT_Q_UNROLL];
+
+    for (int k = 0; k < GGML_VEC_DOT_Q_UNROLL; ++k) {
+        y[k]   = (const block_q8_0 *) ((const char *) vy + k*by);
+        acc[k] = _mm256_setzero_ps();
+    }
+
+    const __m256i off = _mm256_set1_epi8( 8 );
+
+    for (int i = 0; i < nb; ++i) {
+        const __m256 dx = _mm256_broadcast_ss( &x[i].d );
+
+        // unpack the x block once, offset it into [ -8 .. +7 ] and take the absolute values
+        const __m256i bx = _mm256_sub_epi8( bytes_from_nibbles_32(x[i].qs), off );
+        const __m256i ax = _mm256_sign_epi8(bx, bx);
+
+        for (int k = 0; k < GGML_VEC_DOT_Q_UNROLL; ++k) {
+            const __m256 d = _mm256_mul_ps( dx, _mm256_broadcast_ss( &y[k][i].d ) );
+
+            const __m256i sy = _mm256_sign_epi8(_mm256_loadu_si256((const __m256i *)y[k][i].qs), bx);
+
+            acc[k] = _mm256_fmadd_ps( d, mul_sum_us8_pairs_float(ax, sy), acc[k] );
+        }
+    }
+
+    for (int k = 0; k < GGML_VEC_DOT_Q_UNROLL; ++k) {
+        s[k*bs] = hsum_float_8(acc[k]);
+    }
+}
+
+static void ggml_vec_dot_q4_1_q8_1_unroll(const int n, float * restrict s, const int bs, const void * restrict vx, const void * restrict vy, const size_t by) {
+    const int nb = n / QK8_1;
+
+    assert(n % QK8_1 == 0);
+
+    const block_q4_1 * restrict x = vx;
+    const block_q8_1 * restrict y[GGML_VEC_DOT_Q_UNROLL];
+
+    __m256 acc[GGML_VEC_DOT_Q_UNROLL];
+    float  summs[GGML_VEC_DOT_Q_UNROLL];
+
+    for (int k = 0; k < GGML_VEC_DOT_Q_UNROLL; ++k) {
+        y[k]     = (const block_q8_1 *) ((const char *) vy + k*by);
+        acc[k]   = _mm256_setzero_ps();
+        summs[k] = 0.0f;
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        const __m256 dx = _mm256_broadcast_ss( &x[i].d );
+
+        // the x quants are in [ 0 .. 15 ], they are their own absolute values
+        const __m256i bx = bytes_from_nibbles_32(x[i].qs);
+
+        for (int k = 0; k < GGML_VEC_DOT_Q_UNROLL; ++k) {
+            summs[k] += x[i].m * (y[k][i].s0 + y[k][i].s1);
+
+            const __m256 d = _mm256_mul_ps( dx, _mm256_broadcast_ss( &y[k][i].d ) );
+
+            const __m256i sy = _mm256_sign_epi8(_mm256_loadu_si256((const __m256i *)y[k][i].qs), bx);
+
+            acc[k] = _mm256_fmadd_ps( d, mul_sum_us8_pairs_float(bx, sy), acc[k] );
+        }
+    }
+
+    for (int k = 0; k < GGML_VEC_DOT_Q_UNROLL; ++k) {
+        s[k*bs] = hsum_float_8(acc[k]) + summs[k];
+    }
+}
+
+static void ggml_vec_dot_q5_0_q8_0_unroll(const int n, float * restrict s, const int bs, const void * restrict vx, const void * restrict vy, const size_t by) {
+    const int nb = n / QK8_0;
+
+    assert(n % QK8_0 == 0);
+
+    const block_q5_0 * restrict x = vx;
+    const block_q8_0 * restrict y[GGML_VEC_DOT_Q_UNROLL];
+
+    __m256 acc[GGML_VEC_DOT_Q_UNROLL];
+
+    for (int k = 0; k < GGML_VEC_DOT_Q_UNROLL; ++k) {
+        y[k]   = (const block_q8_0 *) ((const char *) vy + k*by);
+        acc[k] = _mm256_setzero_ps();
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        const __m256 dx = _mm256_set1_ps(GGML_FP16_TO_FP32(x[i].d));
+
+        // unpack the x block once, the 5-th bit clear gives [ -16 .. -1 ], then take the absolute values
+        __m256i bx = bytes_from_nibbles_32(x[i].qs);
+        __m256i bxhi = bytes_from_bits_32(x[i].qh);
+        bxhi = _mm256_andnot_si256(bxhi, _mm256_set1_epi8((char)0xF0));
+        bx = _mm256_or_si256(bx, bxhi);
+
+        const __m256i ax = _mm256_sign_epi8(bx, bx);
+
+        for (int k = 0; k < GGML_VEC_DOT_Q_UNROLL; ++k) {
+            const __m256 d = _mm256_mul_ps( dx, _mm256_broadcast_ss( &y[k][i].d ) );
+
+            const __m256i sy = _mm256_sign_epi8(_mm256_loadu_si256((const __m256i *)y[k][i].qs), bx);
+
+            acc[k] = _mm256_fmadd_ps( d, mul_sum_us8_pairs_float(ax, sy), acc[k] );
+        }
+    }
+
+    for (int k = 0; k < GGML_VEC_DOT_Q_UNROLL; ++k) {
+        s[k*bs] = hsum_float_8(acc[k]);
+    }
+}
+
+static void ggml_vec_dot_q5_1_q8_1_unroll(const int n, float * restrict s, const int bs, const void * restrict vx, const void * restrict vy, const size_t by) {
+    const int nb = n / QK8_1;
+
+    assert(n % QK8_1 == 0);
+
+    const block_q5_1 * restrict x = vx;
+    const block_q8_1 * restrict y[GGML_VEC_DOT_Q_UNROLL];
+
+    __m256 acc[GGML_VEC_DOT_Q_UNROLL];
+    float  summs[GGML_VEC_DOT_Q_UNROLL];
+
+    for (int k = 0; k < GGML_VEC_DOT_Q_UNROLL; ++k) {
+        y[k]     = (const block_q8_1 *) ((const char *) vy + k*by);
+        acc[k]   = _mm256_setzero_ps();
+        summs[k] = 0.0f;
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        const __m256 dx = _mm256_set1_ps(GGML_FP16_TO_FP32(x[i].d));
+        const float  mx = GGML_FP16_TO_FP32(x[i].m);
+
+        // the x quants are in [ 0 .. 31 ], they are their own absolute values
+        __m256i bx = bytes_from_nibbles_32(x[i].qs);
+        __m256i bxhi = bytes_from_bits_32(x[i].qh);
+        bxhi = _mm256_and_si256(bxhi, _mm256_set1_epi8(0x10));
+        bx = _mm256_or_si256(bx, bxhi);
+
+        for (int k = 0; k < GGML_VEC_DOT_Q_UNROLL; ++k) {
+            summs[k] += mx * (y[k][i].s0 + y[k][i].s1);
+
+            const __m256 d = _mm256_mul_ps( dx, _mm256_broadcast_ss( &y[k][i].d ) );
+
+            const __m256i sy = _mm256_sign_epi8(_mm256_loadu_si256((const __m256i *)y[k][i].qs), bx);
+
+            acc[k] = _mm256_fmadd_ps( mul_sum_us8_pairs_float(bx, sy), d, acc[k] );
+        }
+    }
+
+    for (int k = 0; k < GGML_VEC_DOT_Q_UNROLL; ++k) {
+        s[k*bs] = hsum_float_8(acc[k]) + summs[k];
+    }
+}
+
+static void ggml_vec_dot_q8_0_q8_0_unroll(const int n, float * restrict s, const int bs, const void * restrict vx, const void * restrict vy, const size_t by) {
+    const int nb = n / QK8_0;
+
+    assert(n % QK8_0 == 0);
+
+    const block_q8_0 * restrict x = vx;
+    const block_q8_0 * restrict y[GGML_VEC_DOT_Q_UNROLL];
+
+    __m256 acc[GGML_VEC_DOT_Q_UNROLL];
+
+    for (int k = 0; k < GGML_VEC_DOT_Q_UNROLL; ++k) {
+        y[k]   = (const block_q8_0 *) ((const char *) vy + k*by);
+        acc[k] = _mm256_setzero_ps();
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        const __m256 dx = _mm256_broadcast_ss( &x[i].d );
+
+        const __m256i bx = _mm256_loadu_si256((const __m256i *)x[i].qs);
+        const __m256i ax = _mm256_sign_epi8(bx, bx);
+
+        for (int k = 0; k < GGML_VEC_DOT_Q_UNROLL; ++k) {
+            const __m256 d = _mm256_mul_ps( dx, _mm256_broadcast_ss( &y[k][i].d ) );
+
+            const __m256i sy = _mm256_sign_epi8(_mm256_loadu_si256((const __m256i *)y[k][i].qs), bx);
+
+            acc[k] = _mm256_fmadd_ps( d, mul_sum_us8_pairs_float(ax, sy), acc[k] );
+        }
+    }
+
+    for (int k = 0; k < GGML_VEC_DOT_Q_UNROLL; ++k) {
+        s[k*bs] = hsum_float_8(acc[k]);
+    }
+}
+#endif
+
+// types without an unrolled kernel fall back to GGML_VEC_DOT_Q_UNROLL calls of vec_dot_q
+static const vec_dot_q_unroll_t vec_dot_q_unroll[GGML_TYPE_COUNT] = {
+#if defined(__AVX2__)
+    [GGML_TYPE_Q4_0] = ggml_vec_dot_q4_0_q8_0_unroll,
+    [GGML_TYPE_Q4_1] = ggml_vec_dot_q4_1_q8_1_unroll,
+    [GGML_TYPE_Q5_0] = ggml_vec_dot_q5_0_q8_0_unroll,
+    [GGML_TYPE_Q5_1] = ggml_vec_dot_q5_1_q8_1_unroll,
+    [GGML_TYPE_Q8_0] = ggml_vec_dot_q8_0_q8_0_unroll,
+#endif
+};
+
+// the quantized mul_mat is computed in tiles with the unrolled dot products for batches of ne11 columns
+static inline bool ggml_mul_mat_q_tiled(int64_t ne11) {
+    return ne11 >= GGML_MUL_MAT_Q_TILE_MIN_COLS;
+}
+
 // compute GGML_VEC_DOT_UNROLL dot products at once
 // xs - x row stride in bytes
 inline static void ggml_vec_dot_f16_unroll(const int n, const int xs, float * restrict s, void * restrict xv, ggml_fp16_t * restrict y) {
@@ -3775,6 +4087,47 @@ inline static void ggml_vec_mad_f32(const int n, float * restrict y, const float
 #endif
 }
 
+// y += sum of the nr contiguous rows of x weighted by v, each part of y is loaded and stored once
+inline static void ggml_vec_mad_rows_f32(const int n, const int nr, float * restrict y, const float * restrict x, const float * restrict v) {
+#if defined(GGML_SIMD)
+    const int np = (n & ~(GGML_F32_STEP - 1));
+
+    GGML_F32_VEC ay[GGML_F32_ARR];
+
+    for (int i = 0; i < np; i += GGML_F32_STEP) {
+        for (int j = 0; j < GGML_F32_ARR; j++) {
+            ay[j] = GGML_F32_VEC_LOAD(y + i + j*GGML_F32_EPR);
+        }
+
+        for (int r = 0; r < nr; ++r) {
+            const GGML_F32_VEC vx = GGML_F32_VEC_SET1(v[r]);
+
+            for (int j = 0; j < GGML_F32_ARR; j++) {
+                ay[j] = GGML_F32_VEC_FMA(ay[j], GGML_F32_VEC_LOAD(x + r*n + i + j*GGML_F32_EPR), vx);
+            }
+        }
+
+        for (int j = 0; j < GGML_F32_ARR; j++) {
+            GGML_F32_VEC_STORE(y + i + j*GGML_F32_EPR, ay[j]);
+        }
+    }
+
+    // leftovers
+    for (int r = 0; r < nr; ++r) {
+        for (int i = np; i < n; ++i) {
+            y[i] += x[r*n + i]*v[r];
+        }
+    }
+#else
+    // scalar
+    for (int r = 0; r < nr; ++r) {
+        for (int i = 0; i < n; ++i) {
+            y[i] += x[r*n + i]*v[r];
+        }
+    }
+#endif
+}
+
 //inline static void ggml_vec_scale_f32(const int n, float * y, const float   v) { for (int i = 0; i < n; ++i) y[i] *= v;          }
 inline static void ggml_vec_scale_f32(const int n, float * y, const float   v) {
 #if defined(GGML_SIMD)
@@ -3805,6 +4158,39 @@ inline static void ggml_vec_scale_f32(const int n, float * y, const float   v) {
 #endif
 }
 
+// y = (x*v)*w
+inline static void ggml_vec_scale_mul_f32(const int n, float * restrict y, const float * restrict x, const float v, const float * restrict w) {
+#if defined(GGML_SIMD)
+    const int np = (n & ~(GGML_F32_STEP - 1));
+
+    GGML_F32_VEC vx = GGML_F32_VEC_SET1(v);
+
+    GGML_F32_VEC ax[GGML_F32_ARR];
+    GGML_F32_VEC aw[GGML_F32_ARR];
+
+    for (int i = 0; i < np; i += GGML_F32_STEP) {
+        for (int j = 0; j < GGML_F32_ARR; j++) {
+            ax[j] = GGML_F32_VEC_LOAD(x + i + j*GGML_F32_EPR);
+            aw[j] = GGML_F32_VEC_LOAD(w + i + j*GGML_F32_EPR);
+            ax[j] = GGML_F32_VEC_MUL(ax[j], vx);
+            ax[j] = GGML_F32_VEC_MUL(ax[j], aw[j]);
+
+            GGML_F32_VEC_STORE(y + i + j*GGML_F32_EPR, ax[j]);
+        }
+    }
+
+    // leftovers
+    for (int i = np; i < n; ++i) {
+        y[i] = (x[i]*v)*w[i];
+    }
+#else
+    // scalar
+    for (int i = 0; i < n; ++i) {
+        y[i] = (x[i]*v)*w[i];
+    }
+#endif
+}
+
 inline static void ggml_vec_norm_f32 (const int n, float * s, const float * x) { ggml_vec_dot_f32(n, s, x, x); *s = sqrtf(*s);   }
 inline static void ggml_vec_sqr_f32  (const int n, float * y, const float * x) { for (int i = 0; i < n; ++i) y[i] = x[i]*x[i];   }
 inline static void ggml_vec_sqrt_f32 (const int n, float * y, const float * x) { for (int i = 0; i < n; ++i) y[i] = sqrtf(x[i]); }
@@ -4025,8 +4411,10 @@ static const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
     "SILU",
     "NORM",
     "RMS_NORM",
+    "RMS_NORM_MUL",
 
     "MUL_MAT",
+    "MUL_MAT_SWIGLU",
 
     "SCALE",
     "CPY",
@@ -4044,13 +4432,14 @@ static const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
     "CONV_1D_2S",
 
     "FLASH_ATTN",
+    "FLASH_ATTN_EXT",
     "FLASH_FF",
 
     "MAP_UNARY",
     "MAP_BINARY",
 };
 
-static_assert(GGML_OP_COUNT == 39, "GGML_OP_COUNT != 39");
+static_assert(GGML_OP_COUNT == 42, "GGML_OP_COUNT != 42");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -4074,8 +4463,10 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "silu(x)",
     "norm(x)",
     "rms_norm(x)",
+    "rms_norm(x)*y",
 
     "X*Y",
+    "silu(X*Z)*(Y*Z)",
 
     "x*v",
     "x-\\>y",
@@ -4093,13 +4484,14 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "conv_1d_2s(x)",
 
     "flash_attn(x)",
+    "flash_attn_ext(x)",
     "flash_ff(x)",
 
     "f(x)",
     "f(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 39, "GGML_OP_COUNT != 39");
+static_assert(GGML_OP_COUNT == 42, "GGML_OP_COUNT != 42");
 
 static_assert(sizeof(struct ggml_object)%GGML_MEM_ALIGN == 0, "ggml_object size must be a multiple of GGML_MEM_ALIGN");
 static_assert(sizeof(struct ggml_tensor)%GGML_MEM_ALIGN == 0, "ggml_tensor size must be a multiple of GGML_MEM_ALIGN");
@@ -4147,8 +4539,57 @@ struct ggml_compute_params {
     // work buffer for all threads
     size_t wsize;
     void * wdata;
+
+    // chunk counter shared by the threads [chunk_t0, chunk_t1) that run on the same NUMA node as this one
+    // (all the threads of the node if not NUMA), reset to 0 before GGML_TASK_INIT
+    atomic_int * chunk;
+    int chunk_t0, chunk_t1;
 };
 
+//
+// dynamic scheduling
+//
+// instead of assigning a fixed range of rows to each thread, a kernel can split its rows
+// into chunks and let the threads grab the next unprocessed chunk until none are left.
+// this way a slow (E-core) or preempted thread ends up processing fewer chunks instead
+// of stalling all the other threads at the barrier that follows the node
+//
+// on a NUMA system the chunks are split between the nodes in proportion to their threads, and the threads of a node
+// share the chunks of the node: the threads of a node process the same rows every time the graph is computed, so
+// the pages of the weights they touched first stay on their node
+//
+// usage in the GGML_TASK_COMPUTE phase:
+//
+//   const int dr = ggml_sched_chunk_size(nr, nth);
+//
+//   for (int ir0 = dr*ggml_sched_next_chunk(params, nr, dr); ir0 < nr; ir0 = dr*ggml_sched_next_chunk(params, nr, dr)) {
+//       const int ir1 = MIN(ir0 + dr, nr);
+//       ...
+//   }
+//
+
+// number of rows per chunk when distributing n rows over nth threads
+inline static int ggml_sched_chunk_size(int n, int nth) {
+    if (nth == 1) {
+        return MAX(n, 1);
+    }
+
+    return MAX(1, n/(nth*GGML_SCHED_CHUNKS_PER_THREAD));
+}
+
+// index of the next chunk of dr of the nr rows to process by the calling thread
+inline static int ggml_sched_next_chunk(const struct ggml_compute_params * params, int nr, int dr) {
+    const int nc = (nr + dr - 1)/dr;
+
+    // the chunks of the NUMA node of the thread
+    const int c0 = (int64_t) nc*params->chunk_t0/params->nth;
+    const int c1 = (int64_t) nc*params->chunk_t1/params->nth;
+
+    const int c = c0 + atomic_fetch_add(params->chunk, 1);
+
+    return c < c1 ? c : nc;
+}
+
 //
 // ggml state
 //
@@ -4597,6 +5038,8 @@ struct ggml_tensor * ggml_new_tensor_impl(
         /*.perf_runs    =*/ 0,
         /*.perf_cycles  =*/ 0,
         /*.perf_time_us =*/ 0,
+        /*.view_src     =*/ NULL,
+        /*.view_offs    =*/ 0,
         /*.data         =*/ (data == NULL && !ctx->no_alloc) ? (void *)(result + 1) : data,
         /*.name         =*/ { 0 },
         /*.pad          =*/ { 0 },
@@ -4665,26 +5108,36 @@ struct ggml_tensor * ggml_new_tensor_4d(
     return ggml_new_tensor(ctx, type, 4, ne);
 }
 
-struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value) {
+// the parameters of an op are set when the op is created: they are kept out of the scratch buffer, so that the
+// graph can be computed more than once, and allocated even in a context with no_alloc
+static struct ggml_tensor * ggml_new_params(
+        struct ggml_context * ctx,
+        enum   ggml_type type,
+        int64_t ne0) {
+    const bool no_alloc = ctx->no_alloc;
+
     ctx->scratch_save = ctx->scratch;
     ctx->scratch.data = NULL;
+    ctx->no_alloc     = false;
 
-    struct ggml_tensor * result = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 1);
+    struct ggml_tensor * result = ggml_new_tensor_1d(ctx, type, ne0);
 
-    ctx->scratch = ctx->scratch_save;
-
-    ggml_set_i32(result, value);
+    ctx->scratch  = ctx->scratch_save;
+    ctx->no_alloc = no_alloc;
 
     return result;
 }
 
-struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value) {
-    ctx->scratch_save = ctx->scratch;
-    ctx->scratch.data = NULL;
+struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value) {
+    struct ggml_tensor * result = ggml_new_params(ctx, GGML_TYPE_I32, 1);
+
+    ggml_set_i32(result, value);
 
-    struct ggml_tensor * result = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1);
+    return result;
+}
 
-    ctx->scratch = ctx->scratch_save;
+struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value) {
+    struct ggml_tensor * result = ggml_new_params(ctx, GGML_TYPE_F32, 1);
 
     ggml_set_f32(result, value);
 
@@ -4962,10 +5415,25 @@ void ggml_set_name(struct ggml_tensor * tensor, const char * name) {
     tensor->name[sizeof(tensor->name) - 1] = '\0';
 }
 
+// a tensor that shares the data of a, offset bytes after its start
+static struct ggml_tensor * ggml_new_view_impl(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int    n_dims,
+        const int64_t * ne,
+        size_t offset) {
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, n_dims, ne, (char *) a->data + offset);
+
+    result->view_src  = a->view_src ? a->view_src : a;
+    result->view_offs = a->view_offs + offset;
+
+    return result;
+}
+
 struct ggml_tensor * ggml_view_tensor(
         struct ggml_context * ctx,
-        const struct ggml_tensor * src) {
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, src->data);
+        struct ggml_tensor  * src) {
+    struct ggml_tensor * result = ggml_new_view_impl(ctx, src, src->n_dims, src->ne, 0);
 
     result->nb[0] = src->nb[0];
     result->nb[1] = src->nb[1];
@@ -5622,6 +6090,31 @@ struct ggml_tensor * ggml_rms_norm_inplace(
     return ggml_rms_norm_impl(ctx, a, true);
 }
 
+// ggml_rms_norm_mul
+
+struct ggml_tensor * ggml_rms_norm_mul(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b) {
+    GGML_ASSERT(ggml_is_vector(b) && b->ne[0] == a->ne[0]);
+
+    bool is_node = false;
+
+    if (a->grad || b->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = ggml_dup_tensor(ctx, a);
+
+    result->op   = GGML_OP_RMS_NORM_MUL;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0 = a;
+    result->src1 = b;
+
+    return result;
+}
+
 // ggml_mul_mat
 
 struct ggml_tensor * ggml_mul_mat(
@@ -5648,6 +6141,62 @@ struct ggml_tensor * ggml_mul_mat(
     return result;
 }
 
+// ggml_mul_mat_swiglu
+
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS) || defined(GGML_USE_CLBLAST)
+static bool ggml_compute_forward_mul_mat_use_blas(
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * dst);
+#endif
+
+// false if the product of a and c is computed by BLAS or the GPU, the fused kernel runs on the CPU only
+static bool ggml_mul_mat_swiglu_can_fuse(struct ggml_tensor * a, struct ggml_tensor * c) {
+    // the shape of a*c, for the checks of mul_mat
+    struct ggml_tensor dst = *c;
+    dst.ne[0] = a->ne[1];
+
+#if defined(GGML_USE_CUBLAS)
+    if (ggml_cuda_can_mul_mat(a, c, &dst)) {
+        return false;
+    }
+#endif
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS) || defined(GGML_USE_CLBLAST)
+    if (ggml_compute_forward_mul_mat_use_blas(a, c, &dst)) {
+        return false;
+    }
+#endif
+    UNUSED(dst);
+
+    return true;
+}
+
+struct ggml_tensor * ggml_mul_mat_swiglu(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c) {
+    GGML_ASSERT(ggml_can_mul_mat(a, c));
+    GGML_ASSERT(ggml_are_same_shape(a, b) && a->type == b->type);
+    GGML_ASSERT(!ggml_is_transposed(a) && !ggml_is_transposed(b));
+    GGML_ASSERT(a->ne[2] == 1 && a->ne[3] == 1 && c->ne[2] == 1 && c->ne[3] == 1);
+
+    if (a->grad || b->grad || c->grad || !ggml_mul_mat_swiglu_can_fuse(a, c)) {
+        return ggml_mul(ctx, ggml_silu(ctx, ggml_mul_mat(ctx, a, c)), ggml_mul_mat(ctx, b, c));
+    }
+
+    const int64_t ne[4] = { a->ne[1], c->ne[1], 1, 1 };
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, MIN(a->n_dims, c->n_dims), ne);
+
+    result->op     = GGML_OP_MUL_MAT_SWIGLU;
+    result->grad   = NULL;
+    result->src0   = a;
+    result->src1   = c;
+    result->opt[0] = b;
+
+    return result;
+}
+
 // ggml_scale
 
 struct ggml_tensor * ggml_scale_impl(
@@ -5784,7 +6333,7 @@ struct ggml_tensor * ggml_reshape(
         is_node = true;
     }
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, b->n_dims, b->ne, a->data);
+    struct ggml_tensor * result = ggml_new_view_impl(ctx, a, b->n_dims, b->ne, 0);
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -5810,7 +6359,7 @@ struct ggml_tensor * ggml_reshape_2d(
     }
 
     const int64_t ne[2] = { ne0, ne1 };
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, a->data);
+    struct ggml_tensor * result = ggml_new_view_impl(ctx, a, 2, ne, 0);
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -5837,7 +6386,7 @@ struct ggml_tensor * ggml_reshape_3d(
     }
 
     const int64_t ne[3] = { ne0, ne1, ne2 };
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 3, ne, a->data);
+    struct ggml_tensor * result = ggml_new_view_impl(ctx, a, 3, ne, 0);
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -5858,7 +6407,7 @@ struct ggml_tensor * ggml_view_1d(
         GGML_ASSERT(false); // gradient propagation is not supported
     }
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 1, &ne0, (char *) a->data + offset);
+    struct ggml_tensor * result = ggml_new_view_impl(ctx, a, 1, &ne0, offset);
 
     result->op   = GGML_OP_VIEW;
     result->grad = NULL;
@@ -5883,7 +6432,7 @@ struct ggml_tensor * ggml_view_2d(
 
     const int64_t ne[GGML_MAX_DIMS] = { ne0, ne1, 1, 1 };
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, (char *) a->data + offset);
+    struct ggml_tensor * result = ggml_new_view_impl(ctx, a, 2, ne, offset);
 
     result->nb[1] = nb1;
     result->nb[2] = result->nb[1]*ne1;
@@ -5914,7 +6463,7 @@ struct ggml_tensor * ggml_view_3d(
 
     const int64_t ne[GGML_MAX_DIMS] = { ne0, ne1, ne2, 1 };
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 3, ne, (char *) a->data + offset);
+    struct ggml_tensor * result = ggml_new_view_impl(ctx, a, 3, ne, offset);
 
     result->nb[1] = nb1;
     result->nb[2] = nb2;
@@ -6115,7 +6664,8 @@ struct ggml_tensor * ggml_rope(
     //struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
     struct ggml_tensor * result = ggml_view_tensor(ctx, a);
 
-    struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 3);
+    struct ggml_tensor * b = ggml_new_params(ctx, GGML_TYPE_I32, 3);
+
     ((int32_t *) b->data)[0] = n_past;
     ((int32_t *) b->data)[1] = n_dims;
     ((int32_t *) b->data)[2] = mode;
@@ -6129,6 +6679,25 @@ struct ggml_tensor * ggml_rope(
     return result;
 }
 
+// ggml_rope_pos
+
+struct ggml_tensor * ggml_rope_pos(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * pos,
+        int                   n_dims,
+        int                   mode) {
+    GGML_ASSERT(pos->type == GGML_TYPE_I32);
+    GGML_ASSERT(ggml_nelements(pos) == a->ne[2]);
+    GGML_ASSERT((mode & 1) == 0);
+
+    struct ggml_tensor * result = ggml_rope(ctx, a, 0, n_dims, mode);
+
+    result->opt[0] = pos;
+
+    return result;
+}
+
 // ggml_alibi
 
 struct ggml_tensor * ggml_alibi(
@@ -6148,7 +6717,7 @@ struct ggml_tensor * ggml_alibi(
     //struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
     struct ggml_tensor * result = ggml_view_tensor(ctx, a);
 
-    struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 2);
+    struct ggml_tensor * b = ggml_new_params(ctx, GGML_TYPE_I32, 2);
     ((int32_t *) b->data)[0] = n_past;
     ((int32_t *) b->data)[1] = n_head;
 
@@ -6245,6 +6814,93 @@ struct ggml_tensor * ggml_flash_attn(
     return result;
 }
 
+// ggml_flash_attn_ext
+
+struct ggml_tensor * ggml_flash_attn_ext_impl(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        struct ggml_tensor  * mask,
+        struct ggml_tensor  * blocks,
+        int                   block_size,
+        size_t                k_stride,
+        size_t                v_stride,
+        float                 scale,
+        int                   n_past) {
+    GGML_ASSERT(ggml_can_mul_mat(k, q));
+    GGML_ASSERT(q->type == GGML_TYPE_F32);
+    GGML_ASSERT(v->type == GGML_TYPE_F32 || v->type == GGML_TYPE_F16);
+    GGML_ASSERT(v->ne[0] == k->ne[0] && v->ne[1] == k->ne[1] && v->ne[2] == k->ne[2]);
+    GGML_ASSERT(q->ne[3] == 1 && k->ne[3] == 1 && v->ne[3] == 1);
+    GGML_ASSERT(k->nb[0] == GGML_TYPE_SIZE[k->type] && v->nb[0] == GGML_TYPE_SIZE[v->type]);
+    GGML_ASSERT(v->nb[1] == v->ne[0]*v->nb[0]);
+    if (mask) {
+        GGML_ASSERT(mask->type == GGML_TYPE_F32 && mask->ne[0] >= k->ne[1] && mask->ne[1] >= q->ne[1]);
+    }
+    if (blocks) {
+        // the values of BLCK_V keys are read at once, they must be in the same block
+        GGML_ASSERT(blocks->type == GGML_TYPE_I32 && ggml_nelements(blocks)*block_size >= k->ne[1]);
+        GGML_ASSERT(block_size > 0 && block_size % GGML_FLASH_ATTN_EXT_BLCK_V == 0);
+        GGML_ASSERT(k_stride <= INT32_MAX && v_stride <= INT32_MAX);
+    }
+    GGML_ASSERT(n_past >= 0);
+
+    if (q->grad || k->grad || v->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+    }
+
+    const int64_t ne[4] = { q->ne[0], q->ne[2], q->ne[1], 1 };
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, 3, ne);
+
+    struct ggml_tensor * b = ggml_new_params(ctx, GGML_TYPE_I32, 5);
+
+    ((int32_t *) b->data)[0] = n_past;
+    memcpy((int32_t *) b->data + 1, &scale, sizeof(float));
+    ((int32_t *) b->data)[2] = block_size;
+    ((int32_t *) b->data)[3] = (int32_t) k_stride;
+    ((int32_t *) b->data)[4] = (int32_t) v_stride;
+    ggml_set_name(b, "n_past, scale, blocks");
+
+    result->op     = GGML_OP_FLASH_ATTN_EXT;
+    result->grad   = NULL;
+    result->src0   = q;
+    result->src1   = k;
+    result->opt[0] = v;
+    result->opt[1] = mask;
+    result->opt[2] = b;
+    result->opt[3] = blocks;
+
+    return result;
+}
+
+struct ggml_tensor * ggml_flash_attn_ext(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        struct ggml_tensor  * mask,
+        float                 scale,
+        int                   n_past) {
+    return ggml_flash_attn_ext_impl(ctx, q, k, v, mask, NULL, 0, 0, 0, scale, n_past);
+}
+
+struct ggml_tensor * ggml_flash_attn_ext_paged(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        struct ggml_tensor  * mask,
+        struct ggml_tensor  * blocks,
+        int                   block_size,
+        size_t                k_stride,
+        size_t                v_stride,
+        float                 scale,
+        int                   n_past) {
+    GGML_ASSERT(blocks != NULL);
+    return ggml_flash_attn_ext_impl(ctx, q, k, v, mask, blocks, block_size, k_stride, v_stride, scale, n_past);
+}
+
 // ggml_flash_ff
 
 struct ggml_tensor * ggml_flash_ff(
@@ -6291,7 +6947,7 @@ struct ggml_tensor * ggml_map_unary_impl_f32(
         is_node = true;
     }
 
-    struct ggml_tensor * addr_tensor = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, sizeof(void *) / sizeof(int32_t));
+    struct ggml_tensor * addr_tensor = ggml_new_params(ctx, GGML_TYPE_I32, sizeof(void *) / sizeof(int32_t));
     *((void (**)(void))addr_tensor->data) = (void (*)(void))fun;
     struct ggml_tensor *result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
 
@@ -6333,7 +6989,7 @@ struct ggml_tensor * ggml_map_binary_impl_f32(
         is_node = true;
     }
 
-    struct ggml_tensor * addr_tensor = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, sizeof(void *) / sizeof(int32_t));
+    struct ggml_tensor * addr_tensor = ggml_new_params(ctx, GGML_TYPE_I32, sizeof(void *) / sizeof(int32_t));
     *((void (**)(void))addr_tensor->data) = (void (*)(void))fun;
     struct ggml_tensor *result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
 
@@ -6969,10 +7625,65 @@ static void ggml_compute_forward_dup_f32(
     }
 }
 
+// copy of quantized rows into a tensor of the same type (e.g. a quantized KV cache slice)
+static void ggml_compute_forward_dup_q(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_nelements(dst) == ggml_nelements(src0));
+    GGML_ASSERT(src0->type == dst->type);
+    GGML_ASSERT(src0->ne[0] == dst->ne[0]);
+    GGML_ASSERT(src0->nb[0] == GGML_TYPE_SIZE[src0->type] && dst->nb[0] == GGML_TYPE_SIZE[dst->type]);
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int64_t ne00 = src0->ne[0];
+    const int64_t ne01 = src0->ne[1];
+    const int64_t ne02 = src0->ne[2];
+    const int64_t ne03 = src0->ne[3];
+
+    const size_t nb01 = src0->nb[1];
+    const size_t nb02 = src0->nb[2];
+    const size_t nb03 = src0->nb[3];
+
+    const size_t nb1 = dst->nb[1];
+    const size_t nb2 = dst->nb[2];
+    const size_t nb3 = dst->nb[3];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    // parallelize by rows
+    const int nr = ne01;
+    const int dr = (nr + nth - 1) / nth;
+    const int ir0 = dr * ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    const size_t rs = ne00*GGML_TYPE_SIZE[src0->type]/GGML_BLCK_SIZE[src0->type];
+
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = ir0; i01 < ir1; i01++) {
+                memcpy(
+                    ((char *)  dst->data + i01*nb1  + i02*nb2  + i03*nb3),
+                    ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03),
+                    rs);
+            }
+        }
+    }
+}
+
 static void ggml_compute_forward_dup(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
+    if (ggml_is_quantized(src0->type)) {
+        ggml_compute_forward_dup_q(params, src0, dst);
+        return;
+    }
+
     switch (src0->type) {
         case GGML_TYPE_F16:
             {
@@ -8184,6 +8895,83 @@ static void ggml_compute_forward_rms_norm(
     }
 }
 
+// ggml_compute_forward_rms_norm_mul
+
+static void ggml_compute_forward_rms_norm_mul_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(src1->ne[0] == src0->ne[0]);
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+    GGML_ASSERT(src1->nb[0] == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t ne00 = src0->ne[0];
+    const int64_t ne01 = src0->ne[1];
+    const int64_t ne02 = src0->ne[2];
+    const int64_t ne03 = src0->ne[3];
+
+    const size_t nb01 = src0->nb[1];
+    const size_t nb02 = src0->nb[2];
+    const size_t nb03 = src0->nb[3];
+
+    const size_t nb1 = dst->nb[1];
+    const size_t nb2 = dst->nb[2];
+    const size_t nb3 = dst->nb[3];
+
+    const float eps = 1e-6f; // TODO: make this a parameter
+
+    const float * w = (float *) src1->data;
+
+    // the rows are split over the threads, the weights are broadcast to every row
+    const int64_t nr = ne01*ne02*ne03;
+
+    for (int64_t ir = ith; ir < nr; ir += nth) {
+        const int64_t i03 = ir/(ne02*ne01);
+        const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+
+        ggml_float sum = 0.0;
+        for (int64_t i00 = 0; i00 < ne00; i00++) {
+            sum += (ggml_float)(x[i00] * x[i00]);
+        }
+
+        const float mean = sum/ne00;
+
+        float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+
+        ggml_vec_scale_mul_f32(ne00, y, x, 1.0f/sqrtf(mean + eps), w);
+    }
+}
+
+static void ggml_compute_forward_rms_norm_mul(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_rms_norm_mul_f32(params, src0, src1, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 
 // ggml_compute_forward_mul_mat
 
@@ -8193,7 +8981,7 @@ static void ggml_compute_forward_rms_norm(
 static bool ggml_compute_forward_mul_mat_use_blas(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
-              struct ggml_tensor * dst) {
+        const struct ggml_tensor * dst) {
     //const int64_t ne00 = src0->ne[0];
     //const int64_t ne01 = src0->ne[1];
 
@@ -8259,7 +9047,6 @@ static void ggml_compute_forward_mul_mat_f32(
     const int nb2  = dst->nb[2];
     const int nb3  = dst->nb[3];
 
-    const int ith = params->ith;
     const int nth = params->nth;
 
     assert(ne02 == ne12);
@@ -8350,35 +9137,35 @@ static void ggml_compute_forward_mul_mat_f32(
     // total rows in src0
     const int nr = ne01*ne02*ne03;
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    // rows per chunk
+    const int dr = ggml_sched_chunk_size(nr, nth);
 
-    for (int ir = ir0; ir < ir1; ++ir) {
-        // src0 indices
-        const int i03 = ir/(ne02*ne01);
-        const int i02 = (ir - i03*ne02*ne01)/ne01;
-        const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+    for (int ir0 = dr*ggml_sched_next_chunk(params, nr, dr); ir0 < nr; ir0 = dr*ggml_sched_next_chunk(params, nr, dr)) {
+        const int ir1 = MIN(ir0 + dr, nr);
 
-        for (int64_t ic = 0; ic < ne11; ++ic) {
-            // src1 indices
-            const int i13 = i03;
-            const int i12 = i02;
-            const int i11 = ic;
+        for (int ir = ir0; ir < ir1; ++ir) {
+            // src0 indices
+            const int i03 = ir/(ne02*ne01);
+            const int i02 = (ir - i03*ne02*ne01)/ne01;
+            const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
 
-            // dst indices
-            const int i0 = i01;
-            const int i1 = i11;
-            const int i2 = i02;
-            const int i3 = i03;
+            for (int64_t ic = 0; ic < ne11; ++ic) {
+                // src1 indices
+                const int i13 = i03;
+                const int i12 = i02;
+                const int i11 = ic;
 
-            ggml_vec_dot_f32(ne00,
-                    (float *) ((char *)  dst->data + (i0*nb0 + i1*nb1 + i2*nb2 + i3*nb3)),
-                    (float *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03)),
-                    (float *) ((char *) src1->data + (i11*nb11 + i12*nb12 + i13*nb13)));
+                // dst indices
+                const int i0 = i01;
+                const int i1 = i11;
+                const int i2 = i02;
+                const int i3 = i03;
+
+                ggml_vec_dot_f32(ne00,
+                        (float *) ((char *)  dst->data + (i0*nb0 + i1*nb1 + i2*nb2 + i3*nb3)),
+                        (float *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03)),
+                        (float *) ((char *) src1->data + (i11*nb11 + i12*nb12 + i13*nb13)));
+            }
         }
     }
 
@@ -8537,18 +9324,26 @@ static void ggml_compute_forward_mul_mat_f16_f32(
     if (params->type == GGML_TASK_INIT) {
         ggml_fp16_t * const wdata = params->wdata;
 
-        size_t id = 0;
-        for (int64_t i13 = 0; i13 < ne13; ++i13) {
-            for (int64_t i12 = 0; i12 < ne12; ++i12) {
-                for (int64_t i11 = 0; i11 < ne11; ++i11) {
-                    for (int64_t i10 = 0; i10 < ne10; ++i10) {
-                        wdata[id++] = GGML_FP32_TO_FP16(*(float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11 + i10*nb10));
-                    }
-                }
+        // convert src1 to fp16, the rows are split between the threads (see ggml_compute_forward_mul_mat_parallel_init)
+        const int64_t nr1 = ne11*ne12*ne13;
+        const int64_t dr1 = (nr1 + nth - 1)/nth;
+
+        const int64_t ir10 = dr1*ith;
+        const int64_t ir11 = MIN(ir10 + dr1, nr1);
+
+        for (int64_t ir1 = ir10; ir1 < ir11; ++ir1) {
+            const int64_t i13 = ir1/(ne12*ne11);
+            const int64_t i12 = (ir1 - i13*ne12*ne11)/ne11;
+            const int64_t i11 = (ir1 - i13*ne12*ne11 - i12*ne11);
+
+            ggml_fp16_t * dst_row = wdata + ir1*ne10;
+
+            for (int64_t i10 = 0; i10 < ne10; ++i10) {
+                dst_row[i10] = GGML_FP32_TO_FP16(*(float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11 + i10*nb10));
             }
         }
 
-        GGML_ASSERT(id*sizeof(ggml_fp16_t) <= params->wsize);
+        GGML_ASSERT(nr1*ne10*sizeof(ggml_fp16_t) <= params->wsize);
 
         return;
     }
@@ -8566,35 +9361,35 @@ static void ggml_compute_forward_mul_mat_f16_f32(
     // total rows in src0
     const int nr = ne01*ne02*ne03;
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    // rows per chunk
+    const int dr = ggml_sched_chunk_size(nr, nth);
 
     ggml_fp16_t * wdata = params->wdata;
 
-    for (int ir = ir0; ir < ir1; ++ir) {
-        // src0 indices
-        const int i03 = ir/(ne02*ne01);
-        const int i02 = (ir - i03*ne02*ne01)/ne01;
-        const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+    for (int ir0 = dr*ggml_sched_next_chunk(params, nr, dr); ir0 < nr; ir0 = dr*ggml_sched_next_chunk(params, nr, dr)) {
+        const int ir1 = MIN(ir0 + dr, nr);
 
-        const int i13 = i03;
-        const int i12 = i02;
+        for (int ir = ir0; ir < ir1; ++ir) {
+            // src0 indices
+            const int i03 = ir/(ne02*ne01);
+            const int i02 = (ir - i03*ne02*ne01)/ne01;
+            const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
 
-        const int i0 = i01;
-        const int i2 = i02;
-        const int i3 = i03;
+            const int i13 = i03;
+            const int i12 = i02;
+
+            const int i0 = i01;
+            const int i2 = i02;
+            const int i3 = i03;
 
-        ggml_fp16_t * src0_row = (ggml_fp16_t *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
-        ggml_fp16_t * src1_col =                                wdata + (       0 + i12*ne11 + i13*ne12*ne11)*ne00;
+            ggml_fp16_t * src0_row = (ggml_fp16_t *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
+            ggml_fp16_t * src1_col =                                wdata + (       0 + i12*ne11 + i13*ne12*ne11)*ne00;
 
-        float * dst_col = (float *) ((char *) dst->data + (i0*nb0 + 0*nb1 + i2*nb2 + i3*nb3));
+            float * dst_col = (float *) ((char *) dst->data + (i0*nb0 + 0*nb1 + i2*nb2 + i3*nb3));
 
-        for (int64_t ic = 0; ic < ne11; ++ic) {
-            ggml_vec_dot_f16(ne00, &dst_col[ic*ne0], src0_row, src1_col + ic*ne00);
+            for (int64_t ic = 0; ic < ne11; ++ic) {
+                ggml_vec_dot_f16(ne00, &dst_col[ic*ne0], src0_row, src1_col + ic*ne00);
+            }
         }
     }
 
@@ -8756,13 +9551,19 @@ static void ggml_compute_forward_mul_mat_q_f32(
         char * wdata = params->wdata;
         const size_t row_size = ne10*GGML_TYPE_SIZE[vec_dot_type]/GGML_BLCK_SIZE[vec_dot_type];
 
-        for (int64_t i13 = 0; i13 < ne13; ++i13) {
-            for (int64_t i12 = 0; i12 < ne12; ++i12) {
-                for (int64_t i11 = 0; i11 < ne11; ++i11) {
-                    quantize_row_q_dot((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11), (void *) wdata, ne10);
-                    wdata += row_size;
-                }
-            }
+        // quantize src1, the rows are split between the threads (see ggml_compute_forward_mul_mat_parallel_init)
+        const int64_t nr1 = ne11*ne12*ne13;
+        const int64_t dr1 = (nr1 + nth - 1)/nth;
+
+        const int64_t ir10 = dr1*ith;
+        const int64_t ir11 = MIN(ir10 + dr1, nr1);
+
+        for (int64_t ir1 = ir10; ir1 < ir11; ++ir1) {
+            const int64_t i13 = ir1/(ne12*ne11);
+            const int64_t i12 = (ir1 - i13*ne12*ne11)/ne11;
+            const int64_t i11 = (ir1 - i13*ne12*ne11 - i12*ne11);
+
+            quantize_row_q_dot((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11), (void *) (wdata + ir1*row_size), ne10);
         }
 
         return;
@@ -8773,42 +9574,68 @@ static void ggml_compute_forward_mul_mat_q_f32(
     }
 
     // parallelize by src0 rows using ggml_vec_dot_q
+    // for batched evaluation (ne11 >= GGML_MUL_MAT_Q_TILE_MIN_COLS) each chunk of rows is processed in tiles of
+    // GGML_MUL_MAT_Q_BLCK_ROWS x GGML_MUL_MAT_Q_BLCK_COLS, so that the quantized src0 and src1 rows are reused from
+    // the cache, smaller batches go row by row
+
+    const bool tiled = ggml_mul_mat_q_tiled(ne11);
+
+    const int     blck_rows = tiled ? GGML_MUL_MAT_Q_BLCK_ROWS : 1;
+    const int64_t blck_cols = tiled ? GGML_MUL_MAT_Q_BLCK_COLS : ne11;
+
+    vec_dot_q_unroll_t const vec_dot_q_un = tiled ? vec_dot_q_unroll[type] : NULL;
 
     // total rows in src0
     const int nr = ne01*ne02*ne03;
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    // rows per chunk
+    const int dr = ggml_sched_chunk_size(nr, nth);
 
     void * wdata = params->wdata;
     const size_t row_size = ne00*GGML_TYPE_SIZE[vec_dot_type]/GGML_BLCK_SIZE[vec_dot_type];
 
-    for (int ir = ir0; ir < ir1; ++ir) {
-        // src0 indices
-        const int i03 = ir/(ne02*ne01);
-        const int i02 = (ir - i03*ne02*ne01)/ne01;
-        const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+    assert(ne00 % 32 == 0);
 
-        const int i13 = i03;
-        const int i12 = i02;
+    for (int ir0 = dr*ggml_sched_next_chunk(params, nr, dr); ir0 < nr; ir0 = dr*ggml_sched_next_chunk(params, nr, dr)) {
+        const int ir1 = MIN(ir0 + dr, nr);
 
-        const int i0 = i01;
-        const int i2 = i02;
-        const int i3 = i03;
+        for (int iir = ir0; iir < ir1; iir += blck_rows) {
+            const int iir1 = MIN(iir + blck_rows, ir1);
 
-        void * src0_row = (void *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
-        char * src1_col =          ((char *)      wdata + (      (0 + i12*ne11 + i13*ne12*ne11)*row_size));
+            for (int64_t iic = 0; iic < ne11; iic += blck_cols) {
+                const int64_t iic1 = MIN(iic + blck_cols, ne11);
 
-        float * dst_col = (float *) ((char *) dst->data + (i0*nb0 + 0*nb1 + i2*nb2 + i3*nb3));
+                for (int ir = iir; ir < iir1; ++ir) {
+                    // src0 indices
+                    const int i03 = ir/(ne02*ne01);
+                    const int i02 = (ir - i03*ne02*ne01)/ne01;
+                    const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
 
-        assert(ne00 % 32 == 0);
+                    const int i13 = i03;
+                    const int i12 = i02;
 
-        for (int64_t ic = 0; ic < ne11; ++ic) {
-            vec_dot_q(ne00, &dst_col[ic*ne0], src0_row, (void *) (src1_col + ic*row_size));
+                    const int i0 = i01;
+                    const int i2 = i02;
+                    const int i3 = i03;
+
+                    void * src0_row = (void *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
+                    char * src1_col =          ((char *)      wdata + (      (0 + i12*ne11 + i13*ne12*ne11)*row_size));
+
+                    float * dst_col = (float *) ((char *) dst->data + (i0*nb0 + 0*nb1 + i2*nb2 + i3*nb3));
+
+                    int64_t ic = iic;
+
+                    if (vec_dot_q_un) {
+                        for (; ic + GGML_VEC_DOT_Q_UNROLL <= iic1; ic += GGML_VEC_DOT_Q_UNROLL) {
+                            vec_dot_q_un(ne00, &dst_col[ic*ne0], ne0, src0_row, (void *) (src1_col + ic*row_size), row_size);
+                        }
+                    }
+
+                    for (; ic < iic1; ++ic) {
+                        vec_dot_q(ne00, &dst_col[ic*ne0], src0_row, (void *) (src1_col + ic*row_size));
+                    }
+                }
+            }
         }
     }
 
@@ -8825,6 +9652,27 @@ static void ggml_compute_forward_mul_mat_q_f32(
     //}
 }
 
+// the GGML_TASK_INIT phase converts src1 to the vec_dot type of src0
+// for large batches this is too much work for a single thread, so it is split over all tasks of the node
+static bool ggml_compute_forward_mul_mat_parallel_init(
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * dst) {
+#if defined(GGML_USE_CUBLAS)
+    if (ggml_cuda_can_mul_mat(src0, src1, dst)) {
+        return false;
+    }
+#endif
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS) || defined(GGML_USE_CLBLAST)
+    if (ggml_compute_forward_mul_mat_use_blas(src0, src1, dst)) {
+        return false;
+    }
+#endif
+    UNUSED(dst);
+
+    return src1->type == GGML_TYPE_F32 && (src0->type == GGML_TYPE_F16 || ggml_is_quantized(src0->type));
+}
+
 static void ggml_compute_forward_mul_mat(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -8856,6 +9704,193 @@ static void ggml_compute_forward_mul_mat(
     }
 }
 
+// dot products of a row of any type with a row of floats converted to its vec_dot type
+
+// the type a row of floats is converted to for ggml_vec_dot_row, GGML_TYPE_F32 if it is used as is
+static enum ggml_type ggml_vec_dot_row_type(const enum ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_F32: return GGML_TYPE_F32;
+        case GGML_TYPE_F16: return GGML_TYPE_F16;
+        default:            return quantize_fns[type].vec_dot_type;
+    }
+}
+
+// y = x in the vec_dot type of rows of the given type
+inline static void ggml_vec_dot_row_convert(const enum ggml_type type, const int n, const float * restrict x, void * restrict y) {
+    switch (type) {
+        case GGML_TYPE_F32:
+            {
+                memcpy(y, x, n*sizeof(float));
+            } break;
+        case GGML_TYPE_F16:
+            {
+                for (int i = 0; i < n; ++i) {
+                    ((ggml_fp16_t *) y)[i] = GGML_FP32_TO_FP16(x[i]);
+                }
+            } break;
+        default:
+            {
+                quantize_fns[type].quantize_row_q_dot(x, y, n);
+            } break;
+    }
+}
+
+// s = x*y for a row x of the given type and a row y converted with ggml_vec_dot_row_convert
+inline static void ggml_vec_dot_row(const enum ggml_type type, const int n, float * restrict s, void * restrict x, void * restrict y) {
+    switch (type) {
+        case GGML_TYPE_F32: ggml_vec_dot_f32(n, s, (float *) x, (float *) y);             break;
+        case GGML_TYPE_F16: ggml_vec_dot_f16(n, s, (ggml_fp16_t *) x, (ggml_fp16_t *) y); break;
+        default:            quantize_fns[type].vec_dot_q(n, s, x, y);                     break;
+    }
+}
+
+// ggml_compute_forward_mul_mat_swiglu
+
+static void ggml_compute_forward_mul_mat_swiglu_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * opt0,
+              struct ggml_tensor * dst) {
+    const int64_t ne00 = src0->ne[0];
+    const int64_t ne01 = src0->ne[1];
+
+    const int64_t ne10 = src1->ne[0];
+    const int64_t ne11 = src1->ne[1];
+
+    const int64_t ne0  = dst->ne[0];
+
+    const size_t nb01 = src0->nb[1];
+    const size_t nb10 = src1->nb[0];
+    const size_t nb11 = src1->nb[1];
+    const size_t nb1  = dst->nb[1];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const enum ggml_type type         = src0->type;
+    const enum ggml_type vec_dot_type = ggml_vec_dot_row_type(type);
+
+    GGML_ASSERT(ne00 == ne10);
+    GGML_ASSERT(ne0  == ne01);
+    GGML_ASSERT(dst->ne[1] == ne11);
+    GGML_ASSERT(nb10 == sizeof(float));
+    GGML_ASSERT(src0->nb[0] == GGML_TYPE_SIZE[type] && opt0->nb[1] == nb01);
+    GGML_ASSERT(dst->nb[0] == sizeof(float));
+
+    // src1 in the vec_dot type of src0
+    char * wdata          = vec_dot_type == GGML_TYPE_F32 ? (char *) src1->data : (char *) params->wdata;
+    const size_t row_size = vec_dot_type == GGML_TYPE_F32 ? nb11 : ne10*GGML_TYPE_SIZE[vec_dot_type]/GGML_BLCK_SIZE[vec_dot_type];
+
+    if (params->type == GGML_TASK_INIT) {
+        if (vec_dot_type == GGML_TYPE_F32) {
+            return;
+        }
+
+        // convert src1, the rows are split between the threads (see ggml_compute_forward_mul_mat_parallel_init)
+        const int64_t dr1 = (ne11 + nth - 1)/nth;
+
+        const int64_t ir10 = dr1*ith;
+        const int64_t ir11 = MIN(ir10 + dr1, ne11);
+
+        for (int64_t i11 = ir10; i11 < ir11; ++i11) {
+            ggml_vec_dot_row_convert(type, ne10, (float *) ((char *) src1->data + i11*nb11), wdata + i11*row_size);
+        }
+
+        return;
+    }
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    // parallelize by src0 rows, row i of src0 and opt0 are multiplied with the same columns of src1 and combined
+    // the tiles and the unrolled dot products are the ones of the quantized mul_mat, so the result is the same as
+    // the one of the separate nodes
+
+    const bool tiled = ggml_mul_mat_q_tiled(ne11);
+
+    const int     blck_rows = tiled ? GGML_MUL_MAT_Q_BLCK_ROWS : 1;
+    const int64_t blck_cols = tiled ? GGML_MUL_MAT_Q_BLCK_COLS : ne11;
+
+    vec_dot_q_unroll_t const vec_dot_q_un = tiled && ggml_is_quantized(type) ? vec_dot_q_unroll[type] : NULL;
+
+    const int nr = ne01;
+    const int dr = ggml_sched_chunk_size(nr, nth);
+
+    float sa[GGML_VEC_DOT_Q_UNROLL];
+    float sb[GGML_VEC_DOT_Q_UNROLL];
+
+    for (int ir0 = dr*ggml_sched_next_chunk(params, nr, dr); ir0 < nr; ir0 = dr*ggml_sched_next_chunk(params, nr, dr)) {
+        const int ir1 = MIN(ir0 + dr, nr);
+
+        for (int iir = ir0; iir < ir1; iir += blck_rows) {
+            const int iir1 = MIN(iir + blck_rows, ir1);
+
+            for (int64_t iic = 0; iic < ne11; iic += blck_cols) {
+                const int64_t iic1 = MIN(iic + blck_cols, ne11);
+
+                for (int ir = iir; ir < iir1; ++ir) {
+                    void * src0_row = (char *) src0->data + ir*nb01;
+                    void * opt0_row = (char *) opt0->data + ir*nb01;
+
+                    float * dst_col = (float *) ((char *) dst->data + ir*sizeof(float));
+
+                    int64_t ic = iic;
+
+                    if (vec_dot_q_un) {
+                        for (; ic + GGML_VEC_DOT_Q_UNROLL <= iic1; ic += GGML_VEC_DOT_Q_UNROLL) {
+                            vec_dot_q_un(ne00, sa, 1, src0_row, (void *) (wdata + ic*row_size), row_size);
+                            vec_dot_q_un(ne00, sb, 1, opt0_row, (void *) (wdata + ic*row_size), row_size);
+
+                            ggml_vec_silu_f32(GGML_VEC_DOT_Q_UNROLL, sa, sa);
+
+                            for (int j = 0; j < GGML_VEC_DOT_Q_UNROLL; ++j) {
+                                *(float *) ((char *) dst_col + (ic + j)*nb1) = sa[j]*sb[j];
+                            }
+                        }
+                    }
+
+                    for (; ic < iic1; ++ic) {
+                        ggml_vec_dot_row(type, ne00, &sa[0], src0_row, wdata + ic*row_size);
+                        ggml_vec_dot_row(type, ne00, &sb[0], opt0_row, wdata + ic*row_size);
+
+                        ggml_vec_silu_f32(1, sa, sa);
+
+                        *(float *) ((char *) dst_col + ic*nb1) = sa[0]*sb[0];
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_mul_mat_swiglu(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * opt0,
+              struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q4_2:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
+        case GGML_TYPE_F16:
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_mul_mat_swiglu_f32(params, src0, src1, opt0, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 // ggml_compute_forward_scale
 
 static void ggml_compute_forward_scale_f32(
@@ -9422,6 +10457,9 @@ static void ggml_compute_forward_rope_f32(
     const int n_dims = ((int32_t *) src1->data)[1];
     const int mode   = ((int32_t *) src1->data)[2];
 
+    // optional per-token positions (ggml_rope_pos)
+    const int32_t * pos = dst->opt[0] ? (const int32_t *) dst->opt[0]->data : NULL;
+
     //const int64_t ne0 = src0->ne[0];
     const int64_t ne1 = src0->ne[1];
     const int64_t ne2 = src0->ne[2];
@@ -9458,7 +10496,7 @@ static void ggml_compute_forward_rope_f32(
 
     for (int64_t i3 = 0; i3 < ne3; i3++) {
         for (int64_t i2 = ((mode & 1) == 0 ? 0 : n_past); i2 < ne2; i2++) {
-            const int p = ((mode & 1) == 0 ? n_past + i2 : i2);
+            const int p = pos ? pos[i2] : ((mode & 1) == 0 ? n_past + i2 : i2);
             for (int64_t i1 = 0; i1 < ne1; i1++) {
                 if (ir++ < ir0) continue;
                 if (ir   > ir1) break;
@@ -9512,6 +10550,9 @@ static void ggml_compute_forward_rope_f16(
     const int n_dims = ((int32_t *) src1->data)[1];
     const int mode   = ((int32_t *) src1->data)[2];
 
+    // optional per-token positions (ggml_rope_pos)
+    const int32_t * pos = dst->opt[0] ? (const int32_t *) dst->opt[0]->data : NULL;
+
     //const int64_t ne0 = src0->ne[0];
     const int64_t ne1 = src0->ne[1];
     const int64_t ne2 = src0->ne[2];
@@ -9548,7 +10589,7 @@ static void ggml_compute_forward_rope_f16(
 
     for (int64_t i3 = 0; i3 < ne3; i3++) {
         for (int64_t i2 = ((mode & 1) == 0 ? 0 : n_past); i2 < ne2; i2++) {
-            const int p = ((mode & 1) == 0 ? n_past + i2 : i2);
+            const int p = pos ? pos[i2] : ((mode & 1) == 0 ? n_past + i2 : i2);
             for (int64_t i1 = 0; i1 < ne1; i1++) {
                 if (ir++ < ir0) continue;
                 if (ir   > ir1) break;
@@ -10613,98 +11654,334 @@ static void ggml_compute_forward_flash_attn(
     }
 }
 
-// ggml_compute_forward_flash_ff
+// ggml_compute_forward_flash_attn_ext
 
-static void ggml_compute_forward_flash_ff_f16(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * a,  // F16
-        const struct ggml_tensor * b0, // F16 fc_w
-        const struct ggml_tensor * b1, // F32 fc_b
-        const struct ggml_tensor * c0, // F16 proj_w
-        const struct ggml_tensor * c1, // F32 proj_b
-        struct ggml_tensor * dst) {
-    int64_t t0 = ggml_perf_time_us();
-    UNUSED(t0);
+// work buffer of a thread: the scores of a tile, the output accumulators, the running max and sum of each query,
+// the values of BLCK_V keys in F32 and the queries in the vec_dot type of k
+static size_t ggml_flash_attn_ext_wsize(int64_t D, enum ggml_type type_k) {
+    const enum ggml_type type_q = ggml_vec_dot_row_type(type_k);
 
-    const int64_t nea0 = a->ne[0];
-    const int64_t nea1 = a->ne[1];
-    const int64_t nea2 = a->ne[2];
-    const int64_t nea3 = a->ne[3];
+    size_t size = 0;
 
-    const int64_t neb00 = b0->ne[0];
-    const int64_t neb01 = b0->ne[1];
-    //const int64_t neb02 = b0->ne[2];
-    //const int64_t neb03 = b0->ne[3];
+    size += sizeof(float)*GGML_FLASH_ATTN_EXT_BLCK_Q*GGML_FLASH_ATTN_EXT_BLCK_K;
+    size += sizeof(float)*GGML_FLASH_ATTN_EXT_BLCK_Q*(D + 2);
+    size += sizeof(float)*GGML_FLASH_ATTN_EXT_BLCK_V*D;
+    size += GGML_FLASH_ATTN_EXT_BLCK_Q*D*GGML_TYPE_SIZE[type_q]/GGML_BLCK_SIZE[type_q];
 
-    const int64_t neb10 = b1->ne[0];
-    const int64_t neb11 = b1->ne[1];
-    //const int64_t neb12 = b1->ne[2];
-    //const int64_t neb13 = b1->ne[3];
+    // keep the buffers of the threads on separate cache lines
+    return (size + CACHE_LINE_SIZE - 1)/CACHE_LINE_SIZE*CACHE_LINE_SIZE;
+}
 
-    const int64_t nec00 = c0->ne[0];
-    const int64_t nec01 = c0->ne[1];
-    //const int64_t nec02 = c0->ne[2];
-    //const int64_t nec03 = c0->ne[3];
+static void ggml_compute_forward_flash_attn_ext_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        const int32_t * blocks,
+        const int block_size,
+        const size_t k_stride,
+        const size_t v_stride,
+        const int n_past,
+        const float scale,
+              struct ggml_tensor * dst) {
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
 
-    const int64_t nec10 = c1->ne[0];
-    const int64_t nec11 = c1->ne[1];
-    //const int64_t nec12 = c1->ne[2];
-    //const int64_t nec13 = c1->ne[3];
+    const int64_t D = q->ne[0];
+    const int64_t N = q->ne[1];
+    const int64_t H = q->ne[2];
+    const int64_t M = k->ne[1];
 
-    const int64_t ne0 = dst->ne[0];
-    const int64_t ne1 = dst->ne[1];
-    const int64_t ne2 = dst->ne[2];
-    //const int64_t ne3 = dst->ne[3];
+    const size_t nbq1 = q->nb[1];
+    const size_t nbq2 = q->nb[2];
+    const size_t nbk1 = k->nb[1];
+    const size_t nbk2 = k->nb[2];
+    const size_t nbv1 = v->nb[1];
+    const size_t nbv2 = v->nb[2];
+    const size_t nb1  = dst->nb[1];
+    const size_t nb2  = dst->nb[2];
 
-    const int nba0 = a->nb[0];
-    const int nba1 = a->nb[1];
-    const int nba2 = a->nb[2];
-    const int nba3 = a->nb[3];
+    const int ith = params->ith;
+    const int nth = params->nth;
 
-    const int nbb00 = b0->nb[0];
-    const int nbb01 = b0->nb[1];
-    const int nbb02 = b0->nb[2];
-    const int nbb03 = b0->nb[3];
+    const enum ggml_type type_k = k->type;
+    const enum ggml_type type_q = ggml_vec_dot_row_type(type_k);
+    const enum ggml_type type_v = v->type;
 
-    const int nbb10 = b1->nb[0];
-    //const int nbb11 = b1->nb[1];
-    //const int nbb12 = b1->nb[2];
-    //const int nbb13 = b1->nb[3];
+    const size_t q_row_size = D*GGML_TYPE_SIZE[type_q]/GGML_BLCK_SIZE[type_q];
 
-    const int nbc00 = c0->nb[0];
-    const int nbc01 = c0->nb[1];
-    const int nbc02 = c0->nb[2];
-    const int nbc03 = c0->nb[3];
+    GGML_ASSERT(q->nb[0] == sizeof(float));
+    GGML_ASSERT(dst->nb[0] == sizeof(float));
+    GGML_ASSERT(ggml_flash_attn_ext_wsize(D, type_k)*nth <= params->wsize);
 
-    const int nbc10 = c1->nb[0];
-    //const int nbc11 = c1->nb[1];
-    //const int nbc12 = c1->nb[2];
-    //const int nbc13 = c1->nb[3];
+    const int BQ = GGML_FLASH_ATTN_EXT_BLCK_Q;
+    const int BK = GGML_FLASH_ATTN_EXT_BLCK_K;
+    const int BV = GGML_FLASH_ATTN_EXT_BLCK_V;
 
-    const int nb0 = dst->nb[0];
-    const int nb1 = dst->nb[1];
-    const int nb2 = dst->nb[2];
-    const int nb3 = dst->nb[3];
+    // work buffer of this thread, see ggml_flash_attn_ext_wsize
+    char * wdata = (char *) params->wdata + ith*ggml_flash_attn_ext_wsize(D, type_k);
 
-    const int ith = params->ith;
-    const int nth = params->nth;
+    float * S    = (float *) wdata;       // [BQ][BK] scores, then probabilities
+    float * acc  = S    + BQ*BK;          // [BQ][D]  sum of the values weighted by exp(score - max)
+    float * smax = acc  + BQ*D;           // [BQ]     max of the scores so far
+    float * ssum = smax + BQ;             // [BQ]     sum of exp(score - max) so far
+    float * vf   = ssum + BQ;             // [BV][D]  values in F32
+    char  * qd   = (char *) (vf + BV*D);  // [BQ]     queries in the vec_dot type of k
 
-    const int64_t D = nea0;
-    //const int64_t N = nea1;
-    const int64_t M = neb01;
+    // the work is split in tiles of BQ queries of a head, handed out by the dynamic scheduler
+    const int64_t nqb = (N + BQ - 1)/BQ;
+    const int nr = H*nqb;
+    const int dr = ggml_sched_chunk_size(nr, nth);
 
-    GGML_ASSERT(ne0 == nea0);
-    GGML_ASSERT(ne1 == nea1);
-    GGML_ASSERT(ne2 == nea2);
+    for (int ir0 = dr*ggml_sched_next_chunk(params, nr, dr); ir0 < nr; ir0 = dr*ggml_sched_next_chunk(params, nr, dr)) {
+        const int ir1 = MIN(ir0 + dr, nr);
 
-    GGML_ASSERT(nba0  == sizeof(ggml_fp16_t));
-    GGML_ASSERT(nbb00 == sizeof(ggml_fp16_t));
-    GGML_ASSERT(nbb10 == sizeof(float));
-    GGML_ASSERT(nbc00 == sizeof(ggml_fp16_t));
-    GGML_ASSERT(nbc10 == sizeof(float));
+        for (int ir = ir0; ir < ir1; ++ir) {
+            const int64_t h  = ir/nqb;
+            const int64_t i0 = (ir - h*nqb)*BQ;
+            const int64_t nq = MIN(BQ, N - i0);
 
-    GGML_ASSERT(neb00 == D);
-    GGML_ASSERT(neb01 == M);
+            for (int64_t iq = 0; iq < nq; ++iq) {
+                ggml_vec_dot_row_convert(type_k, D, (float *) ((char *) q->data + (i0 + iq)*nbq1 + h*nbq2), qd + iq*q_row_size);
+
+                smax[iq] = -INFINITY;
+                ssum[iq] = 0.0f;
+                ggml_vec_set_f32(D, acc + iq*D, 0.0f);
+            }
+
+            // without a mask, the last query of the tile attends to the first n_past + i0 + nq keys
+            const int64_t jend = mask ? M : MIN(M, n_past + i0 + nq);
+
+            for (int64_t j0 = 0; j0 < jend; j0 += BK) {
+                const int64_t nk = MIN(BK, jend - j0);
+
+                for (int64_t iq = 0; iq < nq; ++iq) {
+                    const int64_t i = i0 + iq;
+
+                    float * s = S + iq*BK;
+
+                    const float * mrow = mask ? (float *) ((char *) mask->data + i*mask->nb[1]) + j0 : NULL;
+
+                    // the scores of the block, the masked keys are skipped
+                    float mb = -INFINITY;
+
+                    for (int64_t j = 0; j < nk; ++j) {
+                        const int64_t jk = j0 + j;
+
+                        // with a block table, row jk is row jk % block_size of the block blocks[jk / block_size]
+                        const int32_t ib = blocks ? blocks[jk/block_size] : 0;
+
+                        const bool masked = ib < 0 || (mrow ? mrow[j] == -INFINITY : jk > n_past + i);
+
+                        if (masked) {
+                            s[j] = -INFINITY;
+                            continue;
+                        }
+
+                        const size_t offs = blocks ? ib*k_stride + (jk % block_size)*nbk1 : jk*nbk1;
+
+                        ggml_vec_dot_row(type_k, D, &s[j], (char *) k->data + offs + h*nbk2, qd + iq*q_row_size);
+
+                        s[j] = s[j]*scale + (mrow ? mrow[j] : 0.0f);
+                        mb = MAX(mb, s[j]);
+                    }
+
+                    if (mb == -INFINITY) {
+                        ggml_vec_set_f32(nk, s, 0.0f);
+                        continue;
+                    }
+
+                    // online softmax: rescale what was accumulated with the previous max
+                    float * a = acc + iq*D;
+
+                    if (mb > smax[iq]) {
+                        if (smax[iq] != -INFINITY) {
+                            const float ms = expf(smax[iq] - mb);
+                            ggml_vec_scale_f32(D, a, ms);
+                            ssum[iq] *= ms;
+                        }
+                        smax[iq] = mb;
+                    }
+
+                    ggml_float sum = 0.0;
+
+                    uint16_t scvt;
+                    for (int64_t j = 0; j < nk; ++j) {
+                        if (s[j] == -INFINITY) {
+                            s[j] = 0.0f;
+                        } else {
+                            ggml_fp16_t e = GGML_FP32_TO_FP16(s[j] - smax[iq]);
+                            memcpy(&scvt, &e, sizeof(scvt));
+                            s[j] = GGML_FP16_TO_FP32(table_exp_f16[scvt]);
+                            sum += (ggml_float) s[j];
+                        }
+                    }
+
+                    ssum[iq] += (float) sum;
+                }
+
+                // acc += S*V[j0:j0 + nk], the values of the keys of a head are contiguous and read in order,
+                // BV keys at a time for all the queries of the tile
+                for (int64_t jv = 0; jv < nk; jv += BV) {
+                    const int64_t nv = MIN(BV, nk - jv);
+                    const int64_t jk = j0 + jv;
+
+                    // the BV keys are in the same block, see ggml_flash_attn_ext_impl
+                    const int32_t ib = blocks ? blocks[jk/block_size] : 0;
+
+                    if (ib < 0) {
+                        continue;
+                    }
+
+                    const size_t offs = blocks ? ib*v_stride + (jk % block_size)*nbv1 : jk*nbv1;
+
+                    const float * vb = (const float *) ((char *) v->data + offs + h*nbv2);
+                    if (type_v == GGML_TYPE_F16) {
+                        ggml_fp16_to_fp32_row((const ggml_fp16_t *) vb, vf, nv*D);
+                        vb = vf;
+                    }
+
+                    for (int64_t iq = 0; iq < nq; ++iq) {
+                        ggml_vec_mad_rows_f32(D, nv, acc + iq*D, vb, S + iq*BK + jv);
+                    }
+                }
+            }
+
+            for (int64_t iq = 0; iq < nq; ++iq) {
+                float * y = (float *) ((char *) dst->data + h*nb1 + (i0 + iq)*nb2);
+
+                memcpy(y, acc + iq*D, D*sizeof(float));
+                ggml_vec_scale_f32(D, y, ssum[iq] > 0.0f ? 1.0f/ssum[iq] : 0.0f);
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_flash_attn_ext(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        const struct ggml_tensor * opt,
+        const struct ggml_tensor * blocks,
+              struct ggml_tensor * dst) {
+    const int32_t n_past = ((int32_t *) opt->data)[0];
+
+    float scale;
+    memcpy(&scale, (int32_t *) opt->data + 1, sizeof(float));
+
+    const int32_t block_size = ((int32_t *) opt->data)[2];
+    const size_t  k_stride   = ((int32_t *) opt->data)[3];
+    const size_t  v_stride   = ((int32_t *) opt->data)[4];
+
+    switch (q->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_flash_attn_ext_f32(params, q, k, v, mask,
+                        blocks ? (const int32_t *) blocks->data : NULL, block_size, k_stride, v_stride, n_past, scale, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
+// ggml_compute_forward_flash_ff
+
+static void ggml_compute_forward_flash_ff_f16(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * a,  // F16
+        const struct ggml_tensor * b0, // F16 fc_w
+        const struct ggml_tensor * b1, // F32 fc_b
+        const struct ggml_tensor * c0, // F16 proj_w
+        const struct ggml_tensor * c1, // F32 proj_b
+        struct ggml_tensor * dst) {
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    const int64_t nea0 = a->ne[0];
+    const int64_t nea1 = a->ne[1];
+    const int64_t nea2 = a->ne[2];
+    const int64_t nea3 = a->ne[3];
+
+    const int64_t neb00 = b0->ne[0];
+    const int64_t neb01 = b0->ne[1];
+    //const int64_t neb02 = b0->ne[2];
+    //const int64_t neb03 = b0->ne[3];
+
+    const int64_t neb10 = b1->ne[0];
+    const int64_t neb11 = b1->ne[1];
+    //const int64_t neb12 = b1->ne[2];
+    //const int64_t neb13 = b1->ne[3];
+
+    const int64_t nec00 = c0->ne[0];
+    const int64_t nec01 = c0->ne[1];
+    //const int64_t nec02 = c0->ne[2];
+    //const int64_t nec03 = c0->ne[3];
+
+    const int64_t nec10 = c1->ne[0];
+    const int64_t nec11 = c1->ne[1];
+    //const int64_t nec12 = c1->ne[2];
+    //const int64_t nec13 = c1->ne[3];
+
+    const int64_t ne0 = dst->ne[0];
+    const int64_t ne1 = dst->ne[1];
+    const int64_t ne2 = dst->ne[2];
+    //const int64_t ne3 = dst->ne[3];
+
+    const int nba0 = a->nb[0];
+    const int nba1 = a->nb[1];
+    const int nba2 = a->nb[2];
+    const int nba3 = a->nb[3];
+
+    const int nbb00 = b0->nb[0];
+    const int nbb01 = b0->nb[1];
+    const int nbb02 = b0->nb[2];
+    const int nbb03 = b0->nb[3];
+
+    const int nbb10 = b1->nb[0];
+    //const int nbb11 = b1->nb[1];
+    //const int nbb12 = b1->nb[2];
+    //const int nbb13 = b1->nb[3];
+
+    const int nbc00 = c0->nb[0];
+    const int nbc01 = c0->nb[1];
+    const int nbc02 = c0->nb[2];
+    const int nbc03 = c0->nb[3];
+
+    const int nbc10 = c1->nb[0];
+    //const int nbc11 = c1->nb[1];
+    //const int nbc12 = c1->nb[2];
+    //const int nbc13 = c1->nb[3];
+
+    const int nb0 = dst->nb[0];
+    const int nb1 = dst->nb[1];
+    const int nb2 = dst->nb[2];
+    const int nb3 = dst->nb[3];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t D = nea0;
+    //const int64_t N = nea1;
+    const int64_t M = neb01;
+
+    GGML_ASSERT(ne0 == nea0);
+    GGML_ASSERT(ne1 == nea1);
+    GGML_ASSERT(ne2 == nea2);
+
+    GGML_ASSERT(nba0  == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nbb00 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nbb10 == sizeof(float));
+    GGML_ASSERT(nbc00 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nbc10 == sizeof(float));
+
+    GGML_ASSERT(neb00 == D);
+    GGML_ASSERT(neb01 == M);
     GGML_ASSERT(neb10 == M);
     GGML_ASSERT(neb11 == 1);
 
@@ -10994,10 +12271,18 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_rms_norm(params, tensor->src0, tensor);
             } break;
+        case GGML_OP_RMS_NORM_MUL:
+            {
+                ggml_compute_forward_rms_norm_mul(params, tensor->src0, tensor->src1, tensor);
+            } break;
         case GGML_OP_MUL_MAT:
             {
                 ggml_compute_forward_mul_mat(params, tensor->src0, tensor->src1, tensor);
             } break;
+        case GGML_OP_MUL_MAT_SWIGLU:
+            {
+                ggml_compute_forward_mul_mat_swiglu(params, tensor->src0, tensor->src1, tensor->opt[0], tensor);
+            } break;
         case GGML_OP_SCALE:
             {
                 ggml_compute_forward_scale(params, tensor->src0, tensor->src1, tensor);
@@ -11061,6 +12346,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
                 bool masked = t != 0;
                 ggml_compute_forward_flash_attn(params, tensor->src0, tensor->src1, tensor->opt[0], masked, tensor);
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                ggml_compute_forward_flash_attn_ext(params, tensor->src0, tensor->src1, tensor->opt[0], tensor->opt[1], tensor->opt[2], tensor->opt[3], tensor);
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 ggml_compute_forward_flash_ff(params, tensor->src0, tensor->src1, tensor->opt[0], tensor->opt[1], tensor->opt[2], tensor);
@@ -11264,6 +12553,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
+        case GGML_OP_RMS_NORM_MUL:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_MUL_MAT:
             {
                 if (src0->grad) {
@@ -11280,6 +12573,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                                 inplace);
                 }
             } break;
+        case GGML_OP_MUL_MAT_SWIGLU:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_SCALE:
             {
                 GGML_ASSERT(false); // TODO: not implemented
@@ -11336,6 +12633,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // not supported
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                GGML_ASSERT(false); // not supported
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 GGML_ASSERT(false); // not supported
@@ -11413,6 +12714,9 @@ static void ggml_build_forward_impl(struct ggml_cgraph * cgraph, struct ggml_ten
         cgraph->n_leafs = 0;
     }
 
+    // the new nodes have to be planned
+    cgraph->n_threads_planned = 0;
+
     const int n0 = cgraph->n_nodes;
     UNUSED(n0);
 
@@ -11444,6 +12748,7 @@ struct ggml_cgraph ggml_build_forward(struct ggml_tensor * tensor) {
         /*.perf_runs    =*/ 0,
         /*.perf_cycles  =*/ 0,
         /*.perf_time_us =*/ 0,
+        /*.n_threads_planned =*/ 0,
     };
 
     ggml_build_forward_impl(&result, tensor, false);
@@ -11492,7 +12797,9 @@ struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cg
 //
 // thread data
 //
-// synchronization is done via busy loops
+// the worker threads live in a ggml_threadpool that can be reused across ggml_graph_compute calls
+// idle workers sleep on a condition variable until a new graph is submitted
+// synchronization between the nodes of a graph is done via busy loops
 // I tried using spin locks, but not sure how to use them correctly - the things I tried were slower than busy loops
 //
 
@@ -11548,356 +12855,281 @@ typedef pthread_t ggml_thread_t;
 
 #endif
 
-struct ggml_compute_state_shared {
-    ggml_lock_t spin;
+typedef pthread_mutex_t ggml_mutex_t;
+typedef pthread_cond_t  ggml_cond_t;
 
-    int n_threads;
+#define ggml_mutex_init(x)  pthread_mutex_init(x, NULL)
+#define ggml_mutex_destroy  pthread_mutex_destroy
+#define ggml_mutex_lock     pthread_mutex_lock
+#define ggml_mutex_unlock   pthread_mutex_unlock
 
-    // synchronization primitives
-    atomic_int  n_ready;
-    atomic_bool has_work;
-    atomic_bool stop; // stop all threads
-};
+#define ggml_cond_init(x)   pthread_cond_init(x, NULL)
+#define ggml_cond_destroy   pthread_cond_destroy
+#define ggml_cond_wait      pthread_cond_wait
+#define ggml_cond_broadcast pthread_cond_broadcast
 
-struct ggml_compute_state {
-    ggml_thread_t thrd;
+//
+// NUMA
+//
+// on a system with several NUMA nodes, the workers of a thread pool are pinned to the CPUs of the nodes: the threads
+// of a node have consecutive indices and share the chunks of rows of the node (see ggml_sched_next_chunk)
+//
 
-    struct ggml_compute_params params;
-    struct ggml_tensor * node;
+#define GGML_NUMA_MAX_NODES 8
+#define GGML_NUMA_MAX_CPUS  512
 
-    struct ggml_compute_state_shared * shared;
+struct ggml_numa_node {
+    uint32_t id;
+    uint32_t cpus[GGML_NUMA_MAX_CPUS];
+    uint32_t n_cpus;
 };
 
-static thread_ret_t ggml_graph_compute_thread(void * data) {
-    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+static struct ggml_numa_nodes {
+    struct ggml_numa_node nodes[GGML_NUMA_MAX_NODES];
+    uint32_t n_nodes; // nodes with CPUs the process can run on, 0 before ggml_numa_init
+} g_numa;
 
-    const int n_threads = state->shared->n_threads;
+void ggml_numa_init(void) {
+    if (g_numa.n_nodes > 0) {
+        return;
+    }
 
-    while (true) {
-        if (atomic_fetch_add(&state->shared->n_ready, 1) == n_threads - 1) {
-            atomic_store(&state->shared->has_work, false);
-        } else {
-            while (atomic_load(&state->shared->has_work)) {
-                if (atomic_load(&state->shared->stop)) {
-                    return 0;
-                }
-                ggml_lock_lock  (&state->shared->spin);
-                ggml_lock_unlock(&state->shared->spin);
-            }
-        }
+#ifdef __linux__
+    struct stat st;
+    char path[256];
 
-        atomic_fetch_sub(&state->shared->n_ready, 1);
+    // the CPUs the process can run on
+    cpu_set_t cpus_allowed;
+    CPU_ZERO(&cpus_allowed);
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &cpus_allowed) != 0) {
+        CPU_ZERO(&cpus_allowed);
+    }
 
-        // wait for work
-        while (!atomic_load(&state->shared->has_work)) {
-            if (atomic_load(&state->shared->stop)) {
-                return 0;
-            }
-            ggml_lock_lock  (&state->shared->spin);
-            ggml_lock_unlock(&state->shared->spin);
+    // the node ids can have holes, and memory-only nodes have no CPUs
+    for (uint32_t id = 0; id < 64 && g_numa.n_nodes < GGML_NUMA_MAX_NODES; ++id) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u", id);
+        if (stat(path, &st) != 0) {
+            continue;
         }
 
-        // check if we should stop
-        if (atomic_load(&state->shared->stop)) {
-            break;
-        }
+        struct ggml_numa_node * node = &g_numa.nodes[g_numa.n_nodes];
 
-        if (state->node) {
-            if (state->params.ith < state->params.nth) {
-                ggml_compute_forward(&state->params, state->node);
+        node->id     = id;
+        node->n_cpus = 0;
+
+        for (uint32_t cpu = 0; cpu < GGML_NUMA_MAX_CPUS && cpu < CPU_SETSIZE; ++cpu) {
+            if (!CPU_ISSET(cpu, &cpus_allowed)) {
+                continue;
             }
 
-            state->node = NULL;
-        } else {
-            break;
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpu%u", id, cpu);
+            if (stat(path, &st) == 0) {
+                node->cpus[node->n_cpus++] = cpu;
+            }
         }
-    }
-
-    return 0;
-}
-
-void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
-    const int n_threads = cgraph->n_threads;
-
-    struct ggml_compute_state_shared state_shared = {
-        /*.spin      =*/ GGML_LOCK_INITIALIZER,
-        /*.n_threads =*/ n_threads,
-        /*.n_ready   =*/ 0,
-        /*.has_work  =*/ false,
-        /*.stop      =*/ false,
-    };
-    struct ggml_compute_state * workers = n_threads > 1 ? alloca(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
-
-    // create thread pool
-    if (n_threads > 1) {
-        ggml_lock_init(&state_shared.spin);
-
-        atomic_store(&state_shared.has_work, true);
-
-        for (int j = 0; j < n_threads - 1; j++) {
-            workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
-                .params = {
-                    .type  = GGML_TASK_COMPUTE,
-                    .ith   = j + 1,
-                    .nth   = n_threads,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                },
-                .node   = NULL,
-                .shared = &state_shared,
-            };
 
-            int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
-            GGML_ASSERT(rc == 0);
-            UNUSED(rc);
+        if (node->n_cpus > 0) {
+            g_numa.n_nodes++;
         }
     }
+#endif
 
-    // initialize tasks + work buffer
-    {
-        size_t work_size = 0;
+    if (g_numa.n_nodes == 0) {
+        g_numa.n_nodes = 1;
+    }
+}
 
-        // thread scheduling for the different operations
-        for (int i = 0; i < cgraph->n_nodes; i++) {
-            struct ggml_tensor * node = cgraph->nodes[i];
+int ggml_numa_n_nodes(void) {
+    return g_numa.n_nodes > 1 ? (int) g_numa.n_nodes : 1;
+}
 
-            switch (node->op) {
-                case GGML_OP_CPY:
-                case GGML_OP_DUP:
-                    {
-                        node->n_tasks = n_threads;
+void ggml_numa_interleave(void * addr, size_t size) {
+#if defined(__linux__) && defined(SYS_mbind)
+    if (g_numa.n_nodes < 2) {
+        return;
+    }
 
-                        size_t cur = 0;
-                        if (ggml_is_quantized(node->type)) {
-                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->ne[0] * n_threads;
-                        }
+    // the policy is set for whole pages, the pages at the ends may be shared with other data
+    const uintptr_t page_size = sysconf(_SC_PAGESIZE);
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_ADD:
-                    {
-                        node->n_tasks = n_threads;
+    const uintptr_t p0 = ((uintptr_t) addr + page_size - 1)/page_size*page_size;
+    const uintptr_t p1 = ((uintptr_t) addr + size)/page_size*page_size;
 
-                        size_t cur = 0;
+    if (p1 <= p0) {
+        return;
+    }
 
-                        if (ggml_is_quantized(node->src0->type)) {
-                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->src0->ne[0] * n_threads;
-                        }
+    unsigned long mask = 0;
+    for (uint32_t i = 0; i < g_numa.n_nodes; ++i) {
+        mask |= 1ul << g_numa.nodes[i].id;
+    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_SUB:
-                case GGML_OP_MUL:
-                case GGML_OP_DIV:
-                case GGML_OP_SQR:
-                case GGML_OP_SQRT:
-                case GGML_OP_SUM:
-                case GGML_OP_MEAN:
-                case GGML_OP_REPEAT:
-                case GGML_OP_ABS:
-                case GGML_OP_SGN:
-                case GGML_OP_NEG:
-                case GGML_OP_STEP:
-                case GGML_OP_RELU:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_GELU:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_SILU:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_NORM:
-                case GGML_OP_RMS_NORM:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_MUL_MAT:
-                    {
-                        node->n_tasks = n_threads;
-
-                        // TODO: use different scheduling for different matrix sizes
-                        //const int nr0 = ggml_nrows(node->src0);
-                        //const int nr1 = ggml_nrows(node->src1);
-
-                        //node->n_tasks = MIN(n_threads, MAX(1, nr0/128));
-                        //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks = %d\n", nr0, nr1, nr0*nr1, node->n_tasks);
-
-                        size_t cur = 0;
+    // MPOL_INTERLEAVE from linux/mempolicy.h
+    const int mode = 3;
 
-#if defined(GGML_USE_CUBLAS)
-                        if (ggml_cuda_can_mul_mat(node->src0, node->src1, node)) {
-                            node->n_tasks = 1; // TODO: this actually is doing nothing
-                                                //       the threads are still spinning
-                            cur = ggml_cuda_mul_mat_get_wsize(node->src0, node->src1, node);
-                        }
-                        else
-#endif
-                        if (node->src0->type == GGML_TYPE_F16 && node->src1->type == GGML_TYPE_F32) {
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS) || defined(GGML_USE_CLBLAST)
-                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                node->n_tasks = 1; // TODO: this actually is doing nothing
-                                                   //       the threads are still spinning
-                                // here we need memory just for single 2D matrix from src0
-                                cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
-                            } else {
-                                cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
-                            }
+    if (syscall(SYS_mbind, (void *) p0, (unsigned long) (p1 - p0), mode, &mask, 8*sizeof(mask) + 1, 0) != 0) {
+        static atomic_flag warned = ATOMIC_FLAG_INIT;
+        if (!atomic_flag_test_and_set(&warned)) {
+            fprintf(stderr, "%s: warning: mbind failed, the memory is not interleaved over the NUMA nodes: %s\n",
+                    __func__, strerror(errno));
+        }
+    }
 #else
-                            cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
-#endif
-                        } else if (node->src0->type == GGML_TYPE_F32 && node->src1->type == GGML_TYPE_F32) {
-                            cur = 0;
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS) || defined(GGML_USE_CLBLAST)
-                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                node->n_tasks = 1;
-                            }
+    UNUSED(addr);
+    UNUSED(size);
 #endif
-                        } else if (ggml_is_quantized(node->src0->type) && node->src1->type == GGML_TYPE_F32) {
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS) || defined(GGML_USE_CLBLAST)
-                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                node->n_tasks = 1;
-                                cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
-                            } else
-#endif
-                            {
-                                const enum ggml_type type_q = quantize_fns[node->src0->type].vec_dot_type;
-                                cur = GGML_TYPE_SIZE[type_q]*ggml_nelements(node->src1)/GGML_BLCK_SIZE[type_q];
-                            }
-                        } else {
-                            GGML_ASSERT(false);
-                        }
-
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_SCALE:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_CONT:
-                case GGML_OP_RESHAPE:
-                case GGML_OP_VIEW:
-                case GGML_OP_PERMUTE:
-                case GGML_OP_TRANSPOSE:
-                case GGML_OP_GET_ROWS:
-                case GGML_OP_DIAG_MASK_INF:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_SOFT_MAX:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_ROPE:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_ALIBI:
-                    {
-                        node->n_tasks = 1; //TODO
-                    } break;
-                case GGML_OP_CONV_1D_1S:
-                case GGML_OP_CONV_1D_2S:
-                    {
-                        node->n_tasks = n_threads;
-
-                        GGML_ASSERT(node->src0->ne[3] == 1);
-                        GGML_ASSERT(node->src1->ne[2] == 1);
-                        GGML_ASSERT(node->src1->ne[3] == 1);
-
-                        size_t cur = 0;
-                        const int nk = node->src0->ne[0];
-
-                        if (node->src0->type == GGML_TYPE_F16 &&
-                            node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(ggml_fp16_t)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
-                        } else if (node->src0->type == GGML_TYPE_F32 &&
-                                   node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(float)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
-                        } else {
-                            GGML_ASSERT(false);
-                        }
+}
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_ATTN:
-                    {
-                        node->n_tasks = n_threads;
+// NUMA node of the thread ith of a pool of n_threads threads spread over n_nodes nodes
+static int ggml_numa_node_of_thread(int ith, int n_threads, int n_nodes) {
+    return (int) ((int64_t) ith*n_nodes/n_threads);
+}
 
-                        size_t cur = 0;
+// first thread of a pool of n_threads threads on the NUMA node g
+static int ggml_numa_first_thread(int g, int n_threads, int n_nodes) {
+    return (int) (((int64_t) g*n_threads + n_nodes - 1)/n_nodes);
+}
 
-                        const int64_t ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
+#ifdef __linux__
+static void ggml_numa_set_cpus(const cpu_set_t * cpus) {
+    const int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), cpus);
+    if (rc != 0) {
+        static atomic_flag warned = ATOMIC_FLAG_INIT;
+        if (!atomic_flag_test_and_set(&warned)) {
+            fprintf(stderr, "%s: warning: pthread_setaffinity_np failed, the threads are not pinned to the NUMA nodes: %s\n",
+                    __func__, strerror(rc));
+        }
+    }
+}
+#endif
 
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
-                        }
+// pins the calling thread to the CPUs of the NUMA node g
+static void ggml_numa_set_affinity(int g) {
+#ifdef __linux__
+    const struct ggml_numa_node * node = &g_numa.nodes[g];
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
-                        }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (uint32_t i = 0; i < node->n_cpus; ++i) {
+        CPU_SET(node->cpus[i], &cpus);
+    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_FF:
-                    {
-                        node->n_tasks = n_threads;
+    ggml_numa_set_cpus(&cpus);
+#else
+    UNUSED(g);
+#endif
+}
 
-                        size_t cur = 0;
+// the affinity of a thread that is pinned to a NUMA node for a while
+struct ggml_numa_affinity {
+#ifdef __linux__
+    cpu_set_t cpus;
+#else
+    int unused;
+#endif
+};
 
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+// returns false if the affinity of the calling thread cannot be saved, the thread must not be pinned then
+static bool ggml_numa_affinity_save(struct ggml_numa_affinity * affinity) {
+#ifdef __linux__
+    return pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &affinity->cpus) == 0;
+#else
+    UNUSED(affinity);
+    return false;
+#endif
+}
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+static void ggml_numa_affinity_restore(const struct ggml_numa_affinity * affinity) {
+#ifdef __linux__
+    ggml_numa_set_cpus(&affinity->cpus);
+#else
+    UNUSED(affinity);
+#endif
+}
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_MAP_UNARY:
-                case GGML_OP_MAP_BINARY:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_NONE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_COUNT:
-                    {
-                        GGML_ASSERT(false);
-                    } break;
-            }
-        }
+struct ggml_compute_state {
+    ggml_thread_t thrd;
 
-        if (cgraph->work != NULL && work_size > cgraph->work_size) {
-            GGML_ASSERT(false); // TODO: better handling
-        }
+    int ith;
 
-        if (work_size > 0 && cgraph->work == NULL) {
-            cgraph->work_size = work_size + CACHE_LINE_SIZE*(n_threads - 1);
+    struct ggml_threadpool * pool;
+};
 
-            GGML_PRINT_DEBUG("%s: allocating work buffer for graph (%zu bytes)\n", __func__, cgraph->work_size);
-            cgraph->work = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, cgraph->work_size);
+struct ggml_threadpool {
+    ggml_mutex_t mutex; // protects the job fields below
+    ggml_cond_t  cond;  // signalled when a new job is submitted or the pool is stopped
+
+    int n_threads; // including the thread that calls ggml_graph_compute_pool
+    int n_nodes;   // NUMA nodes the threads are spread over, 1 if not NUMA
+
+    struct ggml_compute_state * workers; // n_threads - 1 entries
+
+    // current job
+    struct ggml_cgraph * cgraph;
+    int  n_active; // number of threads working on cgraph
+    int  n_jobs;   // incremented for every submitted graph
+    bool stop;     // stop all threads
+
+    // barrier between the nodes of the current graph
+    atomic_int n_barrier;
+    atomic_int n_barrier_passed;
+
+    // chunk counters of the current node, one per NUMA node, see ggml_sched_next_chunk
+    atomic_int chunk[GGML_NUMA_MAX_NODES];
+};
+
+static void ggml_threadpool_barrier(struct ggml_threadpool * pool, int n_active) {
+    if (n_active == 1) {
+        return;
+    }
+
+    const int n_passed = atomic_load(&pool->n_barrier_passed);
+
+    if (atomic_fetch_add(&pool->n_barrier, 1) == n_active - 1) {
+        // last thread to arrive releases the others
+        atomic_store(&pool->n_barrier, 0);
+        atomic_fetch_add(&pool->n_barrier_passed, 1);
+    } else {
+        int n_spin = 0;
+
+        while (atomic_load(&pool->n_barrier_passed) == n_passed) {
+            // busy wait - most nodes are too short to afford going to sleep
+            // but give up the time slice if the thread we are waiting for might have been preempted
+            if (++n_spin > GGML_BARRIER_SPIN_COUNT) {
+                sched_yield();
+            }
         }
     }
+}
 
-    const int64_t perf_start_cycles  = ggml_perf_cycles();
-    const int64_t perf_start_time_us = ggml_perf_time_us();
+// true if the GGML_TASK_INIT phase of the node can be split over its tasks instead of running on thread 0 only
+static bool ggml_graph_compute_node_parallel_init(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_MUL_MAT:
+            return ggml_compute_forward_mul_mat_parallel_init(node->src0, node->src1, node);
+        case GGML_OP_MUL_MAT_SWIGLU:
+            return node->src0->type != GGML_TYPE_F32;
+        default:
+            return false;
+    }
+}
+
+// executed by each of the n_active threads, ith == 0 is the calling thread
+// INIT and FINALIZE run on thread 0 only (unless the node has a parallel INIT), COMPUTE is split over node->n_tasks threads
+static void ggml_graph_compute_thread(struct ggml_threadpool * pool, struct ggml_cgraph * cgraph, int ith, int n_active) {
+    const size_t wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0;
+    void *       wdata = cgraph->work ? cgraph->work->data    : NULL;
+
+    // the threads of the NUMA node of this thread share a chunk counter
+    const int n_threads = ggml_threadpool_n_threads(pool);
+    const int n_nodes   = pool ? pool->n_nodes : 1;
+
+    const int numa_node = ggml_numa_node_of_thread(ith, n_threads, n_nodes);
+    const int chunk_t0  = ggml_numa_first_thread(numa_node,     n_threads, n_nodes);
+    const int chunk_t1  = ggml_numa_first_thread(numa_node + 1, n_threads, n_nodes);
+
+    atomic_int   chunk_single;
+    atomic_int * chunk = pool ? &pool->chunk[numa_node] : &chunk_single;
 
     for (int i = 0; i < cgraph->n_nodes; i++) {
         GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, i, cgraph->n_nodes);
@@ -11909,153 +13141,500 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
         //    continue;
         //}
 
-        const int64_t perf_node_start_cycles  = ggml_perf_cycles();
-        const int64_t perf_node_start_time_us = ggml_perf_time_us();
+        int64_t perf_node_start_cycles  = 0;
+        int64_t perf_node_start_time_us = 0;
 
-        // INIT
         struct ggml_compute_params params = {
             /*.type  =*/ GGML_TASK_INIT,
-            /*.ith   =*/ 0,
+            /*.ith   =*/ ith,
             /*.nth   =*/ node->n_tasks,
-            /*.wsize =*/ cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-            /*.wdata =*/ cgraph->work ? cgraph->work->data : NULL,
+            /*.wsize =*/ wsize,
+            /*.wdata =*/ wdata,
+            /*.chunk =*/ chunk,
+            /*.chunk_t0 =*/ chunk_t0,
+            /*.chunk_t1 =*/ MIN(chunk_t1, node->n_tasks),
         };
 
-        ggml_compute_forward(&params, node);
+        const bool parallel_init = node->n_tasks > 1 && ggml_graph_compute_node_parallel_init(node);
 
-        // COMPUTE
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
+        // INIT
+        if (ith == 0) {
+            perf_node_start_cycles  = ggml_perf_cycles();
+            perf_node_start_time_us = ggml_perf_time_us();
+
+            // the other threads are waiting at the barrier below
+            if (pool) {
+                for (int g = 0; g < n_nodes; ++g) {
+                    atomic_store(&pool->chunk[g], 0);
+                }
+            } else {
+                atomic_store(chunk, 0);
             }
+        }
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+        if (parallel_init) {
+            // the inputs of the node might still be computed by thread 0
+            ggml_threadpool_barrier(pool, n_active);
 
-            // launch thread pool
-            for (int j = 0; j < n_threads - 1; j++) {
-                workers[j].params = (struct ggml_compute_params) {
-                    .type  = GGML_TASK_COMPUTE,
-                    .ith   = j + 1,
-                    .nth   = node->n_tasks,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                };
-                workers[j].node = node;
+            if (ith < node->n_tasks) {
+                ggml_compute_forward(&params, node);
             }
+        } else if (ith == 0) {
+            ggml_compute_forward(&params, node);
+        }
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
+        // COMPUTE
+        params.type = GGML_TASK_COMPUTE;
 
-            while (atomic_load(&state_shared.n_ready) > 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
+        if (node->n_tasks > 1) {
+            ggml_threadpool_barrier(pool, n_active);
+
+            if (ith < node->n_tasks) {
+                ggml_compute_forward(&params, node);
             }
 
-            atomic_store(&state_shared.has_work, true);
+            ggml_threadpool_barrier(pool, n_active);
+        } else if (ith == 0) {
+            ggml_compute_forward(&params, node);
         }
 
-        params.type = GGML_TASK_COMPUTE;
-        ggml_compute_forward(&params, node);
+        // FINALIZE
+        if (ith == 0) {
+            params.type = GGML_TASK_FINALIZE;
+            ggml_compute_forward(&params, node);
 
-        // wait for thread pool
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
+            // performance stats (node)
+            int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_node_start_cycles;
+            int64_t perf_time_us_cur = ggml_perf_time_us() - perf_node_start_time_us;
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            node->perf_runs++;
+            node->perf_cycles  += perf_cycles_cur;
+            node->perf_time_us += perf_time_us_cur;
+        }
+    }
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
+    // the graph may be freed as soon as the calling thread returns
+    ggml_threadpool_barrier(pool, n_active);
+}
 
-            while (atomic_load(&state_shared.n_ready) != 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+static thread_ret_t ggml_threadpool_worker(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool    * pool  = state->pool;
+
+    if (pool->n_nodes > 1) {
+        ggml_numa_set_affinity(ggml_numa_node_of_thread(state->ith, pool->n_threads, pool->n_nodes));
+    }
+
+    int n_jobs_seen = 0;
+
+    while (true) {
+        ggml_mutex_lock(&pool->mutex);
+
+        // sleep until there is a new graph to compute
+        while (pool->n_jobs == n_jobs_seen && !pool->stop) {
+            ggml_cond_wait(&pool->cond, &pool->mutex);
         }
 
-        // FINALIZE
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
+        if (pool->stop) {
+            ggml_mutex_unlock(&pool->mutex);
+            break;
+        }
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+        n_jobs_seen = pool->n_jobs;
 
-            // launch thread pool
-            for (int j = 0; j < n_threads - 1; j++) {
-                workers[j].params = (struct ggml_compute_params) {
-                    .type  = GGML_TASK_FINALIZE,
-                    .ith   = j + 1,
-                    .nth   = node->n_tasks,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                };
-                workers[j].node = node;
-            }
+        struct ggml_cgraph * cgraph   = pool->cgraph;
+        const int            n_active = pool->n_active;
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
+        ggml_mutex_unlock(&pool->mutex);
 
-            while (atomic_load(&state_shared.n_ready) > 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+        if (state->ith < n_active) {
+            ggml_graph_compute_thread(pool, cgraph, state->ith, n_active);
+        }
+    }
+
+    return 0;
+}
+
+struct ggml_threadpool * ggml_threadpool_new(int n_threads) {
+    GGML_ASSERT(n_threads > 0);
+
+    struct ggml_threadpool * pool = malloc(sizeof(struct ggml_threadpool));
+    GGML_ASSERT(pool);
+
+    pool->n_threads = n_threads;
+    pool->n_nodes   = MIN(ggml_numa_n_nodes(), n_threads);
+    pool->workers   = n_threads > 1 ? malloc(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
+    pool->cgraph    = NULL;
+    pool->n_active  = 0;
+    pool->n_jobs    = 0;
+    pool->stop      = false;
+
+    atomic_store(&pool->n_barrier,        0);
+    atomic_store(&pool->n_barrier_passed, 0);
+    for (int g = 0; g < GGML_NUMA_MAX_NODES; ++g) {
+        atomic_store(&pool->chunk[g], 0);
+    }
+
+    ggml_mutex_init(&pool->mutex);
+    ggml_cond_init (&pool->cond);
+
+    for (int j = 0; j < n_threads - 1; j++) {
+        pool->workers[j] = (struct ggml_compute_state) {
+            .thrd = 0,
+            .ith  = j + 1,
+            .pool = pool,
+        };
+
+        int rc = ggml_thread_create(&pool->workers[j].thrd, NULL, ggml_threadpool_worker, &pool->workers[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    return pool;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    ggml_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    ggml_cond_broadcast(&pool->cond);
+    ggml_mutex_unlock(&pool->mutex);
+
+    for (int j = 0; j < pool->n_threads - 1; j++) {
+        int rc = ggml_thread_join(pool->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    ggml_cond_destroy (&pool->cond);
+    ggml_mutex_destroy(&pool->mutex);
+
+    free(pool->workers);
+    free(pool);
+}
+
+int ggml_threadpool_n_threads(const struct ggml_threadpool * pool) {
+    return pool ? pool->n_threads : 1;
+}
+
+// sets the number of tasks of the nodes for n_threads threads, returns the size of the work buffer they need
+static size_t ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
+    size_t work_size = 0;
+
+    // thread scheduling for the different operations
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        switch (node->op) {
+            case GGML_OP_CPY:
+            case GGML_OP_DUP:
+                {
+                    node->n_tasks = n_threads;
+
+                    size_t cur = 0;
+                    if (ggml_is_quantized(node->type)) {
+                        cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->ne[0] * n_threads;
+                    }
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_ADD:
+                {
+                    node->n_tasks = n_threads;
+
+                    size_t cur = 0;
+
+                    if (ggml_is_quantized(node->src0->type)) {
+                        cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->src0->ne[0] * n_threads;
+                    }
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_SUB:
+            case GGML_OP_MUL:
+            case GGML_OP_DIV:
+            case GGML_OP_SQR:
+            case GGML_OP_SQRT:
+            case GGML_OP_SUM:
+            case GGML_OP_MEAN:
+            case GGML_OP_REPEAT:
+            case GGML_OP_ABS:
+            case GGML_OP_SGN:
+            case GGML_OP_NEG:
+            case GGML_OP_STEP:
+            case GGML_OP_RELU:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_GELU:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_SILU:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_NORM:
+            case GGML_OP_RMS_NORM:
+            case GGML_OP_RMS_NORM_MUL:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_MUL_MAT:
+                {
+                    node->n_tasks = n_threads;
+
+                    // TODO: use different scheduling for different matrix sizes
+                    //const int nr0 = ggml_nrows(node->src0);
+                    //const int nr1 = ggml_nrows(node->src1);
+
+                    //node->n_tasks = MIN(n_threads, MAX(1, nr0/128));
+                    //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks = %d\n", nr0, nr1, nr0*nr1, node->n_tasks);
+
+                    size_t cur = 0;
+
+#if defined(GGML_USE_CUBLAS)
+                    if (ggml_cuda_can_mul_mat(node->src0, node->src1, node)) {
+                        node->n_tasks = 1; // TODO: this actually is doing nothing
+                                            //       the threads are still spinning
+                        cur = ggml_cuda_mul_mat_get_wsize(node->src0, node->src1, node);
+                    }
+                    else
+#endif
+                    if (node->src0->type == GGML_TYPE_F16 && node->src1->type == GGML_TYPE_F32) {
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS) || defined(GGML_USE_CLBLAST)
+                        if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                            node->n_tasks = 1; // TODO: this actually is doing nothing
+                                               //       the threads are still spinning
+                            // here we need memory just for single 2D matrix from src0
+                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
+                        } else {
+                            cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
+                        }
+#else
+                        cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
+#endif
+                    } else if (node->src0->type == GGML_TYPE_F32 && node->src1->type == GGML_TYPE_F32) {
+                        cur = 0;
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS) || defined(GGML_USE_CLBLAST)
+                        if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                            node->n_tasks = 1;
+                        }
+#endif
+                    } else if (ggml_is_quantized(node->src0->type) && node->src1->type == GGML_TYPE_F32) {
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS) || defined(GGML_USE_CLBLAST)
+                        if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                            node->n_tasks = 1;
+                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
+                        } else
+#endif
+                        {
+                            const enum ggml_type type_q = quantize_fns[node->src0->type].vec_dot_type;
+                            cur = GGML_TYPE_SIZE[type_q]*ggml_nelements(node->src1)/GGML_BLCK_SIZE[type_q];
+                        }
+                    } else {
+                        GGML_ASSERT(false);
+                    }
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_MUL_MAT_SWIGLU:
+                {
+                    node->n_tasks = n_threads;
 
-            atomic_store(&state_shared.has_work, true);
+                    // src1 in the vec_dot type of src0
+                    const enum ggml_type type_d = ggml_vec_dot_row_type(node->src0->type);
+
+                    size_t cur = 0;
+                    if (type_d != GGML_TYPE_F32) {
+                        cur = GGML_TYPE_SIZE[type_d]*ggml_nelements(node->src1)/GGML_BLCK_SIZE[type_d];
+                    }
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_SCALE:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_CONT:
+            case GGML_OP_RESHAPE:
+            case GGML_OP_VIEW:
+            case GGML_OP_PERMUTE:
+            case GGML_OP_TRANSPOSE:
+            case GGML_OP_GET_ROWS:
+            case GGML_OP_DIAG_MASK_INF:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_SOFT_MAX:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_ROPE:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_ALIBI:
+                {
+                    node->n_tasks = 1; //TODO
+                } break;
+            case GGML_OP_CONV_1D_1S:
+            case GGML_OP_CONV_1D_2S:
+                {
+                    node->n_tasks = n_threads;
+
+                    GGML_ASSERT(node->src0->ne[3] == 1);
+                    GGML_ASSERT(node->src1->ne[2] == 1);
+                    GGML_ASSERT(node->src1->ne[3] == 1);
+
+                    size_t cur = 0;
+                    const int nk = node->src0->ne[0];
+
+                    if (node->src0->type == GGML_TYPE_F16 &&
+                        node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(ggml_fp16_t)*(
+                                nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                                ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                                );
+                    } else if (node->src0->type == GGML_TYPE_F32 &&
+                               node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(float)*(
+                                nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                                ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                                );
+                    } else {
+                        GGML_ASSERT(false);
+                    }
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_ATTN:
+                {
+                    node->n_tasks = n_threads;
+
+                    size_t cur = 0;
+
+                    const int64_t ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
+
+                    if (node->src1->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
+                    }
+
+                    if (node->src1->type == GGML_TYPE_F16) {
+                        cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
+                    }
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_ATTN_EXT:
+                {
+                    node->n_tasks = n_threads;
+
+                    const size_t cur = ggml_flash_attn_ext_wsize(node->src0->ne[0], node->src1->type)*node->n_tasks;
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_FF:
+                {
+                    node->n_tasks = n_threads;
+
+                    size_t cur = 0;
+
+                    if (node->src1->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
+
+                    if (node->src1->type == GGML_TYPE_F16) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_MAP_UNARY:
+            case GGML_OP_MAP_BINARY:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_NONE:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_COUNT:
+                {
+                    GGML_ASSERT(false);
+                } break;
         }
+    }
 
-        params.type = GGML_TASK_FINALIZE;
-        ggml_compute_forward(&params, node);
+    return work_size > 0 ? work_size + CACHE_LINE_SIZE*(n_threads - 1) : 0;
+}
 
-        // wait for thread pool
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
+void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
+    struct ggml_threadpool * pool = cgraph->n_threads > 1 ? ggml_threadpool_new(cgraph->n_threads) : NULL;
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+    ggml_graph_compute_pool(ctx, cgraph, pool);
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
+    ggml_threadpool_free(pool);
+}
 
-            while (atomic_load(&state_shared.n_ready) != 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+void ggml_graph_compute_pool(struct ggml_context * ctx, struct ggml_cgraph * cgraph, struct ggml_threadpool * pool) {
+    const int n_threads = MAX(1, MIN(cgraph->n_threads, ggml_threadpool_n_threads(pool)));
+
+    // initialize tasks + work buffer
+    if (cgraph->n_threads_planned != n_threads) {
+        const size_t work_size = ggml_graph_plan(cgraph, n_threads);
+
+        if (cgraph->work != NULL && work_size > cgraph->work_size) {
+            GGML_ASSERT(false); // TODO: better handling
         }
 
-        // performance stats (node)
-        {
-            int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_node_start_cycles;
-            int64_t perf_time_us_cur = ggml_perf_time_us() - perf_node_start_time_us;
+        if (work_size > 0 && cgraph->work == NULL) {
+            cgraph->work_size = work_size;
 
-            node->perf_runs++;
-            node->perf_cycles  += perf_cycles_cur;
-            node->perf_time_us += perf_time_us_cur;
+            GGML_PRINT_DEBUG("%s: allocating work buffer for graph (%zu bytes)\n", __func__, cgraph->work_size);
+            cgraph->work = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, cgraph->work_size);
+
+            // the graphs allocated with ggml_graph_alloc have their work buffer for cgraph->n_threads threads
+            GGML_ASSERT(cgraph->work->data != NULL);
         }
+
+        cgraph->n_threads_planned = n_threads;
     }
 
-    // join thread pool
+    const int64_t perf_start_cycles  = ggml_perf_cycles();
+    const int64_t perf_start_time_us = ggml_perf_time_us();
+
+    // wake up the workers
     if (n_threads > 1) {
-        atomic_store(&state_shared.stop, true);
-        atomic_store(&state_shared.has_work, true);
+        ggml_mutex_lock(&pool->mutex);
+        pool->cgraph   = cgraph;
+        pool->n_active = n_threads;
+        pool->n_jobs++;
+        ggml_cond_broadcast(&pool->cond);
+        ggml_mutex_unlock(&pool->mutex);
+    }
 
-        for (int j = 0; j < n_threads - 1; j++) {
-            int rc = ggml_thread_join(workers[j].thrd, NULL);
-            GGML_ASSERT(rc == 0);
-            UNUSED(rc);
-        }
+    // the calling thread is the first thread of the first NUMA node while it computes the graph,
+    // then it gets back the affinity it had before
+    struct ggml_numa_affinity affinity;
+
+    const bool numa = pool != NULL && pool->n_nodes > 1 && ggml_numa_affinity_save(&affinity);
+
+    if (numa) {
+        ggml_numa_set_affinity(0);
+    }
+
+    ggml_graph_compute_thread(pool, cgraph, 0, n_threads);
 
-        ggml_lock_destroy(&state_shared.spin);
+    if (numa) {
+        ggml_numa_affinity_restore(&affinity);
     }
 
     // performance stats (graph)
@@ -12076,6 +13655,269 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
     }
 }
 
+size_t ggml_graph_overhead(void) {
+    // the op parameters are a few int32 at most
+    const size_t params_size = ((8*sizeof(int32_t) + GGML_MEM_ALIGN - 1)/GGML_MEM_ALIGN)*GGML_MEM_ALIGN;
+
+    // the nodes, the leafs and the work buffer
+    return (2*GGML_MAX_NODES + 1)*(GGML_OBJECT_SIZE + sizeof(struct ggml_tensor) + params_size);
+}
+
+// a tensor of the graph in the hash table of ggml_graph_alloc
+struct ggml_alloc_entry {
+    struct ggml_tensor * t;
+    int  block; // block of the data of the tensor, -1 if the data is not allocated by ggml_graph_alloc
+    bool read;  // the tensor is read by a node
+};
+
+// the data of a tensor without data and of its views
+struct ggml_alloc_block {
+    struct ggml_tensor * t;
+    size_t size;
+    size_t offs;
+    int    first; // step of the first write: 0 for a leaf, i + 1 for node i
+    int    last;  // step of the last read
+    int    next;  // next block freed at the same step
+};
+
+struct ggml_alloc_free {
+    size_t offs;
+    size_t size;
+};
+
+static struct ggml_alloc_entry * ggml_alloc_find(struct ggml_alloc_entry * hash, size_t n_hash, const struct ggml_tensor * t) {
+    size_t i = ((uintptr_t) t / GGML_MEM_ALIGN) & (n_hash - 1);
+
+    while (hash[i].t != NULL && hash[i].t != t) {
+        i = (i + 1) & (n_hash - 1);
+    }
+
+    return &hash[i];
+}
+
+// best fit among the free ranges sorted by offset, or at the end of the buffer
+static size_t ggml_alloc_range(struct ggml_alloc_free * free_list, int * n_free, size_t * top, size_t size) {
+    int best = -1;
+    for (int i = 0; i < *n_free; ++i) {
+        if (free_list[i].size >= size && (best < 0 || free_list[i].size < free_list[best].size)) {
+            best = i;
+        }
+    }
+
+    if (best < 0 && *n_free > 0 && free_list[*n_free - 1].offs + free_list[*n_free - 1].size == *top) {
+        // the last free range grows at the end of the buffer
+        best = *n_free - 1;
+        *top = free_list[best].offs + size;
+        free_list[best].size = size;
+    }
+
+    if (best < 0) {
+        const size_t offs = *top;
+        *top += size;
+        return offs;
+    }
+
+    const size_t offs = free_list[best].offs;
+
+    free_list[best].offs += size;
+    free_list[best].size -= size;
+
+    if (free_list[best].size == 0) {
+        memmove(free_list + best, free_list + best + 1, (*n_free - best - 1)*sizeof(struct ggml_alloc_free));
+        (*n_free)--;
+    }
+
+    return offs;
+}
+
+// returns a range to the free list, merged with the free ranges next to it
+static void ggml_free_range(struct ggml_alloc_free * free_list, int * n_free, size_t offs, size_t size) {
+    int i = 0;
+    while (i < *n_free && free_list[i].offs < offs) {
+        i++;
+    }
+
+    const bool merge_prev = i > 0       && free_list[i - 1].offs + free_list[i - 1].size == offs;
+    const bool merge_next = i < *n_free && offs + size == free_list[i].offs;
+
+    if (merge_prev && merge_next) {
+        free_list[i - 1].size += size + free_list[i].size;
+        memmove(free_list + i, free_list + i + 1, (*n_free - i - 1)*sizeof(struct ggml_alloc_free));
+        (*n_free)--;
+    } else if (merge_prev) {
+        free_list[i - 1].size += size;
+    } else if (merge_next) {
+        free_list[i].offs  = offs;
+        free_list[i].size += size;
+    } else {
+        memmove(free_list + i + 1, free_list + i, (*n_free - i)*sizeof(struct ggml_alloc_free));
+        free_list[i].offs = offs;
+        free_list[i].size = size;
+        (*n_free)++;
+    }
+}
+
+size_t ggml_graph_alloc(
+        struct ggml_context * ctx,
+        struct ggml_cgraph  * cgraph,
+        struct ggml_tensor ** keep,
+        int                   n_keep,
+        void                * data,
+        size_t                size) {
+    const int n_leafs = cgraph->n_leafs;
+    const int n_nodes = cgraph->n_nodes;
+    const int n       = n_leafs + n_nodes;
+
+    // the graph and the sources of its views
+    size_t n_hash = 1;
+    while (n_hash < 4*(size_t) n + 1) {
+        n_hash *= 2;
+    }
+
+    struct ggml_alloc_entry * hash      = calloc(n_hash, sizeof(struct ggml_alloc_entry));
+    struct ggml_alloc_block * blocks    = malloc(2*n*sizeof(struct ggml_alloc_block));
+    struct ggml_alloc_free  * free_list = malloc((2*n + 1)*sizeof(struct ggml_alloc_free));
+    int                     * freed     = malloc((n_nodes + 2)*sizeof(int));
+
+    int n_blocks = 0;
+
+    for (int i = 0; i < n; ++i) {
+        struct ggml_tensor * t   = i < n_leafs ? cgraph->leafs[i] : cgraph->nodes[i - n_leafs];
+        struct ggml_tensor * src = t->view_src ? t->view_src : t;
+
+        const int step = i < n_leafs ? 0 : i - n_leafs + 1;
+
+        struct ggml_alloc_entry * e_src = ggml_alloc_find(hash, n_hash, src);
+        if (e_src->t == NULL) {
+            e_src->t     = src;
+            e_src->block = -1;
+
+            if (src->data == NULL) {
+                e_src->block = n_blocks;
+
+                blocks[n_blocks++] = (struct ggml_alloc_block) {
+                    .t     = src,
+                    .size  = ((ggml_nbytes(src) + GGML_MEM_ALIGN - 1)/GGML_MEM_ALIGN)*GGML_MEM_ALIGN,
+                    .offs  = 0,
+                    .first = step,
+                    .last  = step,
+                    .next  = -1,
+                };
+            }
+        }
+
+        struct ggml_alloc_entry * e = ggml_alloc_find(hash, n_hash, t);
+        if (e->t == NULL) {
+            e->t     = t;
+            e->block = e_src->block;
+        }
+
+        if (i < n_leafs) {
+            continue;
+        }
+
+        // the sources of the node are alive until it is computed
+        struct ggml_tensor * srcs[2 + GGML_MAX_OPT] = { t->src0, t->src1 };
+        for (int j = 0; j < GGML_MAX_OPT; ++j) {
+            srcs[2 + j] = t->opt[j];
+        }
+
+        for (int j = 0; j < 2 + GGML_MAX_OPT; ++j) {
+            if (srcs[j] == NULL) {
+                continue;
+            }
+
+            struct ggml_alloc_entry * e_j = ggml_alloc_find(hash, n_hash, srcs[j]);
+            GGML_ASSERT(e_j->t == srcs[j]);
+
+            e_j->read = true;
+
+            if (e_j->block >= 0) {
+                blocks[e_j->block].last = MAX(blocks[e_j->block].last, step);
+            }
+        }
+    }
+
+    // the outputs of the graph are alive until the end
+    for (int i = 0; i < n; ++i) {
+        struct ggml_tensor * t = i < n_leafs ? cgraph->leafs[i] : cgraph->nodes[i - n_leafs];
+        struct ggml_alloc_entry * e = ggml_alloc_find(hash, n_hash, t);
+
+        if (!e->read && e->block >= 0) {
+            blocks[e->block].last = n_nodes + 1;
+        }
+    }
+
+    for (int i = 0; i < n_keep; ++i) {
+        struct ggml_alloc_entry * e = ggml_alloc_find(hash, n_hash, keep[i]);
+
+        if (e->t == keep[i] && e->block >= 0) {
+            blocks[e->block].last = n_nodes + 1;
+        }
+    }
+
+    // allocate the blocks of each step, then free the ones that are not read after it
+    for (int s = 0; s < n_nodes + 2; ++s) {
+        freed[s] = -1;
+    }
+
+    for (int b = 0; b < n_blocks; ++b) {
+        blocks[b].next = freed[blocks[b].last];
+        freed[blocks[b].last] = b;
+    }
+
+    size_t top    = 0;
+    int    n_free = 0;
+
+    for (int s = 0, b = 0; s < n_nodes + 2; ++s) {
+        for (; b < n_blocks && blocks[b].first == s; ++b) {
+            blocks[b].offs = ggml_alloc_range(free_list, &n_free, &top, blocks[b].size);
+        }
+
+        for (int f = freed[s]; f >= 0; f = blocks[f].next) {
+            ggml_free_range(free_list, &n_free, blocks[f].offs, blocks[f].size);
+        }
+    }
+
+    // the work buffer is used by every node, it is placed before the tensors
+    const int    n_threads = MAX(1, cgraph->n_threads);
+    const size_t work_size = ggml_graph_plan(cgraph, n_threads);
+    const size_t work_offs = ((work_size + GGML_MEM_ALIGN - 1)/GGML_MEM_ALIGN)*GGML_MEM_ALIGN;
+
+    const size_t size_needed = work_offs + top;
+
+    if (data != NULL && size_needed <= size) {
+        for (int b = 0; b < n_blocks; ++b) {
+            blocks[b].t->data = (char *) data + work_offs + blocks[b].offs;
+        }
+
+        for (size_t i = 0; i < n_hash; ++i) {
+            struct ggml_tensor * t = hash[i].t;
+
+            if (t != NULL && t->view_src != NULL && hash[i].block >= 0) {
+                t->data = (char *) t->view_src->data + t->view_offs;
+            }
+        }
+
+        cgraph->work      = NULL;
+        cgraph->work_size = work_size;
+
+        if (work_size > 0) {
+            const int64_t ne = work_size;
+            cgraph->work = ggml_new_tensor_impl(ctx, GGML_TYPE_I8, 1, &ne, data);
+        }
+
+        cgraph->n_threads_planned = n_threads;
+    }
+
+    free(freed);
+    free(free_list);
+    free(blocks);
+    free(hash);
+
+    return size_needed;
+}
+
 void ggml_graph_reset(struct ggml_cgraph * cgraph) {
     for (int i = 0; i < cgraph->n_nodes; i++) {
         struct ggml_tensor * grad = cgraph->grads[i];
@@ -280,8 +280,10 @@ extern "C" {
         GGML_OP_SILU,
         GGML_OP_NORM, // normalize
         GGML_OP_RMS_NORM,
+        GGML_OP_RMS_NORM_MUL,
 
         GGML_OP_MUL_MAT,
+        GGML_OP_MUL_MAT_SWIGLU,
 
         GGML_OP_SCALE,
         GGML_OP_CPY,
@@ -299,6 +301,7 @@ extern "C" {
         GGML_OP_CONV_1D_2S,
 
         GGML_OP_FLASH_ATTN,
+        GGML_OP_FLASH_ATTN_EXT,
         GGML_OP_FLASH_FF,
 
         GGML_OP_MAP_UNARY,
@@ -349,6 +352,10 @@ extern "C" {
         int64_t perf_cycles;
         int64_t perf_time_us;
 
+        // the tensor that owns the data of a view (also through other views) and the offset of the view in it
+        struct ggml_tensor * view_src;
+        size_t               view_offs;
+
         void * data;
 
         char name[32];
@@ -373,6 +380,10 @@ extern "C" {
         int     perf_runs;
         int64_t perf_cycles;
         int64_t perf_time_us;
+
+        // number of threads n_tasks and the work buffer were planned for, 0 if not planned yet
+        // a graph that is computed again with the same number of threads skips the planning
+        int n_threads_planned;
     };
 
     // scratch buffer
@@ -461,7 +472,7 @@ extern "C" {
     GGML_API struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value);
 
     GGML_API struct ggml_tensor * ggml_dup_tensor (struct ggml_context * ctx, const struct ggml_tensor * src);
-    GGML_API struct ggml_tensor * ggml_view_tensor(struct ggml_context * ctx, const struct ggml_tensor * src);
+    GGML_API struct ggml_tensor * ggml_view_tensor(struct ggml_context * ctx, struct ggml_tensor * src);
 
     GGML_API struct ggml_tensor * ggml_set_zero(struct ggml_tensor * tensor);
     GGML_API struct ggml_tensor * ggml_set_i32 (struct ggml_tensor * tensor, int32_t value);
@@ -577,6 +588,13 @@ extern "C" {
             struct ggml_context * ctx,
             struct ggml_tensor  * a);
 
+    // rms_norm(a) * b, where b is a single row of a->ne[0] weights applied to every row of a
+    // same result as ggml_mul(ggml_repeat(b, a), ggml_rms_norm(a)) in a single pass
+    GGML_API struct ggml_tensor * ggml_rms_norm_mul(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b);
+
     // A: m rows, n columns
     // B: p rows, n columns (i.e. we transpose it internally)
     // result is m columns, p rows
@@ -585,6 +603,16 @@ extern "C" {
             struct ggml_tensor  * a,
             struct ggml_tensor  * b);
 
+    // silu(a*c) * (b*c) - the gated feed-forward of LLaMA in a single pass
+    // a and b have the same shape and type, c is converted to their vec_dot type once and
+    // row i of a and row i of b are multiplied together, so no intermediate result is stored
+    // falls back to separate mul_mat, silu and mul nodes if the mul_mat would run on BLAS or the GPU
+    GGML_API struct ggml_tensor * ggml_mul_mat_swiglu(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c);
+
     //
     // operations on tensors without backpropagation
     //
@@ -697,6 +725,16 @@ extern "C" {
             int                   n_dims,
             int                   mode);
 
+    // rotary position embedding with an explicit position for each token
+    // pos is an I32 tensor with a->ne[2] elements, row i2 of a is rotated by pos[i2]
+    // in-place, returns view(a)
+    GGML_API struct ggml_tensor * ggml_rope_pos(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * pos,
+            int                   n_dims,
+            int                   mode);
+
     // alibi position embedding
     // in-place, returns view(a)
     struct ggml_tensor * ggml_alibi(
@@ -726,6 +764,39 @@ extern "C" {
             struct ggml_tensor  * v,
             bool                  masked);
 
+    // attention of N queries over M cached keys and values, softmax(scale*k*q + mask)*v, without storing the
+    // scores: the keys and values are processed in blocks with an online softmax
+    // q:    [D, N, H] F32
+    // k:    [D, M, H] F32, F16 or quantized
+    // v:    [D, M, H] F32 or F16, the values of the keys of a head are contiguous
+    // mask: [M, N] F32 or NULL - if NULL, query i attends to the keys j <= n_past + i
+    // result: [D, H, N] F32, the heads of each query are contiguous
+    GGML_API struct ggml_tensor * ggml_flash_attn_ext(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * q,
+            struct ggml_tensor  * k,
+            struct ggml_tensor  * v,
+            struct ggml_tensor  * mask,
+            float                 scale,
+            int                   n_past);
+
+    // ggml_flash_attn_ext over a paged cache: the keys and values are stored in blocks of block_size rows,
+    // row j of k and v is row j % block_size of the block blocks[j / block_size], the blocks are k_stride and v_stride
+    // bytes apart in k and v - the keys of the blocks < 0 are skipped
+    // blocks: [(M + block_size - 1)/block_size] I32, block_size is a multiple of 32
+    GGML_API struct ggml_tensor * ggml_flash_attn_ext_paged(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * q,
+            struct ggml_tensor  * k,
+            struct ggml_tensor  * v,
+            struct ggml_tensor  * mask,
+            struct ggml_tensor  * blocks,
+            int                   block_size,
+            size_t                k_stride,
+            size_t                v_stride,
+            float                 scale,
+            int                   n_past);
+
     GGML_API struct ggml_tensor * ggml_flash_ff(
             struct ggml_context * ctx,
             struct ggml_tensor  * a,
@@ -765,6 +836,50 @@ extern "C" {
     GGML_API void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph);
     GGML_API void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
+    // memory of the context needed for the tensor objects and the op parameters of a graph with GGML_MAX_NODES nodes
+    // and leafs, built in a context with no_alloc = true
+    GGML_API size_t ggml_graph_overhead(void);
+
+    // allocates the data of a graph built in a context with no_alloc = true in a single buffer of the given size:
+    // the results of the nodes and the leafs without data (the inputs, set by the caller before each compute) get an
+    // offset in the buffer, and a result reuses the memory of the results that are no longer read by the next nodes
+    //   - views and in-place results share the data of their source, which lives until the last of them is read
+    //   - the nodes that no other node reads and the tensors in keep[0..n_keep) live until the end of the graph
+    //   - the graph is planned for cgraph->n_threads threads and its work buffer is allocated in the buffer too
+    // returns the size of the buffer needed by the graph, the tensors are allocated only if it fits in size bytes
+    // (data can be NULL to only measure the graph)
+    GGML_API size_t ggml_graph_alloc(
+            struct ggml_context * ctx,
+            struct ggml_cgraph  * cgraph,
+            struct ggml_tensor ** keep,
+            int                   n_keep,
+            void                * data,
+            size_t                size);
+
+    // NUMA: detects the nodes the process can run on, the thread pools created afterwards spread their workers over
+    // the nodes and pin them to their CPUs (Linux only, no-op elsewhere, safe to call several times)
+    GGML_API void ggml_numa_init(void);
+
+    // number of NUMA nodes found by ggml_numa_init (1 if not NUMA or not initialized)
+    GGML_API int ggml_numa_n_nodes(void);
+
+    // interleaves the pages of an anonymous buffer that are not touched yet over the NUMA nodes
+    GGML_API void ggml_numa_interleave(void * addr, size_t size);
+
+    // persistent set of worker threads that can be reused across ggml_graph_compute_pool calls
+    // idle workers sleep until the next graph is submitted
+    struct ggml_threadpool;
+
+    GGML_API struct ggml_threadpool * ggml_threadpool_new (int n_threads);
+    GGML_API void                     ggml_threadpool_free(struct ggml_threadpool * pool);
+
+    // number of threads in the pool, including the calling thread (1 for a NULL pool)
+    GGML_API int ggml_threadpool_n_threads(const struct ggml_threadpool * pool);
+
+    // same as ggml_graph_compute, but runs on the workers of the given pool
+    // at most min(cgraph->n_threads, ggml_threadpool_n_threads(pool)) threads are used
+    GGML_API void ggml_graph_compute_pool(struct ggml_context * ctx, struct ggml_cgraph * cgraph, struct ggml_threadpool * pool);
+
     // print info and performance information for the graph
     GGML_API void ggml_graph_print(const struct ggml_cgraph * cgraph);
 
@@ -14,6 +14,7 @@
 
 #include <string>
 #include <vector>
+#include <algorithm>
 
 #ifdef __has_include
     #if __has_include(<unistd.h>)
@@ -66,11 +67,32 @@ static std::string format(const char * fmt, ...) {
     return std::string(buf.data(), size);
 }
 
+#if defined(_WIN32)
+static std::string llama_format_win_err(DWORD err) {
+    LPSTR buf;
+    size_t size = FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+                                 NULL, err, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&buf, 0, NULL);
+    if (!size) {
+        return "FormatMessageA failed";
+    }
+    std::string ret(buf, size);
+    LocalFree(buf);
+    return ret;
+}
+#endif
+
 struct llama_file {
     // use FILE * so we don't have to re-open the file to mmap
     FILE * fp;
     size_t size;
 
+    // read_raw_at() does not use the stream position, several threads can read the file at once
+#if defined(_WIN32) || defined(_POSIX_VERSION)
+    static constexpr bool PREAD_SUPPORTED = true;
+#else
+    static constexpr bool PREAD_SUPPORTED = false;
+#endif
+
     llama_file(const char * fname, const char * mode) {
         fp = std::fopen(fname, mode);
         if (fp == NULL) {
@@ -114,6 +136,46 @@ struct llama_file {
         }
     }
 
+    // reads size bytes at offset
+    void read_raw_at(void * ptr, size_t size, size_t offset) {
+        char * dst = (char *) ptr;
+#if defined(_WIN32)
+        HANDLE hFile = (HANDLE) _get_osfhandle(_fileno(fp));
+        while (size > 0) {
+            OVERLAPPED overlapped = {};
+            overlapped.Offset     = (DWORD) (offset & 0xFFFFFFFF);
+            overlapped.OffsetHigh = (DWORD) (offset >> 32);
+
+            DWORD n_read = 0;
+            if (!ReadFile(hFile, dst, (DWORD) std::min<size_t>(size, 1u << 30), &n_read, &overlapped)) {
+                throw format("read error: %s", llama_format_win_err(GetLastError()).c_str());
+            }
+            if (n_read == 0) {
+                throw std::string("unexpectedly reached end of file");
+            }
+            dst += n_read; offset += n_read; size -= n_read;
+        }
+#elif defined(_POSIX_VERSION)
+        int fd = fileno(fp);
+        while (size > 0) {
+            ssize_t n_read = pread(fd, dst, size, (off_t) offset);
+            if (n_read < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw format("read error: %s", strerror(errno));
+            }
+            if (n_read == 0) {
+                throw std::string("unexpectedly reached end of file");
+            }
+            dst += n_read; offset += n_read; size -= n_read;
+        }
+#else
+        seek(offset, SEEK_SET);
+        read_raw(dst, size);
+#endif
+    }
+
     std::uint32_t read_u32() {
         std::uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -148,20 +210,6 @@ struct llama_file {
     }
 };
 
-#if defined(_WIN32)
-static std::string llama_format_win_err(DWORD err) {
-    LPSTR buf;
-    size_t size = FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-                                 NULL, err, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&buf, 0, NULL);
-    if (!size) {
-        return "FormatMessageA failed";
-    }
-    std::string ret(buf, size);
-    LocalFree(buf);
-    return ret;
-}
-#endif
-
 struct llama_mmap {
     void * addr;
     size_t size;
@@ -171,18 +219,33 @@ struct llama_mmap {
 #ifdef _POSIX_MAPPED_FILES
     static constexpr bool SUPPORTED = true;
 
-    llama_mmap(struct llama_file * file, bool prefetch = true) {
+    // with numa the pages are not prefetched: each page is read in on the NUMA node of the thread that touches it first,
+    // which is a thread that computes with it if the file is not in the page cache yet
+    llama_mmap(struct llama_file * file, bool prefetch = true, bool numa = false) {
         size = file->size;
         int fd = fileno(file->fp);
         int flags = MAP_SHARED;
+        if (numa) {
+            prefetch = false;
+        }
 #ifdef __linux__
-        flags |= MAP_POPULATE;
+        if (prefetch) {
+            flags |= MAP_POPULATE;
+        }
 #endif
         addr = mmap(NULL, file->size, PROT_READ, flags, fd, 0);
         if (addr == MAP_FAILED) {
             throw format("mmap failed: %s", strerror(errno));
         }
 
+        if (numa) {
+            // no readahead, it would read the neighbouring pages on the node of the faulting thread
+            if (madvise(addr, file->size, MADV_RANDOM)) {
+                fprintf(stderr, "warning: madvise(.., MADV_RANDOM) failed: %s\n",
+                        strerror(errno));
+            }
+        }
+
         if (prefetch) {
             // Advise the kernel to preload the mapped memory
             if (madvise(addr, file->size, MADV_WILLNEED)) {
@@ -198,7 +261,9 @@ struct llama_mmap {
 #elif defined(_WIN32)
     static constexpr bool SUPPORTED = true;
 
-    llama_mmap(struct llama_file * file, bool prefetch = true) {
+    llama_mmap(struct llama_file * file, bool prefetch = true, bool numa = false) {
+        (void)numa;
+
         size = file->size;
 
         HANDLE hFile = (HANDLE) _get_osfhandle(_fileno(file->fp));
@@ -243,13 +308,105 @@ struct llama_mmap {
 #else
     static constexpr bool SUPPORTED = false;
 
-    llama_mmap(struct llama_file *, bool prefetch = true) {
+    llama_mmap(struct llama_file *, bool prefetch = true, bool numa = false) {
         (void)prefetch;
+        (void)numa;
         throw std::string("mmap not supported");
     }
 #endif
 };
 
+// A range of address space that is reserved up front and backed by memory only where it is written:
+// commit() makes a part of it usable, release() gives its memory back to the OS, the range stays reserved.
+// Without OS support, the whole range is allocated.
+struct llama_vmem {
+    uint8_t * addr = NULL;
+    size_t size = 0;
+
+    llama_vmem(const llama_vmem &) = delete;
+
+#ifdef _POSIX_MAPPED_FILES
+    static constexpr bool SUPPORTED = true;
+
+    llama_vmem(size_t size) : size(size) {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+        flags |= MAP_NORESERVE;
+#endif
+        void * ret = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (ret == MAP_FAILED) {
+            throw format("mmap of %zu bytes failed: %s", size, strerror(errno));
+        }
+        addr = (uint8_t *) ret;
+    }
+
+    // the pages of an anonymous mapping are zero-filled on their first access
+    void commit(size_t offs, size_t len) {
+        (void) offs;
+        (void) len;
+    }
+
+    void release(size_t offs, size_t len) {
+        // only whole pages can be given back
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        const size_t first = (offs + page_size - 1)/page_size*page_size;
+        const size_t last  = (offs + len)/page_size*page_size;
+        if (first < last && madvise(addr + first, last - first, MADV_DONTNEED)) {
+            fprintf(stderr, "warning: madvise(.., MADV_DONTNEED) failed: %s\n", strerror(errno));
+        }
+    }
+
+    ~llama_vmem() {
+        munmap(addr, size);
+    }
+#elif defined(_WIN32)
+    static constexpr bool SUPPORTED = true;
+
+    llama_vmem(size_t size) : size(size) {
+        addr = (uint8_t *) VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+        if (addr == NULL) {
+            throw format("VirtualAlloc of %zu bytes failed: %s", size, llama_format_win_err(GetLastError()).c_str());
+        }
+    }
+
+    void commit(size_t offs, size_t len) {
+        if (VirtualAlloc(addr + offs, len, MEM_COMMIT, PAGE_READWRITE) == NULL) {
+            throw format("VirtualAlloc(.., MEM_COMMIT) failed: %s", llama_format_win_err(GetLastError()).c_str());
+        }
+    }
+
+    void release(size_t offs, size_t len) {
+        if (!VirtualFree(addr + offs, len, MEM_DECOMMIT)) {
+            fprintf(stderr, "warning: VirtualFree(.., MEM_DECOMMIT) failed: %s\n",
+                    llama_format_win_err(GetLastError()).c_str());
+        }
+    }
+
+    ~llama_vmem() {
+        VirtualFree(addr, 0, MEM_RELEASE);
+    }
+#else
+    static constexpr bool SUPPORTED = false;
+
+    llama_vmem(size_t size) : size(size) {
+        addr = new uint8_t[size];
+    }
+
+    void commit(size_t offs, size_t len) {
+        memset(addr + offs, 0, len);
+    }
+
+    void release(size_t offs, size_t len) {
+        (void) offs;
+        (void) len;
+    }
+
+    ~llama_vmem() {
+        delete[] addr;
+    }
+#endif
+};
+
 // Represents some region of memory being locked using mlock or VirtualLock;
 // will automatically unlock on destruction.
 struct llama_mlock {
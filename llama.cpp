@@ -27,11 +27,28 @@
 #include <thread>
 #include <atomic>
 #include <mutex>
+#include <exception>
+#include <system_error>
 #include <sstream>
 #include <numeric>
 
-#define LLAMA_USE_SCRATCH
-#define LLAMA_MAX_SCRATCH_BUFFERS 16
+// number of threads reading the tensors of a model that is not mmapped
+#define LLAMA_MAX_LOAD_THREADS 8
+
+// llama_tokenize_batch splits texts into pieces of about this many bytes that are tokenized in parallel
+#define LLAMA_TOKENIZE_CHUNK_SIZE (64*1024)
+
+// the single-token graph attends to a multiple of this many KV cells, so that it can be reused for the next tokens
+#define LLAMA_GRAPH_KV_PAD 32
+
+// the KV cache is allocated in blocks of this many cells, a multiple of GGML_FLASH_ATTN_EXT_BLCK_V
+#define LLAMA_KV_BLOCK_SIZE 64
+
+// the KV blocks of a model are allocated from address space reserved for this many full contexts (see llama.h)
+#define LLAMA_KV_POOL_N_CTX 64
+
+// the compute buffer of a context is measured with the graph of a batch of this many tokens, larger batches grow it
+#define LLAMA_GRAPH_MEASURE_BATCH 512
 
 // available llama models
 enum e_model {
@@ -44,57 +61,6 @@ enum e_model {
 
 static const size_t MB = 1024*1024;
 
-// computed for n_ctx == 2048
-// TODO: dynamically determine these sizes
-//       needs modifications in ggml
-
-static const std::map<e_model, size_t> & MEM_REQ_SCRATCH0()
-{
-    static std::map<e_model, size_t> _MEM_REQ_SCRATCH0 = {
-        { MODEL_7B,    512ull * MB },
-        { MODEL_13B,   512ull * MB },
-        { MODEL_30B,   512ull * MB },
-        { MODEL_65B,  1024ull * MB },
-    };
-    return _MEM_REQ_SCRATCH0;
-}
-
-static const std::map<e_model, size_t> & MEM_REQ_SCRATCH1()
-{
-    static std::map<e_model, size_t> _MEM_REQ_SCRATCH1 = {
-        { MODEL_7B,    512ull * MB },
-        { MODEL_13B,   512ull * MB },
-        { MODEL_30B,   512ull * MB },
-        { MODEL_65B,  1024ull * MB },
-    };
-    return _MEM_REQ_SCRATCH1;
-}
-
-// 2*n_embd*n_ctx*n_layer*sizeof(float16)
-static const std::map<e_model, size_t> & MEM_REQ_KV_SELF()
-{
-    static std::map<e_model, size_t> _MEM_REQ_KV_SELF = {
-        { MODEL_7B,   1026ull * MB },
-        { MODEL_13B,  1608ull * MB },
-        { MODEL_30B,  3124ull * MB },
-        { MODEL_65B,  5120ull * MB },
-    };
-    return _MEM_REQ_KV_SELF;
-}
-
-// this is mostly needed for temporary mul_mat buffers to dequantize the data
-// not actually needed if BLAS is disabled
-static const std::map<e_model, size_t> & MEM_REQ_EVAL()
-{
-    static std::map<e_model, size_t> _MEM_REQ_EVAL = {
-        { MODEL_7B,   768ull * MB },
-        { MODEL_13B, 1024ull * MB },
-        { MODEL_30B, 1280ull * MB },
-        { MODEL_65B, 1536ull * MB },
-    };
-    return _MEM_REQ_EVAL;
-}
-
 // default hparams (LLaMA 7B)
 struct llama_hparams {
     uint32_t n_vocab = 32000;
@@ -130,28 +96,183 @@ struct llama_layer {
     struct ggml_tensor * w3;
 };
 
-struct llama_kv_cache {
-    struct ggml_tensor * k;
-    struct ggml_tensor * v;
+// a slot of the KV cache, shared by all sequences
+struct llama_kv_cell {
+    int          pos    = -1;
+    llama_seq_id seq_id = -1; // -1 if the cell is free
+};
+
+// the KV blocks of the contexts of a model that have the same cache types, in a reserved address range:
+// a block holds the cells [i*LLAMA_KV_BLOCK_SIZE, (i + 1)*LLAMA_KV_BLOCK_SIZE) of a cache, its memory is committed
+// when it is allocated and given back to the OS when it is freed
+struct llama_kv_pool {
+    struct ggml_tensor * k; // the K of the blocks, k_stride bytes apart
+    struct ggml_tensor * v; // the V of the blocks, v_stride bytes apart
 
     struct ggml_context * ctx = NULL;
 
-    llama_ctx_buffer buf;
+    std::unique_ptr<llama_vmem> mem;
+
+    size_t k_row_size; // K of a cell of a layer
+    size_t v_row_size; // V of a cell of a head of a layer
+    size_t k_stride;
+    size_t v_stride;
+    size_t v_offs;     // of v in mem
 
-    int n; // number of tokens currently in the cache
+    // number of caches that use each block, 0 if it is free
+    std::vector<int32_t> refs;
+    int n_used = 0;
 
-    ~llama_kv_cache() {
+    std::mutex mutex;
+
+    ~llama_kv_pool() {
         if (ctx) {
             ggml_free(ctx);
         }
     }
 };
 
+struct llama_kv_cache {
+    struct ggml_tensor * k = NULL; // the K and V of the pool
+    struct ggml_tensor * v = NULL;
+
+    struct llama_kv_pool * pool = NULL;
+
+    // block of the pool of each LLAMA_KV_BLOCK_SIZE cells, -1 until a token is stored in them
+    // a block can be shared with the caches forked from this one, it is copied before it is written
+    std::vector<int32_t> blocks;
+
+    int n = 0; // number of tokens currently in the cache
+
+    // the token stored in each cell, used to build the attention mask of llama_eval_batch
+    std::vector<llama_kv_cell> cells;
+};
+
+// byte trie over the token texts, the tokenizer walks it instead of hashing a new string for every merge
+struct llama_trie {
+    struct node {
+        int32_t  id      = -1; // token spelled by the path to this node, -1 if none
+        uint32_t edge0   = 0;  // the children are edges[edge0, edge0 + n_edges), sorted by byte
+        uint32_t n_edges = 0;
+        int32_t  dense   = -1; // nodes with many children also index them by byte in dense[dense*256 + byte]
+    };
+
+    struct edge {
+        uint8_t  byte;
+        uint32_t child;
+    };
+
+    std::vector<node>    nodes;
+    std::vector<edge>    edges;
+    std::vector<int32_t> dense;
+
+    // set for the bytes that some token has directly before a space, a text cannot be split in two there
+    bool joins_space[256] = {};
+
+    // node reached from node n by the bytes of text, -1 if no token starts with that path
+    int32_t walk(int32_t n, const char * text, size_t len) const {
+        for (size_t i = 0; i < len && n >= 0; ++i) {
+            const node & cur = nodes[n];
+            if (cur.dense >= 0) {
+                n = dense[cur.dense*256 + static_cast<uint8_t>(text[i])];
+                continue;
+            }
+            const edge * first = edges.data() + cur.edge0;
+            const edge * last  = first + cur.n_edges;
+            const uint8_t c = static_cast<uint8_t>(text[i]);
+            const edge * it = std::lower_bound(first, last, c, [](const edge & e, uint8_t b) { return e.byte < b; });
+            n = it != last && it->byte == c ? (int32_t) it->child : -1;
+        }
+        return n;
+    }
+
+    void build(const std::unordered_map<std::string, int32_t> & token_to_id) {
+        std::vector<std::pair<std::string, int32_t>> tokens(token_to_id.begin(), token_to_id.end());
+        std::sort(tokens.begin(), tokens.end());
+
+        nodes.clear();
+        edges.clear();
+        dense.clear();
+        build_node(tokens, 0, tokens.size(), 0);
+
+        std::fill(std::begin(joins_space), std::end(joins_space), false);
+        for (const auto & tok : tokens) {
+            for (size_t i = 1; i < tok.first.size(); ++i) {
+                if (tok.first[i] == ' ') {
+                    joins_space[static_cast<uint8_t>(tok.first[i - 1])] = true;
+                }
+            }
+        }
+
+        for (node & cur : nodes) {
+            if (cur.n_edges >= 16) {
+                cur.dense = dense.size()/256;
+                dense.resize(dense.size() + 256, -1);
+                for (uint32_t e = cur.edge0; e < cur.edge0 + cur.n_edges; ++e) {
+                    dense[cur.dense*256 + edges[e].byte] = edges[e].child;
+                }
+            }
+        }
+    }
+
+private:
+    // the tokens in [lo, hi) are sorted and share their first depth bytes
+    uint32_t build_node(const std::vector<std::pair<std::string, int32_t>> & tokens, size_t lo, size_t hi, size_t depth) {
+        const uint32_t idx = nodes.size();
+        nodes.emplace_back();
+
+        if (lo < hi && tokens[lo].first.size() == depth) {
+            nodes[idx].id = tokens[lo++].second;
+        }
+
+        // reserve the edges of this node first, so that they are contiguous
+        const uint32_t edge0 = edges.size();
+        for (size_t i = lo; i < hi; ++i) {
+            const uint8_t c = static_cast<uint8_t>(tokens[i].first[depth]);
+            if (i == lo || c != edges.back().byte) {
+                edges.push_back({ c, 0 });
+            }
+        }
+        nodes[idx].edge0   = edge0;
+        nodes[idx].n_edges = edges.size() - edge0;
+
+        for (uint32_t e = edge0; e < edge0 + nodes[idx].n_edges; ++e) {
+            size_t end = lo;
+            while (end < hi && static_cast<uint8_t>(tokens[end].first[depth]) == edges[e].byte) {
+                ++end;
+            }
+            const uint32_t child = build_node(tokens, lo, end, depth + 1);
+            edges[e].child = child;
+            lo = end;
+        }
+
+        return idx;
+    }
+};
+
+struct llama_vocab {
+    using id    = int32_t;
+    using token = std::string;
+
+    struct token_score {
+        token tok;
+        float score;
+    };
+
+    std::unordered_map<token, id> token_to_id;
+    std::vector<token_score> id_to_token;
+
+    llama_trie trie;
+};
+
+// the weights and vocabulary, shared by all the contexts created from them
 struct llama_model {
     e_model type = MODEL_UNKNOWN;
 
     llama_hparams hparams;
 
+    llama_vocab vocab;
+
     struct ggml_tensor * tok_embeddings;
 
     struct ggml_tensor * norm;
@@ -162,10 +283,6 @@ struct llama_model {
     // context
     struct ggml_context * ctx = NULL;
 
-    // key + value cache for the self attention
-    // TODO: move to llama_state
-    struct llama_kv_cache kv_self;
-
     // the model memory buffer
     llama_ctx_buffer buf;
 
@@ -179,6 +296,13 @@ struct llama_model {
     // for quantize-stats only
     std::vector<std::pair<std::string, struct ggml_tensor *>> tensors_by_name;
 
+    // the KV blocks of the contexts, a pool per pair of cache types
+    mutable std::vector<std::unique_ptr<llama_kv_pool>> kv_pools;
+    mutable std::mutex kv_pools_mutex;
+
+    int64_t t_load_us = 0;
+    int64_t t_start_us = 0;
+
     ~llama_model() {
         if (ctx) {
             ggml_free(ctx);
@@ -186,24 +310,58 @@ struct llama_model {
     }
 };
 
-struct llama_vocab {
-    using id    = int32_t;
-    using token = std::string;
+// the compute graph of the last eval: its tensor objects are in buf_compute and their data in buf_alloc
+struct llama_graph {
+    struct ggml_context * ctx = NULL;
 
-    struct token_score {
-        token tok;
-        float score;
-    };
+    ggml_cgraph gf = {};
 
-    std::unordered_map<token, id> token_to_id;
-    std::vector<token_score> id_to_token;
+    // number of KV cells attended to by a reusable single-token graph, 0 if the graph cannot be reused
+    int n_kv = 0;
+
+    struct ggml_tensor * embd       = NULL;
+    struct ggml_tensor * out_ids    = NULL;
+    struct ggml_tensor * kv_blocks  = NULL;
+    struct ggml_tensor * KQ_pos     = NULL;
+    struct ggml_tensor * KQ_mask    = NULL;
+    struct ggml_tensor * logits     = NULL;
+    struct ggml_tensor * embeddings = NULL;
+
+    // per layer tensors that depend on n_past
+    std::vector<struct ggml_tensor *> rope_q;
+    std::vector<struct ggml_tensor *> rope_k;
+    std::vector<struct ggml_tensor *> attn;
+    std::vector<struct ggml_tensor *> k_store;
+    std::vector<struct ggml_tensor *> v_store;
+
+    ~llama_graph() {
+        if (ctx) {
+            ggml_free(ctx);
+        }
+    }
 };
 
+struct llama_tokenizer;
+static void llama_tokenizer_free(struct llama_tokenizer * tokenizer);
+
+static void kv_cache_reset_cells(struct llama_kv_cache & cache, int n);
+
 struct llama_context {
+    llama_context(const llama_model & model) : model(model), vocab(model.vocab), t_load_us(model.t_load_us), t_start_us(model.t_start_us) {}
+
     std::mt19937 rng;
 
-    int64_t t_load_us = 0;
-    int64_t t_start_us = 0;
+    const llama_model & model;
+    const llama_vocab & vocab;
+
+    // context size of this context, at most the n_ctx the model was loaded with
+    int n_ctx = 0;
+
+    // set by llama_init_from_file(), which loads a model for this context only
+    bool model_owner = false;
+
+    int64_t t_load_us;
+    int64_t t_start_us;
     bool has_evaluated_once = false;
 
     int64_t t_sample_us = 0;
@@ -214,55 +372,57 @@ struct llama_context {
     int32_t n_eval   = 0; // number of eval calls
     int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
 
-    llama_model model;
-    llama_vocab vocab;
+    int64_t t_graph_build_us = 0;
+    int32_t n_graph_build    = 0; // number of single-token evals that built a new graph
+    int32_t n_graph_reuse    = 0; // number of single-token evals that reused the previous graph
 
-    size_t mem_per_token = 0;
+    // key + value cache for the self attention
+    struct llama_kv_cache kv_self;
 
     // decode output (2-dimensional array: [n_tokens][n_vocab])
     std::vector<float> logits;
+
+    // rows of the last batch the logits were computed for
+    std::vector<int32_t> output_ids;
     bool logits_all = false;
 
     // input embedding (1-dimensional array: [n_embd])
     std::vector<float> embedding;
 
+    // created by the first llama_tokenize call and reused by the next ones
+    struct llama_tokenizer * tokenizer = NULL;
+    std::vector<llama_vocab::id> tokenize_out;
+
+    // storage reused by llama_sample_chain
+    std::vector<float>            sampling_logits;
+    std::vector<llama_token_data> sampling_cur;
+    std::vector<llama_token>      sampling_prev;
+
     // memory buffers used to evaluate the model
     // TODO: move in llama_state
     llama_ctx_buffer buf_compute;
-    llama_ctx_buffer buf_scratch[LLAMA_MAX_SCRATCH_BUFFERS];
+    llama_ctx_buffer buf_alloc;
 
-    int    buf_last = 0;
-    size_t buf_max_size[LLAMA_MAX_SCRATCH_BUFFERS] = { 0 };
+    // largest size of the data of the graphs, measured by ggml_graph_alloc
+    size_t alloc_peak = 0;
 
-    void use_buf(struct ggml_context * ctx, int i) {
-#if defined(LLAMA_USE_SCRATCH)
-        size_t last_size = 0;
+    // worker threads used to evaluate the model, kept alive between llama_eval calls
+    struct ggml_threadpool * threadpool = NULL;
 
-        if (i == -1) {
-            last_size = ggml_set_scratch(ctx, { 0, 0, nullptr, });
-        } else {
-            auto & buf = buf_scratch[i];
-            last_size = ggml_set_scratch(ctx, { 0, buf.size, buf.addr, });
-        }
+    llama_graph graph;
 
-        if (buf_last >= 0) {
-            buf_max_size[buf_last] = std::max(buf_max_size[buf_last], last_size);
-        }
+    ~llama_context() {
+        ggml_threadpool_free(threadpool);
+        llama_tokenizer_free(tokenizer);
 
-        buf_last = i;
-#else
-        (void) i;
-        (void) ctx;
-#endif
-    }
+        // the blocks go back to the pool of the model
+        if (kv_self.pool) {
+            kv_cache_reset_cells(kv_self, 0);
+        }
 
-    size_t get_buf_max_mem(int i) const {
-#if defined(LLAMA_USE_SCRATCH)
-        return buf_max_size[i];
-#else
-        (void) i;
-        return 0;
-#endif
+        if (model_owner) {
+            delete &model;
+        }
     }
 };
 
@@ -672,14 +832,14 @@ struct llama_model_loader {
         }
     }
 
-    void load_all_data(llama_progress_callback progress_callback, void *  progress_callback_user_data, llama_mlock * lmlock) {
+    void load_all_data(llama_progress_callback progress_callback, void *  progress_callback_user_data, llama_mlock * lmlock, bool numa) {
         size_t data_size = 0;
         for (const llama_load_tensor & lt : tensors_map.tensors) {
             data_size += lt.size;
         }
 
         if (use_mmap) {
-            mapping.reset(new llama_mmap(&file_loaders.at(0)->file));
+            mapping.reset(new llama_mmap(&file_loaders.at(0)->file, /* prefetch */ true, numa));
             if (!lmlock) {
                 // Don't call the callback since the actual loading will be lazy
                 // and we can't measure it.
@@ -690,20 +850,62 @@ struct llama_model_loader {
             }
         }
 
-        size_t done_size = 0;
-        for (llama_load_tensor & lt : tensors_map.tensors) {
-            if (progress_callback) {
-                progress_callback((float) done_size / data_size, progress_callback_user_data);
+        // without mmap the tensors are read with concurrent positional reads, which keeps several requests
+        // in flight on fast drives, and the column-split shards are reshaped by the thread that read them
+        const size_t n_tensors = tensors_map.tensors.size();
+        const size_t n_threads = use_mmap || !llama_file::PREAD_SUPPORTED ? 1 :
+            std::min({ (size_t) std::max(1u, std::thread::hardware_concurrency()), (size_t) LLAMA_MAX_LOAD_THREADS, n_tensors });
+
+        std::atomic<size_t> next_tensor(0);
+        std::atomic<size_t> done_size(0);
+
+        // the first error of any thread, the others stop at their next tensor
+        std::mutex         err_mutex;
+        std::exception_ptr err;
+
+        // the calling thread also reports the progress
+        auto load_tensors = [&](bool report_progress) {
+            try {
+                for (size_t i; (i = next_tensor++) < n_tensors; ) {
+                    llama_load_tensor & lt = tensors_map.tensors.at(i);
+                    if (report_progress && progress_callback) {
+                        progress_callback((float) done_size / data_size, progress_callback_user_data);
+                    }
+                    LLAMA_ASSERT(lt.ggml_tensor); // unused tensors should have been caught by load_data already
+                    lt.data = (uint8_t *) lt.ggml_tensor->data;
+                    load_data_for(lt);
+                    lt.ggml_tensor->data = lt.data;
+                    const size_t done = done_size += lt.size;
+                    if (use_mmap && lmlock) {
+                        lmlock->grow_to(done);
+                    }
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(err_mutex);
+                if (!err) {
+                    err = std::current_exception();
+                }
+                next_tensor = n_tensors;
             }
-            LLAMA_ASSERT(lt.ggml_tensor); // unused tensors should have been caught by load_data already
-            lt.data = (uint8_t *) lt.ggml_tensor->data;
-            load_data_for(lt);
-            lt.ggml_tensor->data = lt.data;
-            done_size += lt.size;
-            if (use_mmap && lmlock) {
-                lmlock->grow_to(done_size);
+        };
+
+        // if a worker cannot be started, the tensors are read by the ones that are running
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < n_threads; i++) {
+            try {
+                workers.emplace_back(load_tensors, false);
+            } catch (const std::system_error &) {
+                break;
             }
         }
+        load_tensors(true);
+        for (std::thread & worker : workers) {
+            worker.join();
+        }
+        if (err) {
+            std::rethrow_exception(err);
+        }
+
         if (progress_callback) {
             progress_callback(1.0f, progress_callback_user_data);
         }
@@ -715,14 +917,12 @@ struct llama_model_loader {
             lt.data = (uint8_t *) mapping->addr + lt.shards.at(0).file_off;
         } else if (lt.split_type == SPLIT_NONE) {
             llama_file & file = file_loaders.at(lt.shards.at(0).file_idx)->file;
-            file.seek(lt.shards.at(0).file_off, SEEK_SET);
-            file.read_raw(lt.data, lt.size);
+            file.read_raw_at(lt.data, lt.size, lt.shards.at(0).file_off);
         } else if (lt.split_type == SPLIT_BY_ROWS) {
             size_t offset = 0;
             for (llama_load_tensor_shard & shard : lt.shards) {
                 llama_file & file = file_loaders.at(shard.file_idx)->file;
-                file.seek(shard.file_off, SEEK_SET);
-                file.read_raw(lt.data + offset, shard.size);
+                file.read_raw_at(lt.data + offset, shard.size, shard.file_off);
                 offset += shard.size;
             }
             LLAMA_ASSERT(offset == lt.size);
@@ -732,9 +932,8 @@ struct llama_model_loader {
             for (size_t i = 0; i < lt.shards.size(); i++) {
                 llama_load_tensor_shard & shard = lt.shards.at(i);
                 llama_file & file = file_loaders.at(shard.file_idx)->file;
-                file.seek(shard.file_off, SEEK_SET);
                 tmp_bufs.at(i).resize(shard.size);
-                file.read_raw(tmp_bufs.at(i).addr, shard.size);
+                file.read_raw_at(tmp_bufs.at(i).addr, shard.size, shard.file_off);
             }
             // Then reshape.
             size_t num_rows = lt.ne.at(1);
@@ -772,142 +971,506 @@ struct llama_model_loader {
 // kv cache
 //
 
-static bool kv_cache_init(
-        const struct llama_hparams & hparams,
-             struct llama_kv_cache & cache,
-                         ggml_type   wtype,
-                               int   n_ctx) {
+// the cells of a cache are stored in blocks of LLAMA_KV_BLOCK_SIZE cells from the pool of the model, a block holds
+// [n_layer][LLAMA_KV_BLOCK_SIZE] rows of K of n_embd and [n_layer][n_head][LLAMA_KV_BLOCK_SIZE] rows of V of
+// n_embd/n_head: the values of the cells of a head are contiguous, so that the attention reads them sequentially
+
+// size in bytes of n consecutive elements of a cache tensor, K may be block-quantized
+static size_t kv_cache_nbytes(const struct ggml_tensor * t, int64_t n) {
+    return ggml_type_size(t->type)*n/ggml_blck_size(t->type);
+}
+
+// the size of a block rounded up to 64 KB, so that the memory of the blocks can be committed and given back on
+// its own, and to a whole number of elements, so that the blocks are one tensor
+static size_t kv_pool_stride(size_t size, ggml_type type) {
+    const size_t align = 64*1024;
+
+    size_t stride = (size + align - 1)/align*align;
+    while (stride % ggml_type_size(type) != 0) {
+        stride += align;
+    }
+
+    return stride;
+}
+
+// the pool of the model for the given cache types, reserved by the first context that uses them
+static struct llama_kv_pool * kv_pool_get(const llama_model & model, ggml_type ktype, ggml_type vtype) {
+    std::lock_guard<std::mutex> lock(model.kv_pools_mutex);
+
+    for (const auto & pool : model.kv_pools) {
+        if (pool->k->type == ktype && pool->v->type == vtype) {
+            return pool.get();
+        }
+    }
+
+    const auto & hparams = model.hparams;
+
     const int n_embd  = hparams.n_embd;
+    const int n_head  = hparams.n_head;
     const int n_layer = hparams.n_layer;
 
-    const int64_t n_mem      = n_layer*n_ctx;
-    const int64_t n_elements = n_embd*n_mem;
-
-    cache.buf.resize(2u*n_elements*ggml_type_size(wtype) + 2u*MB);
+    std::unique_ptr<llama_kv_pool> pool(new llama_kv_pool);
+
+    pool->k_row_size = ggml_type_size(ktype)*n_embd/ggml_blck_size(ktype);
+    pool->v_row_size = ggml_type_size(vtype)*(n_embd/n_head)/ggml_blck_size(vtype);
+    pool->k_stride   = kv_pool_stride((size_t) n_layer*LLAMA_KV_BLOCK_SIZE*pool->k_row_size, ktype);
+    pool->v_stride   = kv_pool_stride((size_t) n_layer*n_head*LLAMA_KV_BLOCK_SIZE*pool->v_row_size, vtype);
+
+    // with less address space, the contexts of the model can hold fewer tokens together
+    const int n_ctx_blocks = (hparams.n_ctx + LLAMA_KV_BLOCK_SIZE - 1)/LLAMA_KV_BLOCK_SIZE;
+
+    int n_blocks = 0;
+    for (int n_ctx_max = llama_vmem::SUPPORTED ? LLAMA_KV_POOL_N_CTX : 1; !pool->mem; n_ctx_max /= 2) {
+        n_blocks = n_ctx_max*n_ctx_blocks;
+        try {
+            pool->mem.reset(new llama_vmem(n_blocks*(pool->k_stride + pool->v_stride)));
+        } catch (const std::string & err) {
+            if (n_ctx_max == 1) {
+                fprintf(stderr, "%s: failed to reserve memory for the kv cache: %s\n", __func__, err.c_str());
+                return NULL;
+            }
+        }
+    }
 
     struct ggml_init_params params;
-    params.mem_size   = cache.buf.size;
-    params.mem_buffer = cache.buf.addr;
-    params.no_alloc   = false;
+    params.mem_size   = MB;
+    params.mem_buffer = NULL;
+    params.no_alloc   = true;
 
-    cache.ctx = ggml_init(params);
+    pool->ctx = ggml_init(params);
 
-    if (!cache.ctx) {
+    if (!pool->ctx) {
         fprintf(stderr, "%s: failed to allocate memory for kv cache\n", __func__);
-        return false;
+        return NULL;
     }
 
-    cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    ggml_set_name(cache.k, "cache_k");
-    ggml_set_name(cache.v, "cache_v");
+    pool->k = ggml_new_tensor_1d(pool->ctx, ktype, n_blocks*pool->k_stride/ggml_type_size(ktype)*ggml_blck_size(ktype));
+    pool->v = ggml_new_tensor_1d(pool->ctx, vtype, n_blocks*pool->v_stride/ggml_type_size(vtype)*ggml_blck_size(vtype));
+    ggml_set_name(pool->k, "cache_k");
+    ggml_set_name(pool->v, "cache_v");
 
-    return true;
-}
+    pool->v_offs  = n_blocks*pool->k_stride;
+    pool->k->data = pool->mem->addr;
+    pool->v->data = pool->mem->addr + pool->v_offs;
 
-struct llama_context_params llama_context_default_params() {
-    struct llama_context_params result = {
-        /*.n_ctx                       =*/ 512,
-        /*.n_parts                     =*/ -1,
-        /*.seed                        =*/ -1,
-        /*.f16_kv                      =*/ false,
-        /*.logits_all                  =*/ false,
-        /*.vocab_only                  =*/ false,
-        /*.use_mmap                    =*/ true,
-        /*.use_mlock                   =*/ false,
-        /*.embedding                   =*/ false,
-        /*.progress_callback           =*/ nullptr,
-        /*.progress_callback_user_data =*/ nullptr,
-    };
+    pool->refs.resize(n_blocks, 0);
 
-    return result;
-}
+    fprintf(stderr, "%s: reserved %.2f MB for %d kv blocks of %d cells (%.2f MB each)\n", __func__,
+            pool->mem->size/1024.0/1024.0, n_blocks, LLAMA_KV_BLOCK_SIZE, (pool->k_stride + pool->v_stride)/1024.0/1024.0);
 
-bool llama_mmap_supported() {
-    return llama_mmap::SUPPORTED;
-}
+    model.kv_pools.push_back(std::move(pool));
 
-bool llama_mlock_supported() {
-    return llama_mlock::SUPPORTED;
+    return model.kv_pools.back().get();
 }
 
-//
-// model loading
-//
+// allocates a block with a single reference, -1 if the pool is full or its memory cannot be committed (pool.mutex is held)
+// a new block reads as zeros: the reused single-token graph also reads the cells after the last token (masked),
+// they must not hold NaNs
+static int kv_pool_alloc_locked(struct llama_kv_pool & pool) {
+    // the lowest free block, to keep the used memory together
+    const auto it = std::find(pool.refs.begin(), pool.refs.end(), 0);
+    if (it == pool.refs.end()) {
+        return -1;
+    }
 
-static const char *llama_file_version_name(llama_file_version version) {
-    switch (version) {
-        case LLAMA_FILE_VERSION_GGML: return "'ggml' (old version with low tokenizer quality and no mmap support)";
-        case LLAMA_FILE_VERSION_GGMF_V1: return "ggmf v1 (old version with no mmap support)";
-        case LLAMA_FILE_VERSION_GGJT_V1: return "ggjt v1 (latest)";
-        default: LLAMA_ASSERT(false);
+    const int ib = it - pool.refs.begin();
+
+    try {
+        pool.mem->commit(ib*pool.k_stride, pool.k_stride);
+        pool.mem->commit(pool.v_offs + ib*pool.v_stride, pool.v_stride);
+    } catch (const std::string & err) {
+        fprintf(stderr, "%s: failed to commit the memory of a kv block: %s\n", __func__, err.c_str());
+        pool.mem->release(ib*pool.k_stride, pool.k_stride);
+        return -1;
     }
+
+    pool.refs[ib] = 1;
+    pool.n_used++;
+
+    return ib;
 }
 
-static const char *llama_ftype_name(enum llama_ftype ftype) {
-    switch (ftype) {
-        case LLAMA_FTYPE_ALL_F32:     return "all F32";
-        case LLAMA_FTYPE_MOSTLY_F16:  return "mostly F16";
-        case LLAMA_FTYPE_MOSTLY_Q4_0: return "mostly Q4_0";
-        case LLAMA_FTYPE_MOSTLY_Q4_1: return "mostly Q4_1";
-        case LLAMA_FTYPE_MOSTLY_Q4_1_SOME_F16:
-                                      return "mostly Q4_1, some F16";
-        case LLAMA_FTYPE_MOSTLY_Q4_2: return "mostly Q4_2";
-        case LLAMA_FTYPE_MOSTLY_Q5_0: return "mostly Q5_0";
-        case LLAMA_FTYPE_MOSTLY_Q5_1: return "mostly Q5_1";
-        case LLAMA_FTYPE_MOSTLY_Q8_0: return "mostly Q8_0";
-        default:                      return "unknown, may not work";
+// returns a block the caller can write to in place of block ib: ib itself if the caller holds its only reference,
+// else a new block with a copy of ib (or a new block if ib < 0), -1 if the pool is full
+// the references of the other caches can change concurrently, so the check and the copy are done under the lock
+static int kv_pool_make_writable(struct llama_kv_pool & pool, int ib) {
+    std::lock_guard<std::mutex> lock(pool.mutex);
+
+    if (ib >= 0 && pool.refs[ib] == 1) {
+        return ib;
     }
-}
 
-static const char *llama_model_type_name(e_model type) {
-    switch (type) {
-        case MODEL_7B: return "7B";
-        case MODEL_13B: return "13B";
-        case MODEL_30B: return "30B";
-        case MODEL_65B: return "65B";
-        default: LLAMA_ASSERT(false);
+    const int ib_new = kv_pool_alloc_locked(pool);
+    if (ib_new < 0 || ib < 0) {
+        return ib_new;
     }
+
+    memcpy((uint8_t *) pool.k->data + ib_new*pool.k_stride, (uint8_t *) pool.k->data + ib*pool.k_stride, pool.k_stride);
+    memcpy((uint8_t *) pool.v->data + ib_new*pool.v_stride, (uint8_t *) pool.v->data + ib*pool.v_stride, pool.v_stride);
+
+    // the block is still used by the other caches
+    LLAMA_ASSERT(pool.refs[ib] > 1);
+    pool.refs[ib]--;
+
+    return ib_new;
 }
 
-static void llama_model_load_internal(
-        const std::string & fname,
-        llama_context & lctx,
-        int n_ctx,
-        ggml_type memory_type,
-        bool use_mmap,
-        bool use_mlock,
-        bool vocab_only,
-        llama_progress_callback progress_callback,
-        void * progress_callback_user_data) {
+static void kv_pool_ref(struct llama_kv_pool & pool, int ib) {
+    std::lock_guard<std::mutex> lock(pool.mutex);
 
-    lctx.t_start_us = ggml_time_us();
+    pool.refs[ib]++;
+}
 
-    std::unique_ptr<llama_model_loader> ml(new llama_model_loader(fname, use_mmap, vocab_only));
+// drops a reference to a block, the memory of the block is given back with the last one
+static void kv_pool_unref(struct llama_kv_pool & pool, int ib) {
+    std::lock_guard<std::mutex> lock(pool.mutex);
 
-    lctx.vocab = std::move(ml->file_loaders.at(0)->vocab);
-    auto & model = lctx.model;
-    model.hparams = ml->file_loaders.at(0)->hparams;
-    llama_file_version file_version = ml->file_loaders.at(0)->file_version;
-    auto & hparams = model.hparams;
-    uint32_t n_ff = ((2*(4*hparams.n_embd)/3 + hparams.n_mult - 1)/hparams.n_mult)*hparams.n_mult;
+    LLAMA_ASSERT(pool.refs[ib] > 0);
 
-    {
-        switch (hparams.n_layer) {
-            case 32: model.type = e_model::MODEL_7B; break;
-            case 40: model.type = e_model::MODEL_13B; break;
-            case 60: model.type = e_model::MODEL_30B; break;
-            case 80: model.type = e_model::MODEL_65B; break;
-        }
+    if (--pool.refs[ib] == 0) {
+        pool.mem->release(ib*pool.k_stride, pool.k_stride);
+        pool.mem->release(pool.v_offs + ib*pool.v_stride, pool.v_stride);
 
-        hparams.n_ctx = n_ctx;
+        pool.n_used--;
     }
+}
 
-    {
-        fprintf(stderr, "%s: format     = %s\n",  __func__, llama_file_version_name(file_version));
-        fprintf(stderr, "%s: n_vocab    = %u\n",  __func__, hparams.n_vocab);
-        fprintf(stderr, "%s: n_ctx      = %u\n",  __func__, hparams.n_ctx);
-        fprintf(stderr, "%s: n_embd     = %u\n",  __func__, hparams.n_embd);
+static bool kv_cache_init(
+        const struct llama_model & model,
+             struct llama_kv_cache & cache,
+                         ggml_type   ktype,
+                         ggml_type   vtype,
+                               int   n_ctx) {
+    const auto & hparams = model.hparams;
+
+    const int n_embd = hparams.n_embd;
+
+    // K is stored one cell per row, so a quantized K needs whole blocks per head
+    if (ggml_is_quantized(ktype) && (n_embd/hparams.n_head) % ggml_blck_size(ktype) != 0) {
+        fprintf(stderr, "%s: head size %d is not a multiple of %d, cannot quantize the K cache\n",
+                __func__, n_embd/hparams.n_head, ggml_blck_size(ktype));
+        return false;
+    }
+
+    cache.pool = kv_pool_get(model, ktype, vtype);
+
+    if (!cache.pool) {
+        return false;
+    }
+
+    cache.k = cache.pool->k;
+    cache.v = cache.pool->v;
+
+    cache.blocks.clear();
+    cache.blocks.resize((n_ctx + LLAMA_KV_BLOCK_SIZE - 1)/LLAMA_KV_BLOCK_SIZE, -1);
+
+    cache.cells.clear();
+    cache.cells.resize(n_ctx);
+
+    return true;
+}
+
+// offsets in the K and V of the pool of the row of cell c of layer il (and head h), the block of c is allocated
+static size_t kv_cache_k_offs(const struct llama_kv_cache & cache, int il, int c) {
+    const auto & pool = *cache.pool;
+
+    const int ib = cache.blocks[c/LLAMA_KV_BLOCK_SIZE];
+    LLAMA_ASSERT(ib >= 0);
+
+    return ib*pool.k_stride + ((size_t) il*LLAMA_KV_BLOCK_SIZE + c % LLAMA_KV_BLOCK_SIZE)*pool.k_row_size;
+}
+
+static size_t kv_cache_v_offs(const struct llama_kv_cache & cache, int n_head, int il, int h, int c) {
+    const auto & pool = *cache.pool;
+
+    const int ib = cache.blocks[c/LLAMA_KV_BLOCK_SIZE];
+    LLAMA_ASSERT(ib >= 0);
+
+    return ib*pool.v_stride + (((size_t) il*n_head + h)*LLAMA_KV_BLOCK_SIZE + c % LLAMA_KV_BLOCK_SIZE)*pool.v_row_size;
+}
+
+// number of cells from c up to c1 or the end of the block of c, the rows of these cells are contiguous
+static int kv_cache_run(int c, int c1) {
+    return std::min(c1, (c/LLAMA_KV_BLOCK_SIZE + 1)*LLAMA_KV_BLOCK_SIZE) - c;
+}
+
+// makes the blocks of the cells [c0, c1) writable: allocates the missing ones and copies the shared ones
+// returns false if the pool is full
+static bool kv_cache_alloc(struct llama_kv_cache & cache, int c0, int c1) {
+    auto & pool = *cache.pool;
+
+    for (int b = c0/LLAMA_KV_BLOCK_SIZE; b*LLAMA_KV_BLOCK_SIZE < c1; ++b) {
+        const int ib_new = kv_pool_make_writable(pool, cache.blocks[b]);
+        if (ib_new < 0) {
+            fprintf(stderr, "%s: all the %d kv blocks are in use\n", __func__, (int) pool.refs.size());
+            return false;
+        }
+
+        cache.blocks[b] = ib_new;
+    }
+
+    return true;
+}
+
+// frees the blocks without used cells
+static void kv_cache_release(struct llama_kv_cache & cache) {
+    const int n_ctx = cache.cells.size();
+
+    for (int b = 0; b < (int) cache.blocks.size(); ++b) {
+        if (cache.blocks[b] < 0) {
+            continue;
+        }
+
+        bool used = false;
+        for (int c = b*LLAMA_KV_BLOCK_SIZE; c < std::min(n_ctx, (b + 1)*LLAMA_KV_BLOCK_SIZE) && !used; ++c) {
+            used = cache.cells[c].seq_id >= 0;
+        }
+
+        if (!used) {
+            kv_pool_unref(*cache.pool, cache.blocks[b]);
+            cache.blocks[b] = -1;
+        }
+    }
+}
+
+// llama_eval and the state functions use the cache as a single sequence:
+// cell i holds position i of sequence 0 for i < n, the remaining cells are free
+static void kv_cache_reset_cells(struct llama_kv_cache & cache, int n) {
+    for (int i = 0; i < (int) cache.cells.size(); ++i) {
+        cache.cells[i].pos    = i < n ? i :  -1;
+        cache.cells[i].seq_id = i < n ? 0 :  -1;
+    }
+
+    kv_cache_release(cache);
+}
+
+// calls f(data, offs, size) on the K and V of the cells [c0, c0 + n), in the order of their rows [i0, i0 + n) in
+// a buffer that holds [n_layer][n_buf] rows of K and then [n_layer][n_head][n_buf] rows of V:
+// the size bytes at data are at offs in the buffer, data is NULL for the cells of a freed block, which read as zeros
+template <typename F>
+static void kv_cache_visit(const struct llama_kv_cache & cache, const llama_hparams & hparams, int c0, int n, int n_buf, int i0, F && f) {
+    const int n_layer = hparams.n_layer;
+    const int n_head  = hparams.n_head;
+
+    const size_t k_row_size = cache.pool->k_row_size;
+    const size_t v_row_size = cache.pool->v_row_size;
+
+    uint8_t * k = (uint8_t *) cache.k->data;
+    uint8_t * v = (uint8_t *) cache.v->data;
+
+    for (int il = 0; il < n_layer; ++il) {
+        for (int c = c0, nc; c < c0 + n; c += nc) {
+            nc = kv_cache_run(c, c0 + n);
+            f(cache.blocks[c/LLAMA_KV_BLOCK_SIZE] < 0 ? NULL : k + kv_cache_k_offs(cache, il, c),
+                    ((size_t) il*n_buf + i0 + c - c0)*k_row_size, nc*k_row_size);
+        }
+    }
+
+    const size_t v_offs = (size_t) n_layer*n_buf*k_row_size;
+
+    for (int il = 0; il < n_layer; ++il) {
+        for (int h = 0; h < n_head; ++h) {
+            for (int c = c0, nc; c < c0 + n; c += nc) {
+                nc = kv_cache_run(c, c0 + n);
+                f(cache.blocks[c/LLAMA_KV_BLOCK_SIZE] < 0 ? NULL : v + kv_cache_v_offs(cache, n_head, il, h, c),
+                        v_offs + (((size_t) il*n_head + h)*n_buf + i0 + c - c0)*v_row_size, nc*v_row_size);
+            }
+        }
+    }
+}
+
+// returns the first cell of n_tokens consecutive free cells, or -1 if there are none (see kv_cache_defrag)
+static int kv_cache_find_slot(const struct llama_kv_cache & cache, int n_tokens) {
+    const int n_ctx = cache.cells.size();
+
+    int n_free = 0;
+    for (int i = 0; i < n_ctx; ++i) {
+        n_free = cache.cells[i].seq_id < 0 ? n_free + 1 : 0;
+        if (n_free == n_tokens) {
+            return i - n_tokens + 1;
+        }
+    }
+
+    return -1;
+}
+
+// moves the used cells down into the free cells before them, so that all the free cells are at the end
+// the attention masks the cells by their pos and seq_id, the cells of a sequence do not have to be in order
+// returns false if the blocks of the cells cannot be allocated
+static bool kv_cache_defrag(struct llama_kv_cache & cache, const llama_hparams & hparams) {
+    const int n_layer = hparams.n_layer;
+    const int n_head  = hparams.n_head;
+
+    const int n_ctx = cache.cells.size();
+
+    int n_used = 0;
+    for (const auto & cell : cache.cells) {
+        n_used += cell.seq_id >= 0;
+    }
+
+    if (!kv_cache_alloc(cache, 0, n_used)) {
+        kv_cache_release(cache);
+        return false;
+    }
+
+    const size_t k_row_size = cache.pool->k_row_size;
+    const size_t v_row_size = cache.pool->v_row_size;
+
+    uint8_t * k = (uint8_t *) cache.k->data;
+    uint8_t * v = (uint8_t *) cache.v->data;
+
+    for (int dst = 0, src = n_ctx - 1; ; ++dst, --src) {
+        while (dst < n_used && cache.cells[dst].seq_id >= 0) {
+            dst++;
+        }
+        while (src >= n_used && cache.cells[src].seq_id < 0) {
+            src--;
+        }
+        if (dst >= n_used || src < n_used) {
+            break;
+        }
+
+        for (int il = 0; il < n_layer; ++il) {
+            memcpy(k + kv_cache_k_offs(cache, il, dst), k + kv_cache_k_offs(cache, il, src), k_row_size);
+
+            for (int h = 0; h < n_head; ++h) {
+                memcpy(v + kv_cache_v_offs(cache, n_head, il, h, dst), v + kv_cache_v_offs(cache, n_head, il, h, src), v_row_size);
+            }
+        }
+
+        cache.cells[dst] = cache.cells[src];
+        cache.cells[src] = llama_kv_cell();
+    }
+
+    cache.n = n_used;
+
+    kv_cache_release(cache);
+
+    return true;
+}
+
+struct llama_sampling_params llama_sampling_default_params() {
+    struct llama_sampling_params result = {
+        /*.temp                        =*/ 0.80f,
+        /*.top_k                       =*/ 40,
+        /*.top_p                       =*/ 0.95f,
+        /*.tfs_z                       =*/ 1.00f,
+        /*.typical_p                   =*/ 1.00f,
+        /*.repeat_penalty              =*/ 1.10f,
+        /*.alpha_frequency             =*/ 0.00f,
+        /*.alpha_presence              =*/ 0.00f,
+        /*.penalize_nl                 =*/ true,
+    };
+
+    return result;
+}
+
+struct llama_context_params llama_context_default_params() {
+    struct llama_context_params result = {
+        /*.n_ctx                       =*/ 512,
+        /*.n_parts                     =*/ -1,
+        /*.seed                        =*/ -1,
+        /*.f16_kv                      =*/ false,
+        /*.logits_all                  =*/ false,
+        /*.vocab_only                  =*/ false,
+        /*.use_mmap                    =*/ true,
+        /*.use_mlock                   =*/ false,
+        /*.embedding                   =*/ false,
+        /*.progress_callback           =*/ nullptr,
+        /*.progress_callback_user_data =*/ nullptr,
+        /*.kv_type_k                   =*/ LLAMA_KV_TYPE_DEFAULT,
+        /*.numa                        =*/ false,
+    };
+
+    return result;
+}
+
+bool llama_mmap_supported() {
+    return llama_mmap::SUPPORTED;
+}
+
+bool llama_mlock_supported() {
+    return llama_mlock::SUPPORTED;
+}
+
+//
+// model loading
+//
+
+static const char *llama_file_version_name(llama_file_version version) {
+    switch (version) {
+        case LLAMA_FILE_VERSION_GGML: return "'ggml' (old version with low tokenizer quality and no mmap support)";
+        case LLAMA_FILE_VERSION_GGMF_V1: return "ggmf v1 (old version with no mmap support)";
+        case LLAMA_FILE_VERSION_GGJT_V1: return "ggjt v1 (latest)";
+        default: LLAMA_ASSERT(false);
+    }
+}
+
+static const char *llama_ftype_name(enum llama_ftype ftype) {
+    switch (ftype) {
+        case LLAMA_FTYPE_ALL_F32:     return "all F32";
+        case LLAMA_FTYPE_MOSTLY_F16:  return "mostly F16";
+        case LLAMA_FTYPE_MOSTLY_Q4_0: return "mostly Q4_0";
+        case LLAMA_FTYPE_MOSTLY_Q4_1: return "mostly Q4_1";
+        case LLAMA_FTYPE_MOSTLY_Q4_1_SOME_F16:
+                                      return "mostly Q4_1, some F16";
+        case LLAMA_FTYPE_MOSTLY_Q4_2: return "mostly Q4_2";
+        case LLAMA_FTYPE_MOSTLY_Q5_0: return "mostly Q5_0";
+        case LLAMA_FTYPE_MOSTLY_Q5_1: return "mostly Q5_1";
+        case LLAMA_FTYPE_MOSTLY_Q8_0: return "mostly Q8_0";
+        default:                      return "unknown, may not work";
+    }
+}
+
+static const char *llama_model_type_name(e_model type) {
+    switch (type) {
+        case MODEL_7B: return "7B";
+        case MODEL_13B: return "13B";
+        case MODEL_30B: return "30B";
+        case MODEL_65B: return "65B";
+        default:        return "unknown";
+    }
+}
+
+static void llama_model_load_internal(
+        const std::string & fname,
+        llama_model & model,
+        int n_ctx,
+        ggml_type memory_type,
+        bool use_mmap,
+        bool use_mlock,
+        bool numa,
+        bool vocab_only,
+        llama_progress_callback progress_callback,
+        void * progress_callback_user_data) {
+
+    model.t_start_us = ggml_time_us();
+
+    std::unique_ptr<llama_model_loader> ml(new llama_model_loader(fname, use_mmap, vocab_only));
+
+    model.vocab = std::move(ml->file_loaders.at(0)->vocab);
+    model.vocab.trie.build(model.vocab.token_to_id);
+    model.hparams = ml->file_loaders.at(0)->hparams;
+    llama_file_version file_version = ml->file_loaders.at(0)->file_version;
+    auto & hparams = model.hparams;
+    uint32_t n_ff = ((2*(4*hparams.n_embd)/3 + hparams.n_mult - 1)/hparams.n_mult)*hparams.n_mult;
+
+    {
+        switch (hparams.n_layer) {
+            case 32: model.type = e_model::MODEL_7B; break;
+            case 40: model.type = e_model::MODEL_13B; break;
+            case 60: model.type = e_model::MODEL_30B; break;
+            case 80: model.type = e_model::MODEL_65B; break;
+        }
+
+        hparams.n_ctx = n_ctx;
+    }
+
+    {
+        fprintf(stderr, "%s: format     = %s\n",  __func__, llama_file_version_name(file_version));
+        fprintf(stderr, "%s: n_vocab    = %u\n",  __func__, hparams.n_vocab);
+        fprintf(stderr, "%s: n_ctx      = %u\n",  __func__, hparams.n_ctx);
+        fprintf(stderr, "%s: n_embd     = %u\n",  __func__, hparams.n_embd);
         fprintf(stderr, "%s: n_mult     = %u\n",  __func__, hparams.n_mult);
         fprintf(stderr, "%s: n_head     = %u\n",  __func__, hparams.n_head);
         fprintf(stderr, "%s: n_layer    = %u\n",  __func__, hparams.n_layer);
@@ -922,6 +1485,12 @@ static void llama_model_load_internal(
         return;
     }
 
+    if (numa) {
+        // before the threads of the contexts are created
+        ggml_numa_init();
+        fprintf(stderr, "%s: numa nodes = %d\n", __func__, ggml_numa_n_nodes());
+    }
+
     auto & ctx = model.ctx;
 
     size_t ctx_size, mmapped_size;
@@ -930,35 +1499,34 @@ static void llama_model_load_internal(
 
     // print memory requirements
     {
-        const size_t scale = memory_type == GGML_TYPE_F32 ? 2 : 1;
-
-        // this is the total memory required to run the inference
+        // this is the memory required by the weights, the compute buffer of each context is measured when it is created
         const size_t mem_required =
             ctx_size +
-            mmapped_size +
-            MEM_REQ_SCRATCH0().at(model.type) +
-            MEM_REQ_SCRATCH1().at(model.type) +
-            MEM_REQ_EVAL().at(model.type);
+            mmapped_size;
 
-        // this is the memory required by one llama_state
+        // this is the memory required by the KV cache of one llama_state with a full context
         const size_t mem_required_state =
-            scale*MEM_REQ_KV_SELF().at(model.type);
+            2*(size_t) hparams.n_layer*hparams.n_ctx*hparams.n_embd*ggml_type_size(memory_type);
 
-        fprintf(stderr, "%s: mem required  = %7.2f MB (+ %7.2f MB per state)\n", __func__,
+        fprintf(stderr, "%s: mem required  = %7.2f MB (+ up to %7.2f MB per state)\n", __func__,
                 mem_required / 1024.0 / 1024.0, mem_required_state / 1024.0 / 1024.0);
     }
 
     // create the ggml context
     {
-        lctx.model.buf.resize(ctx_size);
+        model.buf.resize(ctx_size);
+        if (numa && !ml->use_mmap) {
+            // the weights are read into the buffer by the loading threads, spread their pages over the nodes
+            ggml_numa_interleave(model.buf.addr, model.buf.size);
+        }
         if (use_mlock) {
-            lctx.model.mlock_buf.init(lctx.model.buf.addr);
-            lctx.model.mlock_buf.grow_to(lctx.model.buf.size);
+            model.mlock_buf.init(model.buf.addr);
+            model.mlock_buf.grow_to(model.buf.size);
         }
 
         struct ggml_init_params params = {
-            /*.mem_size   =*/ lctx.model.buf.size,
-            /*.mem_buffer =*/ lctx.model.buf.addr,
+            /*.mem_size   =*/ model.buf.size,
+            /*.mem_buffer =*/ model.buf.addr,
             /*.no_alloc   =*/ ml->use_mmap,
         };
 
@@ -1010,27 +1578,28 @@ static void llama_model_load_internal(
         model.tensors_by_name.emplace_back(lt.name, lt.ggml_tensor);
     }
 
-    ml->load_all_data(progress_callback, progress_callback_user_data, use_mlock ? &lctx.model.mlock_mmap : NULL);
+    ml->load_all_data(progress_callback, progress_callback_user_data, use_mlock ? &model.mlock_mmap : NULL, numa);
 
     model.mapping = std::move(ml->mapping);
 
     // loading time will be recalculate after the first eval, so
     // we take page faults deferred by mmap() into consideration
-    lctx.t_load_us = ggml_time_us() - lctx.t_start_us;
+    model.t_load_us = ggml_time_us() - model.t_start_us;
 }
 
 static bool llama_model_load(
         const std::string & fname,
-        llama_context & lctx,
+        llama_model & model,
         int n_ctx,
         ggml_type memory_type,
         bool use_mmap,
         bool use_mlock,
+        bool numa,
         bool vocab_only,
         llama_progress_callback progress_callback,
         void *progress_callback_user_data) {
     try {
-        llama_model_load_internal(fname, lctx, n_ctx, memory_type, use_mmap, use_mlock,
+        llama_model_load_internal(fname, model, n_ctx, memory_type, use_mmap, use_mlock, numa,
                                   vocab_only, progress_callback, progress_callback_user_data);
         return true;
     } catch (const std::string & err) {
@@ -1039,97 +1608,144 @@ static bool llama_model_load(
     }
 }
 
-// evaluate the transformer
+// build the graph of an eval into lctx.graph and allocate its data in lctx.buf_alloc
 //
-//   - lctx:      llama context
-//   - tokens:    new batch of tokens to process
-//   - n_past:    the context size so far
-//   - n_threads: number of threads to use
+//   - kv_head: cell the first new token is stored in
+//   - n_kv:    number of cells the tokens attend to
+//   - batch:   the tokens have their own positions and sequences (llama_eval_batch)
+//   - measure: the graph only sizes buf_alloc, the blocks of the KV cells are not allocated
 //
-static bool llama_eval_internal(
-        llama_context & lctx,
-    const llama_token * tokens,
-            const int   n_tokens,
-            const int   n_past,
-            const int   n_threads) {
-    const int64_t t_start_us = ggml_time_us();
-
-    const int N = n_tokens;
-
+static void llama_build_graph(
+         llama_context & lctx,
+             const int   N,
+             const int   n_outputs,
+             const int   n_past,
+             const int   kv_head,
+             const int   n_kv,
+             const int   n_threads,
+            const bool   batch,
+            const bool   measure) {
     const auto & model   = lctx.model;
     const auto & hparams = model.hparams;
 
-    auto & kv_self = model.kv_self;
-
-    LLAMA_ASSERT(!!kv_self.ctx);
+    const auto & kv_self = lctx.kv_self;
+    const auto & pool    = *kv_self.pool;
 
     const int n_embd  = hparams.n_embd;
     const int n_layer = hparams.n_layer;
-    const int n_ctx   = hparams.n_ctx;
     const int n_head  = hparams.n_head;
-    const int n_vocab = hparams.n_vocab;
     const int n_rot   = hparams.n_embd/hparams.n_head;
 
-    auto & mem_per_token = lctx.mem_per_token;
-    auto & buf_compute   = lctx.buf_compute;
+    auto & buf_compute = lctx.buf_compute;
+    auto & buf_alloc   = lctx.buf_alloc;
+    auto & graph       = lctx.graph;
+
+    // the previous graph lives in the same buffers
+    if (graph.ctx) {
+        ggml_free(graph.ctx);
+    }
 
     struct ggml_init_params params = {
         /*.mem_size   =*/ buf_compute.size,
         /*.mem_buffer =*/ buf_compute.addr,
-        /*.no_alloc   =*/ false,
+        /*.no_alloc   =*/ true,
     };
 
-    struct ggml_context * ctx0 = ggml_init(params);
+    graph.ctx  = ggml_init(params);
+    graph.gf   = {};
+    graph.n_kv = 0;
+
+    graph.rope_q.clear();
+    graph.rope_k.clear();
+    graph.attn.clear();
+    graph.k_store.clear();
+    graph.v_store.clear();
+
+    struct ggml_context * ctx0 = graph.ctx;
 
     // for big prompts, if BLAS is enabled, it is better to use only one thread
     // otherwise, the threads are spin-lock waiting for the BLAS calls and are degrading the performance
-    ggml_cgraph gf = {};
+    ggml_cgraph & gf = graph.gf;
     gf.n_threads = N >= 32 && ggml_cpu_has_blas() && !ggml_cpu_has_gpublas() ? 1 : n_threads;
 
     struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
     ggml_set_name(embd, "embd");
-    memcpy(embd->data, tokens, N*ggml_element_size(embd));
 
     struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.tok_embeddings, embd);
 
+    // rows of the batch that go through the lm_head, if not all of them
+    struct ggml_tensor * out_ids = NULL;
+
+    if (n_outputs < N) {
+        out_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, std::max(n_outputs, 1));
+        ggml_set_name(out_ids, "out_ids");
+    }
+
+    // the blocks of the KV cells, set before each compute: the blocks can change when the graph is reused
+    struct ggml_tensor * kv_blocks = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, kv_self.blocks.size());
+    ggml_set_name(kv_blocks, "kv_blocks");
+
+    // per-token positions and attention mask for the batch of sequences, set before the compute
+    struct ggml_tensor * KQ_pos  = NULL;
+    struct ggml_tensor * KQ_mask = NULL;
+
+    if (batch) {
+        KQ_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+        ggml_set_name(KQ_pos, "KQ_pos");
+
+        KQ_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv, N);
+        ggml_set_name(KQ_mask, "KQ_mask");
+    }
+
     for (int il = 0; il < n_layer; ++il) {
         struct ggml_tensor * inpSA = inpL;
 
         struct ggml_tensor * cur;
 
-        lctx.use_buf(ctx0, 0);
-
         // norm
         {
-            cur = ggml_rms_norm(ctx0, inpL);
-
-            // cur = attention_norm*cur
-            cur = ggml_mul(ctx0,
-                        ggml_repeat(ctx0, model.layers[il].attention_norm, cur),
-                        cur);
+            // cur = attention_norm*rms_norm(inpL)
+            cur = ggml_rms_norm_mul(ctx0, inpL, model.layers[il].attention_norm);
         }
 
         // self-attention
         {
             // compute Q and K and RoPE them
-            struct ggml_tensor * Qcur = ggml_rope(ctx0, ggml_reshape_3d(ctx0, ggml_mul_mat(ctx0, model.layers[il].wq, cur), n_embd/n_head, n_head, N), n_past, n_rot, 0);
-            struct ggml_tensor * Kcur = ggml_rope(ctx0, ggml_reshape_3d(ctx0, ggml_mul_mat(ctx0, model.layers[il].wk, cur), n_embd/n_head, n_head, N), n_past, n_rot, 0);
+            struct ggml_tensor * Qcur = ggml_reshape_3d(ctx0, ggml_mul_mat(ctx0, model.layers[il].wq, cur), n_embd/n_head, n_head, N);
+            struct ggml_tensor * Kcur = ggml_reshape_3d(ctx0, ggml_mul_mat(ctx0, model.layers[il].wk, cur), n_embd/n_head, n_head, N);
+            Qcur = batch ? ggml_rope_pos(ctx0, Qcur, KQ_pos, n_rot, 0) : ggml_rope(ctx0, Qcur, n_past, n_rot, 0);
+            Kcur = batch ? ggml_rope_pos(ctx0, Kcur, KQ_pos, n_rot, 0) : ggml_rope(ctx0, Kcur, n_past, n_rot, 0);
             ggml_set_name(Qcur, "Qcur");
             ggml_set_name(Kcur, "Kcur");
 
+            graph.rope_q.push_back(Qcur);
+            graph.rope_k.push_back(Kcur);
+
             // store key and value to memory
             {
-                // compute the transposed [N, n_embd] V matrix
-                struct ggml_tensor * Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, ggml_mul_mat(ctx0, model.layers[il].wv, cur), n_embd, N));
+                // the [n_embd/n_head, N, n_head] V matrix, the tokens of a head are stored next to each other
+                struct ggml_tensor * Vcur = ggml_permute(ctx0,
+                        ggml_reshape_3d(ctx0, ggml_mul_mat(ctx0, model.layers[il].wv, cur), n_embd/n_head, n_head, N),
+                        0, 2, 1, 3);
+
+                // the cells of the tokens are contiguous within a block, one copy per block
+                for (int i = 0, n; i < N; i += n) {
+                    n = kv_cache_run(kv_head + i, kv_head + N);
+
+                    const size_t k_offs = measure ? 0 : kv_cache_k_offs(kv_self, il, kv_head + i);
+                    const size_t v_offs = measure ? 0 : kv_cache_v_offs(kv_self, n_head, il, 0, kv_head + i);
+
+                    struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, n*n_embd, k_offs);
+                    struct ggml_tensor * v = ggml_view_3d(ctx0, kv_self.v, n_embd/n_head, n, n_head,
+                            pool.v_row_size, pool.v_row_size*LLAMA_KV_BLOCK_SIZE, v_offs);
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_embd, (ggml_element_size(kv_self.k)*n_embd)*(il*n_ctx + n_past));
-                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, N, n_embd,
-                        (   n_ctx)*ggml_element_size(kv_self.v),
-                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_embd + n_past*ggml_element_size(kv_self.v));
+                    // important: storing RoPE-ed version of K in the KV cache!
+                    graph.k_store.push_back(ggml_cpy(ctx0, ggml_view_1d(ctx0, Kcur, n*n_embd, i*Kcur->nb[2]), k));
+                    graph.v_store.push_back(ggml_cpy(ctx0, ggml_view_3d(ctx0, Vcur, n_embd/n_head, n, n_head, Vcur->nb[1], Vcur->nb[2], i*Vcur->nb[1]), v));
 
-                // important: storing RoPE-ed version of K in the KV cache!
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
+                    ggml_build_forward_expand(&gf, graph.k_store.back());
+                    ggml_build_forward_expand(&gf, graph.v_store.back());
+                }
             }
 
             struct ggml_tensor * Q =
@@ -1138,62 +1754,34 @@ static bool llama_eval_internal(
                         0, 2, 1, 3);
             ggml_set_name(Q, "Q");
 
+            // the first n_kv cells of each head of cached K and V, as in the first block of the pool:
+            // the attention finds the cells of the other blocks with kv_blocks
             struct ggml_tensor * K =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0,
-                            ggml_view_1d(ctx0, kv_self.k, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(kv_self.k)*n_embd),
-                            n_embd/n_head, n_head, n_past + N),
-                        0, 2, 1, 3);
+                ggml_view_3d(ctx0, kv_self.k,
+                        n_embd/n_head, n_kv, n_head,
+                        pool.k_row_size,
+                        kv_cache_nbytes(kv_self.k, n_embd/n_head),
+                        il*LLAMA_KV_BLOCK_SIZE*pool.k_row_size);
             ggml_set_name(K, "K");
 
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-            ggml_set_name(KQ, "KQ");
-
-            // KQ_scaled = KQ / sqrt(n_embd/n_head)
-            struct ggml_tensor * KQ_scale = ggml_new_f32(ctx0, 1.0f/sqrtf(float(n_embd)/n_head));
-            ggml_set_name(KQ_scale, "1/sqrt(n_embd/n_head)");
-
-            struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQ_scale);
-            ggml_set_name(KQ_scaled, "KQ_scaled");
-
-            // KQ_masked = mask_past(KQ_scaled)
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
-            ggml_set_name(KQ_masked, "KQ_masked");
-
-            // KQ = soft_max(KQ_masked)
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
-            ggml_set_name(KQ_soft_max, "KQ_soft_max");
-
-            // split cached V into n_head heads
             struct ggml_tensor * V =
                 ggml_view_3d(ctx0, kv_self.v,
-                        n_past + N, n_embd/n_head, n_head,
-                        n_ctx*ggml_element_size(kv_self.v),
-                        n_ctx*ggml_element_size(kv_self.v)*n_embd/n_head,
-                        il*n_ctx*ggml_element_size(kv_self.v)*n_embd);
+                        n_embd/n_head, n_kv, n_head,
+                        pool.v_row_size,
+                        pool.v_row_size*LLAMA_KV_BLOCK_SIZE,
+                        il*n_head*LLAMA_KV_BLOCK_SIZE*pool.v_row_size);
             ggml_set_name(V, "V");
 
-#if 1
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+            // KQV = soft_max(mask_past(K*Q/sqrt(n_embd/n_head)))*V, computed block by block without storing KQ
+            // the heads of each token are merged in the result
+            struct ggml_tensor * KQV = ggml_flash_attn_ext_paged(ctx0, Q, K, V, KQ_mask,
+                    kv_blocks, LLAMA_KV_BLOCK_SIZE, pool.k_stride, pool.v_stride, 1.0f/sqrtf(float(n_embd)/n_head), n_past);
             ggml_set_name(KQV, "KQV");
-#else
-            // make V contiguous in memory to speed up the matmul, however we waste time on the copy
-            // on M1 this is faster for the perplexity computation, but ~5% slower for the single-token generation
-            // is there a better way?
-            struct ggml_tensor * V_cont = ggml_cpy(ctx0, V, ggml_new_tensor_3d(ctx0, kv_self.v->type, n_past + N, n_embd/n_head, n_head));
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_cont, KQ_soft_max);
-#endif
 
-            // KQV_merged = KQV.permute(0, 2, 1, 3)
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-            ggml_set_name(KQV_merged, "KQV_merged");
+            graph.attn.push_back(KQV);
 
-            // cur = KQV_merged.contiguous().view(n_embd, N)
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
-            ggml_set_name(cur, "KQV_merged_contiguous");
+            // cur = KQV.view(n_embd, N)
+            cur = ggml_reshape_2d(ctx0, KQV, n_embd, N);
 
             // projection (no bias)
             cur = ggml_mul_mat(ctx0,
@@ -1201,75 +1789,258 @@ static bool llama_eval_internal(
                     cur);
         }
 
-        lctx.use_buf(ctx0, 1);
-
         struct ggml_tensor * inpFF = ggml_add(ctx0, cur, inpSA);
 
         // feed-forward network
         {
             // norm
             {
-                cur = ggml_rms_norm(ctx0, inpFF);
-
-                // cur = ffn_norm*cur
-                cur = ggml_mul(ctx0,
-                        ggml_repeat(ctx0, model.layers[il].ffn_norm, cur),
-                        cur);
+                // cur = ffn_norm*rms_norm(inpFF)
+                cur = ggml_rms_norm_mul(ctx0, inpFF, model.layers[il].ffn_norm);
             }
 
-            struct ggml_tensor * tmp = ggml_mul_mat(ctx0,
+            // cur = silu(w1*cur) * (w3*cur)
+            cur = ggml_mul_mat_swiglu(ctx0,
+                    model.layers[il].w1,
                     model.layers[il].w3,
                     cur);
 
             cur = ggml_mul_mat(ctx0,
-                    model.layers[il].w1,
+                    model.layers[il].w2,
                     cur);
+        }
 
-            // SILU activation
-            cur = ggml_silu(ctx0, cur);
-
-            cur = ggml_mul(ctx0, cur, tmp);
-
-            cur = ggml_mul_mat(ctx0,
-                    model.layers[il].w2,
-                    cur);
-        }
-
-        cur = ggml_add(ctx0, cur, inpFF);
+        cur = ggml_add(ctx0, cur, inpFF);
 
         // input for next layer
         inpL = cur;
     }
 
-    lctx.use_buf(ctx0, 0);
-
     // used at the end to optionally extract the embeddings
     struct ggml_tensor * embeddings = NULL;
 
     // norm
     {
-
-        inpL = ggml_rms_norm(ctx0, inpL);
-
-        // inpL = norm*inpL
-        inpL = ggml_mul(ctx0,
-                    ggml_repeat(ctx0, model.norm, inpL),
-                    inpL);
+        // inpL = norm*rms_norm(inpL)
+        inpL = ggml_rms_norm_mul(ctx0, inpL, model.norm);
 
         embeddings = inpL;
     }
 
     // lm_head
-    inpL = ggml_mul_mat(ctx0, model.output, inpL);
-
-    lctx.use_buf(ctx0, -1);
+    if (n_outputs > 0) {
+        if (out_ids) {
+            inpL = ggml_get_rows(ctx0, inpL, out_ids);
+        }
+        inpL = ggml_mul_mat(ctx0, model.output, inpL);
+    } else {
+        inpL = NULL;
+    }
 
     // logits -> probs
     //inpL = ggml_soft_max(ctx0, inpL);
 
+    ggml_build_forward_expand(&gf, inpL ? inpL : embeddings);
+
+    // the intermediate results share the memory of the ones that are no longer needed, the embeddings are kept
+    // the buffer grows if the batch is larger than the one it was measured with
+    size_t size_alloc = ggml_graph_alloc(ctx0, &gf, &embeddings, 1, buf_alloc.addr, buf_alloc.size);
+    if (size_alloc > buf_alloc.size) {
+        buf_alloc.resize(size_alloc);
+        ggml_graph_alloc(ctx0, &gf, &embeddings, 1, buf_alloc.addr, buf_alloc.size);
+    }
+
+    lctx.alloc_peak = std::max(lctx.alloc_peak, size_alloc);
+
+    graph.embd       = embd;
+    graph.out_ids    = out_ids;
+    graph.kv_blocks  = kv_blocks;
+    graph.KQ_pos     = KQ_pos;
+    graph.KQ_mask    = KQ_mask;
+    graph.logits     = inpL;
+    graph.embeddings = embeddings;
+}
+
+// move a single-token graph to a new n_past: the rope and mask parameters and the cells the new K and V are stored in
+static void llama_graph_set_n_past(
+             llama_graph & graph,
+    const llama_kv_cache & kv_self,
+     const llama_hparams & hparams,
+                     int   n_past) {
+    const int n_head = hparams.n_head;
+
+    for (int il = 0; il < (int) graph.k_store.size(); ++il) {
+        ((int32_t *) graph.rope_q[il]->src1->data)[0] = n_past;
+        ((int32_t *) graph.rope_k[il]->src1->data)[0] = n_past;
+        ((int32_t *) graph.attn[il]->opt[2]->data)[0] = n_past;
+
+        // the cpy node writes to its own view of the destination
+        struct ggml_tensor * k = graph.k_store[il];
+        struct ggml_tensor * v = graph.v_store[il];
+
+        k->data = k->src1->data = (char *) kv_self.k->data + kv_cache_k_offs(kv_self, il, n_past);
+        v->data = v->src1->data = (char *) kv_self.v->data + kv_cache_v_offs(kv_self, n_head, il, 0, n_past);
+    }
+}
+
+// (re)create the worker threads only when the requested number changes
+static void llama_threadpool_resize(llama_context & lctx, int n_threads) {
+    if (ggml_threadpool_n_threads(lctx.threadpool) != n_threads) {
+        ggml_threadpool_free(lctx.threadpool);
+        lctx.threadpool = n_threads > 1 ? ggml_threadpool_new(n_threads) : NULL;
+    }
+}
+
+// evaluate the transformer
+//
+//   - lctx:      llama context
+//   - tokens:    new batch of tokens to process
+//   - n_past:    the context size so far
+//   - n_threads: number of threads to use
+//
+// if seq_id is NULL, the tokens are at positions n_past, n_past + 1, ... of the sequence held by the cache (llama_eval)
+// otherwise tokens[i] is at position pos[i] of the sequence seq_id[i] (llama_eval_batch)
+static bool llama_eval_internal(
+         llama_context & lctx,
+     const llama_token * tokens,
+             const int   n_tokens,
+             const int   n_past,
+             const int   n_threads,
+             const int * pos,
+    const llama_seq_id * seq_id,
+            const bool * need_logits) {
+    const int64_t t_start_us = ggml_time_us();
+
+    const int N = n_tokens;
+
+    const auto & model   = lctx.model;
+    const auto & hparams = model.hparams;
+
+    auto & kv_self = lctx.kv_self;
+
+    LLAMA_ASSERT(!!kv_self.pool);
+
+    const int n_embd  = hparams.n_embd;
+    const int n_ctx   = lctx.n_ctx;
+    const int n_vocab = hparams.n_vocab;
+
+    auto & graph = lctx.graph;
+
+    const bool batch = seq_id != nullptr;
+
+    // cell to store the first new token in, and number of cells the tokens attend to
+    int kv_head = n_past;
+    int n_kv    = n_past + N;
+
+    if (batch) {
+        for (int i = 0; i < N; ++i) {
+            if (seq_id[i] < 0 || pos[i] < 0) {
+                fprintf(stderr, "%s: invalid sequence %d / position %d for token %d\n", __func__, seq_id[i], pos[i], i);
+                return false;
+            }
+        }
+
+        kv_head = kv_cache_find_slot(kv_self, N);
+        if (kv_head < 0 && kv_cache_defrag(kv_self, hparams)) {
+            // the free cells are spread between the sequences, they are together after the used ones now
+            kv_head = kv_cache_find_slot(kv_self, N);
+        }
+        if (kv_head < 0) {
+            fprintf(stderr, "%s: no room for %d tokens in the KV cache\n", __func__, N);
+            return false;
+        }
+
+        n_kv = std::max(kv_self.n, kv_head + N);
+
+        for (int i = 0; i < N; ++i) {
+            lctx.kv_self.cells[kv_head + i].pos    = pos[i];
+            lctx.kv_self.cells[kv_head + i].seq_id = seq_id[i];
+        }
+    } else {
+        if (n_past < 0 || n_past + N > n_ctx) {
+            fprintf(stderr, "%s: %d tokens after n_past = %d do not fit in n_ctx = %d\n", __func__, N, n_past, n_ctx);
+            return false;
+        }
+
+        kv_cache_reset_cells(lctx.kv_self, n_past + N);
+    }
+
+    if (!kv_cache_alloc(kv_self, kv_head, kv_head + N)) {
+        // the tokens are not stored
+        for (int i = 0; i < N; ++i) {
+            kv_self.cells[kv_head + i] = llama_kv_cell();
+        }
+        kv_cache_release(kv_self);
+        return false;
+    }
+
+    llama_threadpool_resize(lctx, n_threads);
+
+    // the lm_head runs only on the rows the logits are returned for
+    auto & output_ids = lctx.output_ids;
+
+    output_ids.clear();
+    for (int i = 0; i < N; ++i) {
+        if (need_logits ? need_logits[i] : lctx.logits_all || batch || i == N - 1) {
+            output_ids.push_back(i);
+        }
+    }
+
+    const int n_outputs = output_ids.size();
+
+    // single-token evals attend to a multiple of LLAMA_GRAPH_KV_PAD cells (the cells after n_past are masked),
+    // so the graph of the previous token can be moved to the new n_past and executed again
+    const bool reusable = !batch && N == 1 && n_outputs == 1;
+
+    if (reusable) {
+        n_kv = std::min(n_ctx, (n_kv + LLAMA_GRAPH_KV_PAD - 1)/LLAMA_GRAPH_KV_PAD*LLAMA_GRAPH_KV_PAD);
+    }
+
+    if (reusable && graph.n_kv == n_kv && graph.gf.n_threads == n_threads) {
+        llama_graph_set_n_past(graph, kv_self, hparams, n_past);
+
+        lctx.n_graph_reuse++;
+    } else {
+        const int64_t t_build_start_us = ggml_time_us();
+
+        llama_build_graph(lctx, N, n_outputs, n_past, kv_head, n_kv, n_threads, batch, false);
+
+        if (reusable) {
+            graph.n_kv = n_kv;
+
+            lctx.t_graph_build_us += ggml_time_us() - t_build_start_us;
+            lctx.n_graph_build++;
+        }
+    }
+
+    struct ggml_context * ctx0 = graph.ctx;
+
+    ggml_cgraph & gf = graph.gf;
+
+    struct ggml_tensor * inpL       = graph.logits;
+    struct ggml_tensor * embeddings = graph.embeddings;
+
+    memcpy(graph.embd->data, tokens, N*ggml_element_size(graph.embd));
+    memcpy(graph.kv_blocks->data, kv_self.blocks.data(), ggml_nbytes(graph.kv_blocks));
+    if (graph.out_ids && n_outputs > 0) {
+        memcpy(graph.out_ids->data, output_ids.data(), n_outputs*ggml_element_size(graph.out_ids));
+    }
+
+    if (batch) {
+        memcpy(graph.KQ_pos->data, pos, N*ggml_element_size(graph.KQ_pos));
+
+        // token j attends to cell i if it holds an earlier token of the same sequence
+        float * data = (float *) graph.KQ_mask->data;
+        for (int j = 0; j < N; ++j) {
+            for (int i = 0; i < n_kv; ++i) {
+                const auto & cell = kv_self.cells[i];
+                data[j*n_kv + i] = cell.seq_id == seq_id[j] && cell.pos <= pos[j] ? 0.0f : -INFINITY;
+            }
+        }
+    }
+
     // run the computation
-    ggml_build_forward_expand(&gf, inpL);
-    ggml_graph_compute       (ctx0, &gf);
+    ggml_graph_compute_pool  (ctx0, &gf, lctx.threadpool);
 
 #ifdef GGML_PERF
     // print timing information per ggml operation (for debugging purposes)
@@ -1286,19 +2057,15 @@ static bool llama_eval_internal(
     //memcpy(embd_w.data(), ggml_get_data(inpL), sizeof(float)*n_vocab*N);
 
     // update kv token count
-    lctx.model.kv_self.n = n_past + N;
+    lctx.kv_self.n = batch ? n_kv : n_past + N;
 
-    // extract logits
+    // extract logits, one row per selected token
     {
         auto & logits_out = lctx.logits;
 
-        if (lctx.logits_all) {
-            logits_out.resize(n_vocab * N);
-            memcpy(logits_out.data(), (float *) ggml_get_data(inpL), sizeof(float)*n_vocab*N);
-        } else {
-            // return result for just the last token
-            logits_out.resize(n_vocab);
-            memcpy(logits_out.data(), (float *) ggml_get_data(inpL) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
+        logits_out.resize(n_vocab*n_outputs);
+        if (n_outputs > 0) {
+            memcpy(logits_out.data(), (float *) ggml_get_data(inpL), sizeof(float)*n_vocab*n_outputs);
         }
     }
 
@@ -1310,19 +2077,12 @@ static bool llama_eval_internal(
         memcpy(embedding_out.data(), (float *) ggml_get_data(embeddings) + (n_embd*(N - 1)), sizeof(float)*n_embd);
     }
 
-    if (mem_per_token == 0) {
-        mem_per_token = ggml_used_mem(ctx0)/N;
-    }
-
 #if 0
-    printf("\n%s: used_mem = %.3f MB, scratch -- %.3f MB %.3f MB\n", __func__,
+    printf("\n%s: used_mem = %.3f MB, compute buffer = %.3f MB\n", __func__,
             ggml_used_mem(ctx0)/1024.0/1024.0,
-            lctx.get_buf_max_mem(0)/1024.0/1024.0,
-            lctx.get_buf_max_mem(1)/1024.0/1024.0);
+            lctx.buf_alloc.size/1024.0/1024.0);
 #endif
 
-    ggml_free(ctx0);
-
     // measure the performance only for the single-token evals
     if (N == 1) {
         lctx.t_eval_us += ggml_time_us() - t_start_us;
@@ -1336,6 +2096,116 @@ static bool llama_eval_internal(
     return true;
 }
 
+// drop the tokens [n_keep, n_keep + n_discard) of the llama_eval sequence and move the following ones down
+// the keys are stored RoPE-ed and the rotations compose, so rotating them by -n_discard gives the keys of
+// their new positions without evaluating the tokens again
+static bool llama_kv_cache_shift_internal(
+         llama_context & lctx,
+             const int   n_keep,
+             const int   n_discard,
+             const int   n_threads) {
+    auto & kv_self = lctx.kv_self;
+
+    const auto & hparams = lctx.model.hparams;
+
+    const int n_embd  = hparams.n_embd;
+    const int n_head  = hparams.n_head;
+    const int n_rot   = hparams.n_embd/hparams.n_head; // as in llama_build_graph
+    const int n_layer = hparams.n_layer;
+    const int n_past  = kv_self.n;
+
+    if (n_keep < 0 || n_discard < 0 || n_keep + n_discard > n_past) {
+        fprintf(stderr, "%s: cannot discard tokens [%d, %d) of the %d tokens in the KV cache\n",
+                __func__, n_keep, n_keep + n_discard, n_past);
+        return false;
+    }
+
+    const int n_move = n_past - n_keep - n_discard;
+
+    const auto & pool = *kv_self.pool;
+
+    if (n_move > 0 && n_discard > 0) {
+        // the blocks of the moved cells are written, they must not be shared
+        if (!kv_cache_alloc(kv_self, n_keep, n_keep + n_move)) {
+            return false;
+        }
+
+        uint8_t * k = (uint8_t *) kv_self.k->data;
+        uint8_t * v = (uint8_t *) kv_self.v->data;
+
+        // the cells are moved down by runs that are contiguous in both their old and new blocks
+        for (int i = 0, n; i < n_move; i += n) {
+            const int c_dst = n_keep + i;
+            const int c_src = n_keep + n_discard + i;
+
+            n = std::min(kv_cache_run(c_dst, n_keep + n_move), kv_cache_run(c_src, n_past));
+
+            for (int il = 0; il < n_layer; ++il) {
+                memmove(k + kv_cache_k_offs(kv_self, il, c_dst), k + kv_cache_k_offs(kv_self, il, c_src), n*pool.k_row_size);
+
+                for (int h = 0; h < n_head; ++h) {
+                    memmove(v + kv_cache_v_offs(kv_self, n_head, il, h, c_dst),
+                            v + kv_cache_v_offs(kv_self, n_head, il, h, c_src), n*pool.v_row_size);
+                }
+            }
+        }
+
+        llama_threadpool_resize(lctx, n_threads);
+
+        // the tensor objects of the graph of one layer, and its data: the moved keys in F32, their rotated copy and
+        // the work buffer of the quantizing cpy, placed by ggml_graph_alloc
+        std::vector<uint8_t> buf(ggml_graph_overhead());
+        std::vector<uint8_t> buf_alloc;
+
+        for (int il = 0; il < n_layer; ++il) {
+            struct ggml_init_params params = { buf.size(), buf.data(), true };
+
+            struct ggml_context * ctx0 = ggml_init(params);
+
+            struct ggml_tensor * rows = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_move);
+            struct ggml_tensor * pos  = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_move);
+
+            ggml_cgraph gf = {};
+            gf.n_threads = n_threads;
+
+            // get_rows dequantizes the keys, the cpy back quantizes them again, one block at a time
+            for (int i = 0, n; i < n_move; i += n) {
+                n = kv_cache_run(n_keep + i, n_keep + n_move);
+
+                const size_t offs = kv_cache_k_offs(kv_self, il, n_keep + i);
+
+                struct ggml_tensor * k = ggml_view_2d(ctx0, kv_self.k, n_embd, n, pool.k_row_size, offs);
+
+                struct ggml_tensor * cur = ggml_get_rows(ctx0, k, ggml_view_1d(ctx0, rows, n, 0));
+                cur = ggml_rope_pos(ctx0, ggml_reshape_3d(ctx0, cur, n_embd/n_head, n_head, n), ggml_view_1d(ctx0, pos, n, 0), n_rot, 0);
+                cur = ggml_cpy(ctx0, cur, ggml_view_1d(ctx0, kv_self.k, n*n_embd, offs));
+
+                ggml_build_forward_expand(&gf, cur);
+            }
+
+            const size_t size_alloc = ggml_graph_alloc(ctx0, &gf, NULL, 0, buf_alloc.data(), buf_alloc.size());
+            if (size_alloc > buf_alloc.size()) {
+                buf_alloc.resize(size_alloc);
+                ggml_graph_alloc(ctx0, &gf, NULL, 0, buf_alloc.data(), buf_alloc.size());
+            }
+
+            for (int i = 0; i < n_move; ++i) {
+                ((int32_t *) rows->data)[i] = i;
+                ((int32_t *) pos->data)[i]  = -n_discard;
+            }
+
+            ggml_graph_compute_pool(ctx0, &gf, lctx.threadpool);
+
+            ggml_free(ctx0);
+        }
+    }
+
+    kv_self.n = n_past - n_discard;
+    kv_cache_reset_cells(kv_self, kv_self.n);
+
+    return true;
+}
+
 //
 // tokenizer
 //
@@ -1352,41 +2222,48 @@ struct llama_sp_symbol {
     index next;
     const char * text;
     size_t n;
+    int32_t node; // trie node of text, -1 if no token starts with it
 };
 
 struct llama_sp_bigram {
     struct comparator {
-        bool operator()(llama_sp_bigram & l, llama_sp_bigram & r) {
+        bool operator()(const llama_sp_bigram & l, const llama_sp_bigram & r) const {
             return (l.score < r.score) || (l.score == r.score && l.left > r.left);
         }
     };
     using queue_storage = std::vector<llama_sp_bigram>;
-    using queue = std::priority_queue<llama_sp_bigram, queue_storage, comparator>;
     llama_sp_symbol::index left;
     llama_sp_symbol::index right;
     float score;
     size_t size;
+    int32_t node;
 };
 
 // original implementation:
 // https://github.com/ggerganov/llama.cpp/commit/074bea2eb1f1349a0118239c4152914aecaa1be4
+//
+// the symbols and the work queue are kept between calls, a context tokenizes without allocating once they have grown
 struct llama_tokenizer {
     llama_tokenizer(const llama_vocab & vocab): vocab_(vocab) {}
 
-    void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
+    void tokenize(const char * text, size_t len, std::vector<llama_vocab::id> & output) {
+        symbols_.clear();
+        work_queue_.clear();
+
         // split string into utf8 chars
         int index = 0;
         size_t offs = 0;
-        while (offs < text.size()) {
+        while (offs < len) {
             llama_sp_symbol sym;
-            size_t char_len = std::min(text.size() - offs, utf8_len(text[offs]));
-            sym.text = text.c_str() + offs;
+            size_t char_len = std::min(len - offs, utf8_len(text[offs]));
+            sym.text = text + offs;
             sym.n = char_len;
+            sym.node = vocab_.trie.walk(0, sym.text, sym.n);
             offs += char_len;
             sym.prev = index - 1;
-            sym.next = offs == text.size() ? -1 : index + 1;
+            sym.next = offs == len ? -1 : index + 1;
             index++;
-            symbols_.emplace_back(std::move(sym));
+            symbols_.emplace_back(sym);
         }
 
         // seed the work queue with all possible 2-character tokens.
@@ -1396,8 +2273,9 @@ struct llama_tokenizer {
 
         // keep substituting the highest frequency pairs for as long as we can.
         while (!work_queue_.empty()) {
-            auto bigram = work_queue_.top();
-            work_queue_.pop();
+            std::pop_heap(work_queue_.begin(), work_queue_.end(), llama_sp_bigram::comparator());
+            auto bigram = work_queue_.back();
+            work_queue_.pop_back();
 
             auto & left_sym = symbols_[bigram.left];
             auto & right_sym = symbols_[bigram.right];
@@ -1410,6 +2288,7 @@ struct llama_tokenizer {
 
             // merge the right sym into the left one
             left_sym.n += right_sym.n;
+            left_sym.node = bigram.node;
             right_sym.n = 0;
 
             //printf("left = '%*s' size = %zu\n", (int) left_sym.n, left_sym.text, bigram.size);
@@ -1425,18 +2304,18 @@ struct llama_tokenizer {
             try_add_bigram(bigram.left, left_sym.next);
         }
 
-        for (int i = 0; i != -1; i = symbols_[i].next) {
+        for (int i = 0; i != -1 && !symbols_.empty(); i = symbols_[i].next) {
             auto & symbol = symbols_[i];
-            auto token = vocab_.token_to_id.find(std::string(symbol.text, symbol.n));
+            const llama_vocab::id token = symbol.node >= 0 ? vocab_.trie.nodes[symbol.node].id : -1;
 
-            if (token == vocab_.token_to_id.end()) {
+            if (token < 0) {
                 // output any symbols that did not form tokens as bytes.
                 for (int j = 0; j < (int) symbol.n; ++j) {
                     llama_vocab::id token_id = static_cast<uint8_t>(symbol.text[j]) + 3;
                     output.push_back(token_id);
                 }
             } else {
-                output.push_back((*token).second);
+                output.push_back(token);
             }
         }
     }
@@ -1447,46 +2326,68 @@ private:
             return;
         }
 
-        const std::string text = std::string(symbols_[left].text, symbols_[left].n + symbols_[right].n);
-        auto token = vocab_.token_to_id.find(text);
-
-        if (token == vocab_.token_to_id.end()) {
+        // the two symbols are adjacent in the text, continue the walk of the left one with the bytes of the right one
+        const int32_t node = vocab_.trie.walk(symbols_[left].node, symbols_[right].text, symbols_[right].n);
+        if (node < 0) {
             return;
         }
 
-        if (static_cast<size_t>((*token).second) >= vocab_.id_to_token.size()) {
+        const llama_vocab::id token = vocab_.trie.nodes[node].id;
+        if (token < 0 || static_cast<size_t>(token) >= vocab_.id_to_token.size()) {
             return;
         }
 
-        const auto &tok_score = vocab_.id_to_token[(*token).second];
+        const auto &tok_score = vocab_.id_to_token[token];
 
         llama_sp_bigram bigram;
         bigram.left = left;
         bigram.right = right;
         bigram.score = tok_score.score;
-        bigram.size = text.size();
-        work_queue_.push(bigram);
+        bigram.size = symbols_[left].n + symbols_[right].n;
+        bigram.node = node;
+        work_queue_.push_back(bigram);
+        std::push_heap(work_queue_.begin(), work_queue_.end(), llama_sp_bigram::comparator());
     }
 
     const llama_vocab & vocab_;
     std::vector<llama_sp_symbol> symbols_;
-    llama_sp_bigram::queue work_queue_;
+    llama_sp_bigram::queue_storage work_queue_;
 };
 
-static std::vector<llama_vocab::id> llama_tokenize(const llama_vocab & vocab, const std::string & text, bool bos) {
-    llama_tokenizer tokenizer(vocab);
-    std::vector<llama_vocab::id> output;
+static void llama_tokenizer_free(struct llama_tokenizer * tokenizer) {
+    delete tokenizer;
+}
+
+static void llama_tokenize(llama_tokenizer & tokenizer, const char * text, bool bos, std::vector<llama_vocab::id> & output) {
+    output.clear();
 
-    if (text.size() == 0) {
-        return output;
+    const size_t len = strlen(text);
+    if (len == 0) {
+        return;
     }
 
     if (bos) {
         output.push_back(1);
     }
 
-    tokenizer.tokenize(text, output);
-    return output;
+    tokenizer.tokenize(text, len, output);
+}
+
+// splits text into pieces of at least chunk_size bytes, each one starting at a space that no token joins with
+// the byte before it - no merge crosses such a space, so the tokens of the pieces add up to the tokens of the text
+static void llama_tokenize_split(const llama_trie & trie, const char * text, size_t len, size_t chunk_size,
+                                 std::vector<std::pair<size_t, size_t>> & pieces) {
+    size_t begin = 0;
+    size_t offs  = 0;
+    while (offs < len) {
+        // step over whole symbols like the tokenizer does, so that a piece never starts inside one
+        if (offs - begin >= chunk_size && text[offs] == ' ' && !trie.joins_space[static_cast<uint8_t>(text[offs - 1])]) {
+            pieces.emplace_back(begin, offs);
+            begin = offs;
+        }
+        offs += std::min(len - offs, utf8_len(text[offs]));
+    }
+    pieces.emplace_back(begin, len);
 }
 
 //
@@ -1891,6 +2792,97 @@ llama_token llama_sample_token(struct llama_context * ctx, llama_token_data_arra
     return result;
 }
 
+llama_token llama_sample_chain(struct llama_context * ctx, const float * logits, const struct llama_sampling_params * params, const llama_token * last_tokens, size_t last_tokens_size) {
+    assert(ctx);
+    const int64_t t_start_sample_us = ggml_time_us();
+
+    const int n_vocab = llama_n_vocab(ctx);
+
+    auto & cur_logits = ctx->sampling_logits;
+    auto & cur        = ctx->sampling_cur;
+    auto & prev       = ctx->sampling_prev;
+
+    cur_logits.assign(logits, logits + n_vocab);
+
+    // penalize each distinct previous token once, counting its occurrences
+    const bool penalize = params->repeat_penalty != 1.0f || params->alpha_frequency != 0.0f || params->alpha_presence != 0.0f;
+    if (penalize && last_tokens_size > 0) {
+        prev.assign(last_tokens, last_tokens + last_tokens_size);
+        std::sort(prev.begin(), prev.end());
+
+        for (size_t i = 0; i < prev.size(); ) {
+            const llama_token id = prev[i];
+
+            size_t count = 0;
+            for (; i < prev.size() && prev[i] == id; ++i) {
+                count++;
+            }
+
+            if (id < 0 || id >= n_vocab || (!params->penalize_nl && id == llama_token_nl())) {
+                continue;
+            }
+
+            float & logit = cur_logits[id];
+            if (params->repeat_penalty != 1.0f) {
+                logit = logit <= 0 ? logit*params->repeat_penalty : logit/params->repeat_penalty;
+            }
+            logit -= float(count)*params->alpha_frequency + params->alpha_presence;
+        }
+    }
+
+    if (params->temp <= 0) {
+        const llama_token result = std::max_element(cur_logits.begin(), cur_logits.end()) - cur_logits.begin();
+
+        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        ctx->n_sample++;
+        return result;
+    }
+
+    const int k = params->top_k <= 0 ? n_vocab : std::min(params->top_k, n_vocab);
+
+    cur.resize(k);
+
+    if (k == n_vocab) {
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            cur[id] = llama_token_data{id, cur_logits[id], 0.0f};
+        }
+        std::sort(cur.begin(), cur.end(), [](const llama_token_data & a, const llama_token_data & b) {
+            return a.logit > b.logit;
+        });
+    } else {
+        // min-heap of the k largest logits seen so far, most tokens are rejected by a single compare with its top
+        auto comp = [](const llama_token_data & a, const llama_token_data & b) {
+            return a.logit > b.logit;
+        };
+
+        for (llama_token id = 0; id < k; ++id) {
+            cur[id] = llama_token_data{id, cur_logits[id], 0.0f};
+        }
+        std::make_heap(cur.begin(), cur.end(), comp);
+
+        for (llama_token id = k; id < n_vocab; ++id) {
+            if (cur_logits[id] > cur[0].logit) {
+                std::pop_heap(cur.begin(), cur.end(), comp);
+                cur[k - 1] = llama_token_data{id, cur_logits[id], 0.0f};
+                std::push_heap(cur.begin(), cur.end(), comp);
+            }
+        }
+
+        std::sort_heap(cur.begin(), cur.end(), comp);
+    }
+
+    llama_token_data_array cur_p = { cur.data(), cur.size(), true };
+
+    llama_sample_tail_free  (nullptr, &cur_p, params->tfs_z);
+    llama_sample_typical    (nullptr, &cur_p, params->typical_p);
+    llama_sample_top_p      (nullptr, &cur_p, params->top_p);
+    llama_sample_temperature(nullptr, &cur_p, params->temp);
+
+    ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+
+    return llama_sample_token(ctx, &cur_p);
+}
+
 //
 // quantization
 //
@@ -2049,16 +3041,12 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
 // interface implementation
 //
 
-struct llama_context * llama_init_from_file(
+struct llama_model * llama_load_model_from_file(
                              const char * path_model,
             struct llama_context_params   params) {
     ggml_time_init();
 
-    llama_context * ctx = new llama_context;
-
-    if (params.seed < 0) {
-        params.seed = time(NULL);
-    }
+    llama_model * model = new llama_model;
 
     unsigned cur_percentage = 0;
     if (params.progress_callback == NULL) {
@@ -2077,37 +3065,81 @@ struct llama_context * llama_init_from_file(
         };
     }
 
-    ctx->rng = std::mt19937(params.seed);
-    ctx->logits_all = params.logits_all;
-
     ggml_type memory_type = params.f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
 
-    if (!llama_model_load(path_model, *ctx, params.n_ctx, memory_type,
-                          params.use_mmap, params.use_mlock, params.vocab_only,
+    if (!llama_model_load(path_model, *model, params.n_ctx, memory_type,
+                          params.use_mmap, params.use_mlock, params.numa, params.vocab_only,
                           params.progress_callback, params.progress_callback_user_data)) {
         fprintf(stderr, "%s: failed to load model\n", __func__);
+        delete model;
+        return nullptr;
+    }
+
+    return model;
+}
+
+void llama_free_model(struct llama_model * model) {
+    delete model;
+}
+
+struct llama_context * llama_new_context_with_model(
+                     struct llama_model * model,
+            struct llama_context_params   params) {
+    if (!model) {
+        return nullptr;
+    }
+
+    llama_context * ctx = new llama_context(*model);
+
+    if (params.seed < 0) {
+        params.seed = time(NULL);
+    }
+
+    ctx->rng = std::mt19937(params.seed);
+    ctx->logits_all = params.logits_all;
+
+    // a context can be shorter than the model, its KV cache and compute buffer are sized for its own n_ctx
+    ctx->n_ctx = params.n_ctx > 0 ? params.n_ctx : (int) model->hparams.n_ctx;
+    if (ctx->n_ctx > (int) model->hparams.n_ctx) {
+        fprintf(stderr, "%s: n_ctx = %d is larger than the n_ctx = %u the model was loaded with\n", __func__,
+                ctx->n_ctx, model->hparams.n_ctx);
         llama_free(ctx);
         return nullptr;
     }
 
+    ggml_type memory_type = params.f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
+
     // reserve memory for context buffers
     if (!params.vocab_only) {
-        if (!kv_cache_init(ctx->model.hparams, ctx->model.kv_self, memory_type, ctx->model.hparams.n_ctx)) {
+        ggml_type memory_type_k = memory_type;
+        switch (params.kv_type_k) {
+            case LLAMA_KV_TYPE_DEFAULT: break;
+            case LLAMA_KV_TYPE_Q8_0:    memory_type_k = GGML_TYPE_Q8_0; break;
+            case LLAMA_KV_TYPE_Q4_0:    memory_type_k = GGML_TYPE_Q4_0; break;
+            default:
+                fprintf(stderr, "%s: invalid kv_type_k %d\n", __func__, params.kv_type_k);
+                llama_free(ctx);
+                return nullptr;
+        }
+
+        if (!kv_cache_init(ctx->model, ctx->kv_self, memory_type_k, memory_type, ctx->n_ctx)) {
             fprintf(stderr, "%s: kv_cache_init() failed for self-attention cache\n", __func__);
             llama_free(ctx);
             return nullptr;
         }
 
         {
-            const size_t memory_size = ggml_nbytes(ctx->model.kv_self.k) + ggml_nbytes(ctx->model.kv_self.v);
-            fprintf(stderr, "%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
+            const auto & pool = *ctx->kv_self.pool;
+            const size_t memory_size = ctx->kv_self.blocks.size()*(pool.k_stride + pool.v_stride);
+            fprintf(stderr, "%s: kv self size  = %7.2f MB (at most, allocated by blocks of %d cells)\n", __func__,
+                    memory_size / 1024.0 / 1024.0, LLAMA_KV_BLOCK_SIZE);
         }
 
         const auto & hparams = ctx->model.hparams;
 
         // resized during inference
         if (params.logits_all) {
-            ctx->logits.reserve(hparams.n_ctx*hparams.n_vocab);
+            ctx->logits.reserve((size_t) ctx->n_ctx*hparams.n_vocab);
         } else {
             ctx->logits.reserve(hparams.n_vocab);
         }
@@ -2116,12 +3148,40 @@ struct llama_context * llama_init_from_file(
             ctx->embedding.resize(hparams.n_embd);
         }
 
-        ctx->buf_compute.resize(MEM_REQ_EVAL().at(ctx->model.type));
+        // the tensor objects of the graphs, their data is allocated in buf_alloc
+        ctx->buf_compute.resize(ggml_graph_overhead());
+
+        // buf_alloc is sized for the largest graph: a batch of sequences that attend to the whole context
+        {
+            const int N = std::min(ctx->n_ctx, LLAMA_GRAPH_MEASURE_BATCH);
+            const int n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+            llama_build_graph(*ctx, N, N, 0, 0, ctx->n_ctx, n_threads, true, true);
+
+            fprintf(stderr, "%s: compute buffer = %7.2f MB (measured for a batch of %d tokens)\n", __func__,
+                    ctx->buf_alloc.size / 1024.0 / 1024.0, N);
+        }
+    }
+
+    return ctx;
+}
+
+struct llama_context * llama_init_from_file(
+                             const char * path_model,
+            struct llama_context_params   params) {
+    struct llama_model * model = llama_load_model_from_file(path_model, params);
+    if (!model) {
+        return nullptr;
+    }
 
-        ctx->buf_scratch[0].resize(MEM_REQ_SCRATCH0().at(ctx->model.type));
-        ctx->buf_scratch[1].resize(MEM_REQ_SCRATCH1().at(ctx->model.type));
+    struct llama_context * ctx = llama_new_context_with_model(model, params);
+    if (!ctx) {
+        llama_free_model(model);
+        return nullptr;
     }
 
+    ctx->model_owner = true;
+
     return ctx;
 }
 
@@ -2143,11 +3203,9 @@ int llama_model_quantize(
     }
 }
 
-int llama_apply_lora_from_file_internal(struct llama_context * ctx, const char * path_lora, const char * path_base_model, int n_threads) {
+int llama_apply_lora_from_file_internal(const struct llama_model & model, const char * path_lora, const char * path_base_model, int n_threads) {
     fprintf(stderr, "%s: applying lora adapter from '%s' - please wait ...\n", __func__, path_lora);
 
-    auto & model = ctx->model;
-
     const int64_t t_start_lora_us = ggml_time_us();
 
     auto fin = std::ifstream(path_lora, std::ios::binary);
@@ -2384,19 +3442,28 @@ int llama_apply_lora_from_file_internal(struct llama_context * ctx, const char *
 
 int llama_apply_lora_from_file(struct llama_context * ctx, const char * path_lora, const char * path_base_model, int n_threads) {
     try {
-        return llama_apply_lora_from_file_internal(ctx, path_lora, path_base_model, n_threads);
+        return llama_apply_lora_from_file_internal(ctx->model, path_lora, path_base_model, n_threads);
     } catch (const std::string & err) {
         fprintf(stderr, "%s: failed to apply lora adapter: %s\n", __func__, err.c_str());
         return 1;
     }
 }
 
-int llama_get_kv_cache_token_count(const struct llama_context * ctx) {
-    return ctx->model.kv_self.n;
-}
-
-#define LLAMA_MAX_RNG_STATE 64*1024
-
+int llama_model_apply_lora_from_file(const struct llama_model * model, const char * path_lora, const char * path_base_model, int n_threads) {
+    try {
+        return llama_apply_lora_from_file_internal(*model, path_lora, path_base_model, n_threads);
+    } catch (const std::string & err) {
+        fprintf(stderr, "%s: failed to apply lora adapter: %s\n", __func__, err.c_str());
+        return 1;
+    }
+}
+
+int llama_get_kv_cache_token_count(const struct llama_context * ctx) {
+    return ctx->kv_self.n;
+}
+
+#define LLAMA_MAX_RNG_STATE 64*1024
+
 void llama_set_rng_seed(struct llama_context * ctx, int seed) {
     if (seed < 0) {
         seed = time(NULL);
@@ -2404,25 +3471,38 @@ void llama_set_rng_seed(struct llama_context * ctx, int seed) {
     ctx->rng.seed(seed);
 }
 
-// Returns the *maximum* size of the state
-size_t llama_get_state_size(const struct llama_context * ctx) {
+// size in bytes of the K and V of the first n_tokens cells of all the layers
+static size_t llama_kv_state_size(const struct llama_context * ctx, int n_tokens) {
+    const auto & kv_self = ctx->kv_self;
+    const auto & hparams = ctx->model.hparams;
+
+    if (!kv_self.pool) {
+        return 0;
+    }
+
+    const size_t k_row_size = kv_self.pool->k_row_size;
+    const size_t v_row_size = kv_self.pool->v_row_size*hparams.n_head;
+
+    return (size_t) hparams.n_layer*n_tokens*(k_row_size + v_row_size);
+}
+
+// the state functions below only differ in the number of logits and KV cells they count
+static size_t llama_get_state_size(const struct llama_context * ctx, size_t n_logits, int n_tokens) {
     // we don't know size of rng until we actually serialize it. so reserve more than enough memory for its serialized state.
     // for reference, std::mt19937(1337) serializes to 6701 bytes.
     const size_t s_rng_size        = sizeof(size_t);
     const size_t s_rng             = LLAMA_MAX_RNG_STATE;
-    const size_t s_logits_capacity = sizeof(size_t);
     const size_t s_logits_size     = sizeof(size_t);
-    const size_t s_logits          = ctx->logits.capacity() * sizeof(float);
+    const size_t s_logits          = n_logits * sizeof(float);
     const size_t s_embedding_size  = sizeof(size_t);
     const size_t s_embedding       = ctx->embedding.size() * sizeof(float);
     const size_t s_kv_size         = sizeof(size_t);
     const size_t s_kv_ntok         = sizeof(int);
-    const size_t s_kv              = ctx->model.kv_self.buf.size;
+    const size_t s_kv              = llama_kv_state_size(ctx, n_tokens);
 
     const size_t s_total = (
         + s_rng_size
         + s_rng
-        + s_logits_capacity
         + s_logits_size
         + s_logits
         + s_embedding_size
@@ -2435,6 +3515,16 @@ size_t llama_get_state_size(const struct llama_context * ctx) {
     return s_total;
 }
 
+// the size of the largest state a context can have, with all its logits and a full KV cache
+static size_t llama_get_state_size_max(const struct llama_context * ctx) {
+    return llama_get_state_size(ctx, ctx->logits.capacity(), ctx->n_ctx);
+}
+
+// Returns the size of the state as of the last eval
+size_t llama_get_state_size(const struct llama_context * ctx) {
+    return llama_get_state_size(ctx, ctx->logits.size(), ctx->kv_self.n);
+}
+
 // Copies the state to the specified destination address
 size_t llama_copy_state_data(struct llama_context * ctx, uint8_t * dest) {
     uint8_t * out = dest;
@@ -2454,19 +3544,16 @@ size_t llama_copy_state_data(struct llama_context * ctx, uint8_t * dest) {
         memcpy(out, &rng_buf[0], LLAMA_MAX_RNG_STATE); out += LLAMA_MAX_RNG_STATE;
     }
 
-    // copy logits
+    // copy logits, only the ones of the last eval
     {
-        const size_t logits_cap  = ctx->logits.capacity();
         const size_t logits_size = ctx->logits.size();
 
-        memcpy(out, &logits_cap,  sizeof(logits_cap));  out += sizeof(logits_cap);
         memcpy(out, &logits_size, sizeof(logits_size)); out += sizeof(logits_size);
 
         if (logits_size) {
             memcpy(out, ctx->logits.data(), logits_size * sizeof(float));
+            out += logits_size * sizeof(float);
         }
-
-        out += logits_cap * sizeof(float);
     }
 
     // copy embeddings
@@ -2481,46 +3568,26 @@ size_t llama_copy_state_data(struct llama_context * ctx, uint8_t * dest) {
         }
     }
 
-    // copy kv cache
+    // copy the used part of the kv cache: [n_layer][kv_ntok] rows of K, then [n_layer][n_head][kv_ntok] rows of V
     {
-        const auto & kv_self = ctx->model.kv_self;
-        const auto & hparams = ctx->model.hparams;
-        const int    n_layer = hparams.n_layer;
-        const int    n_embd  = hparams.n_embd;
-        const int    n_ctx   = hparams.n_ctx;
+        const auto & kv_self = ctx->kv_self;
 
-        const size_t kv_size = kv_self.buf.size;
+        // the size of a cache of the n_ctx of the model, the cache is only written if the context has one
+        const size_t kv_size = llama_kv_state_size(ctx, ctx->model.hparams.n_ctx);
         const int    kv_ntok = llama_get_kv_cache_token_count(ctx);
 
         memcpy(out, &kv_size, sizeof(kv_size)); out += sizeof(kv_size);
         memcpy(out, &kv_ntok, sizeof(kv_ntok)); out += sizeof(kv_ntok);
 
         if (kv_size) {
-            const size_t elt_size = ggml_element_size(kv_self.k);
-            char buffer[4096];
-            ggml_context * cpy_ctx = ggml_init({ sizeof(buffer), buffer, /* no_alloc */ true });
-            ggml_cgraph gf{};
-            gf.n_threads = 1;
-
-            ggml_tensor * kout3d = ggml_new_tensor_3d(cpy_ctx, kv_self.k->type, n_embd, kv_ntok, n_layer);
-            kout3d->data = out;
-            out += ggml_nbytes(kout3d);
-
-            ggml_tensor * vout3d = ggml_new_tensor_3d(cpy_ctx, kv_self.v->type, kv_ntok, n_embd, n_layer);
-            vout3d->data = out;
-            out += ggml_nbytes(vout3d);
-
-            ggml_tensor * k3d = ggml_view_3d(cpy_ctx, kv_self.k,
-                n_embd, kv_ntok, n_layer,
-                elt_size*n_embd, elt_size*n_embd*n_ctx, 0);
-
-            ggml_tensor * v3d = ggml_view_3d(cpy_ctx, kv_self.v,
-                kv_ntok, n_embd, n_layer,
-                elt_size*n_ctx, elt_size*n_ctx*n_embd, 0);
-
-            ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, k3d, kout3d));
-            ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, v3d, vout3d));
-            ggml_graph_compute(cpy_ctx, &gf);
+            kv_cache_visit(kv_self, ctx->model.hparams, 0, kv_ntok, kv_ntok, 0, [&](const uint8_t * data, size_t offs, size_t size) {
+                if (data) {
+                    memcpy(out + offs, data, size);
+                } else {
+                    memset(out + offs, 0, size);
+                }
+            });
+            out += llama_kv_state_size(ctx, kv_ntok);
         }
     }
 
@@ -2553,20 +3620,17 @@ size_t llama_set_state_data(struct llama_context * ctx, const uint8_t * src) {
 
     // set logits
     {
-        size_t logits_cap;
         size_t logits_size;
 
-        memcpy(&logits_cap,  in, sizeof(logits_cap));  in += sizeof(logits_cap);
         memcpy(&logits_size, in, sizeof(logits_size)); in += sizeof(logits_size);
 
-        LLAMA_ASSERT(ctx->logits.capacity() == logits_cap);
+        LLAMA_ASSERT(ctx->logits.capacity() >= logits_size);
 
         if (logits_size) {
             ctx->logits.resize(logits_size);
             memcpy(ctx->logits.data(), in, logits_size * sizeof(float));
+            in += logits_size * sizeof(float);
         }
-
-        in += logits_cap * sizeof(float);
     }
 
     // set embeddings
@@ -2583,13 +3647,9 @@ size_t llama_set_state_data(struct llama_context * ctx, const uint8_t * src) {
         }
     }
 
-    // set kv cache
+    // set kv cache, the blocks of the cells after kv_ntok are freed
     {
-        const auto & kv_self = ctx->model.kv_self;
-        const auto & hparams = ctx->model.hparams;
-        const int    n_layer = hparams.n_layer;
-        const int    n_embd  = hparams.n_embd;
-        const int    n_ctx   = hparams.n_ctx;
+        auto & kv_self = ctx->kv_self;
 
         size_t kv_size;
         int kv_ntok;
@@ -2597,133 +3657,709 @@ size_t llama_set_state_data(struct llama_context * ctx, const uint8_t * src) {
         memcpy(&kv_size, in, sizeof(kv_size)); in += sizeof(kv_size);
         memcpy(&kv_ntok, in, sizeof(kv_ntok)); in += sizeof(kv_ntok);
 
+        kv_self.n = kv_ntok;
+        kv_cache_reset_cells(kv_self, kv_ntok);
+
         if (kv_size) {
-            LLAMA_ASSERT(kv_self.buf.size == kv_size);
+            LLAMA_ASSERT(llama_kv_state_size(ctx, ctx->model.hparams.n_ctx) == kv_size);
+            LLAMA_ASSERT(kv_ntok <= ctx->n_ctx);
+
+            const bool allocated = kv_cache_alloc(kv_self, 0, kv_ntok);
+            LLAMA_ASSERT(allocated);
+
+            kv_cache_visit(kv_self, ctx->model.hparams, 0, kv_ntok, kv_ntok, 0, [&](uint8_t * data, size_t offs, size_t size) {
+                memcpy(data, in + offs, size);
+            });
+            in += llama_kv_state_size(ctx, kv_ntok);
+        }
+    }
+
+    const size_t nread    = in - src;
+    const size_t max_size = llama_get_state_size_max(ctx);
+
+    LLAMA_ASSERT(nread <= max_size);
+
+    return nread;
+}
 
-            const size_t elt_size = ggml_element_size(kv_self.k);
-            char buffer[4096];
-            ggml_context * cpy_ctx = ggml_init({ sizeof(buffer), buffer, /* no_alloc */ true });
-            ggml_cgraph gf{};
-            gf.n_threads = 1;
+//
+// session files
+//
+// the header, then chunks that each add tokens to the ones of the chunks before them:
+//   u64 size of the rest of the chunk
+//   u32 n_tokens, the tokens
+//   [n_layer][n_tokens] rows of K and [n_layer][n_head][n_tokens] rows of V of these tokens
+//   u32 rng size, rng, u64 n_logits, logits, u64 n_embd, embedding - the state after the tokens
+// a session grows by appending a chunk with only the new tokens, a chunk cut short by a crash is ignored
+//
+
+static void llama_session_write_header(llama_file & file, const struct llama_context * ctx) {
+    file.write_u32(LLAMA_SESSION_MAGIC);
+    file.write_u32(LLAMA_SESSION_VERSION);
+
+    file.write_raw(&ctx->model.hparams, sizeof(llama_hparams));
+
+    file.write_u32((uint32_t) ctx->kv_self.k->type);
+    file.write_u32((uint32_t) ctx->kv_self.v->type);
+}
+
+static bool llama_session_read_header(llama_file & file, const struct llama_context * ctx) {
+    const uint32_t magic   = file.read_u32();
+    const uint32_t version = file.read_u32();
+
+    if (!(magic == LLAMA_SESSION_MAGIC && version == LLAMA_SESSION_VERSION)) {
+        fprintf(stderr, "%s : unknown (magic, version) for session file: %08x, %08x\n", __func__, magic, version);
+        return false;
+    }
+
+    llama_hparams session_hparams;
+    file.read_raw(&session_hparams, sizeof(llama_hparams));
+
+    if (session_hparams != ctx->model.hparams) {
+        fprintf(stderr, "%s : model hparams didn't match from session file!\n", __func__);
+        return false;
+    }
 
-            ggml_tensor * kin3d = ggml_new_tensor_3d(cpy_ctx, kv_self.k->type, n_embd, kv_ntok, n_layer);
-            kin3d->data = (void *) in;
-            in += ggml_nbytes(kin3d);
+    const uint32_t ktype = file.read_u32();
+    const uint32_t vtype = file.read_u32();
+
+    if (ktype != (uint32_t) ctx->kv_self.k->type || vtype != (uint32_t) ctx->kv_self.v->type) {
+        fprintf(stderr, "%s : the KV cache types of the session file do not match the context\n", __func__);
+        return false;
+    }
+
+    return true;
+}
 
-            ggml_tensor * vin3d = ggml_new_tensor_3d(cpy_ctx, kv_self.v->type, kv_ntok, n_embd, n_layer);
-            vin3d->data = (void *) in;
-            in += ggml_nbytes(vin3d);
+// appends the chunk of tokens[n0, n1), which must be in the cells n0 to n1 - 1 of the KV cache
+static void llama_session_write_chunk(llama_file & file, const struct llama_context * ctx, const llama_token * tokens, int n0, int n1) {
+    const auto & kv_self = ctx->kv_self;
+    const int    n       = n1 - n0;
 
-            ggml_tensor * k3d = ggml_view_3d(cpy_ctx, kv_self.k,
-                n_embd, kv_ntok, n_layer,
-                elt_size*n_embd, elt_size*n_embd*n_ctx, 0);
+    std::stringstream rng_ss;
+    rng_ss << ctx->rng;
+    const std::string rng = rng_ss.str();
 
-            ggml_tensor * v3d = ggml_view_3d(cpy_ctx, kv_self.v,
-                kv_ntok, n_embd, n_layer,
-                elt_size*n_ctx, elt_size*n_ctx*n_embd, 0);
+    const uint64_t n_logits    = ctx->logits.size();
+    const uint64_t n_embedding = ctx->embedding.size();
 
-            ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, kin3d, k3d));
-            ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, vin3d, v3d));
-            ggml_graph_compute(cpy_ctx, &gf);
+    const uint64_t chunk_size =
+        sizeof(uint32_t) + n*sizeof(llama_token) +
+        llama_kv_state_size(ctx, n) +
+        sizeof(uint32_t) + rng.size() +
+        sizeof(uint64_t) + n_logits*sizeof(float) +
+        sizeof(uint64_t) + n_embedding*sizeof(float);
+
+    file.write_raw(&chunk_size, sizeof(chunk_size));
+
+    file.write_u32((uint32_t) n);
+    file.write_raw(tokens + n0, n*sizeof(llama_token));
+
+    std::vector<uint8_t> zeros;
+
+    kv_cache_visit(kv_self, ctx->model.hparams, n0, n, n, 0, [&](const uint8_t * data, size_t offs, size_t size) {
+        (void) offs;
+        if (!data) {
+            zeros.resize(size);
+            data = zeros.data();
         }
+        file.write_raw(data, size);
+    });
+
+    file.write_u32((uint32_t) rng.size());
+    file.write_raw(rng.data(), rng.size());
 
-        ctx->model.kv_self.n = kv_ntok;
+    file.write_raw(&n_logits, sizeof(n_logits));
+    file.write_raw(ctx->logits.data(), n_logits*sizeof(float));
+
+    file.write_raw(&n_embedding, sizeof(n_embedding));
+    file.write_raw(ctx->embedding.data(), n_embedding*sizeof(float));
+}
+
+// the state at the end of a chunk: the rng, the logits and the embedding
+struct llama_session_state {
+    const char  * rng;
+    uint32_t      rng_size;
+    const float * logits;
+    uint64_t      n_logits;
+    const float * embedding;
+    uint64_t      n_embedding;
+};
+
+// reads the state from [in, end), returns false if it does not fit
+static bool llama_session_read_state(const uint8_t * in, const uint8_t * end, llama_session_state & state) {
+    if ((size_t) (end - in) < sizeof(uint32_t)) {
+        return false;
     }
+    memcpy(&state.rng_size, in, sizeof(uint32_t)); in += sizeof(uint32_t);
 
-    const size_t nread    = in - src;
-    const size_t max_size = llama_get_state_size(ctx);
+    if ((size_t) (end - in) < state.rng_size) {
+        return false;
+    }
+    state.rng = (const char *) in; in += state.rng_size;
 
-    LLAMA_ASSERT(nread <= max_size);
+    if ((size_t) (end - in) < sizeof(uint64_t)) {
+        return false;
+    }
+    memcpy(&state.n_logits, in, sizeof(uint64_t)); in += sizeof(uint64_t);
 
-    return nread;
+    if ((size_t) (end - in)/sizeof(float) < state.n_logits) {
+        return false;
+    }
+    state.logits = (const float *) in; in += state.n_logits*sizeof(float);
+
+    if ((size_t) (end - in) < sizeof(uint64_t)) {
+        return false;
+    }
+    memcpy(&state.n_embedding, in, sizeof(uint64_t)); in += sizeof(uint64_t);
+
+    if ((size_t) (end - in)/sizeof(float) < state.n_embedding) {
+        return false;
+    }
+    state.embedding = (const float *) in;
+
+    return true;
 }
 
-bool llama_load_session_file(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+static bool llama_load_session_file_internal(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
     llama_file file(path_session, "rb");
 
-    // sanity checks
-    {
-        const uint32_t magic   = file.read_u32();
-        const uint32_t version = file.read_u32();
+    if (!llama_session_read_header(file, ctx)) {
+        return false;
+    }
 
-        if (!(magic == LLAMA_SESSION_MAGIC && version == LLAMA_SESSION_VERSION)) {
-            fprintf(stderr, "%s : unknown (magic, version) for session file: %08x, %08x\n", __func__, magic, version);
-            return false;
+    // the chunks are read from a mapping of the file, their K and V are copied from it straight into the cache
+    const size_t offs_chunks = file.tell();
+
+    std::unique_ptr<llama_mmap> mapping;
+    std::vector<uint8_t> buf;
+    const uint8_t * data;
+    if (llama_mmap::SUPPORTED) {
+        mapping.reset(new llama_mmap(&file, /* prefetch */ false));
+        data = (const uint8_t *) mapping->addr;
+    } else {
+        buf.resize(file.size);
+        file.read_raw_at(buf.data(), file.size, 0);
+        data = buf.data();
+    }
+
+    auto & kv_self = ctx->kv_self;
+    const auto & hparams = ctx->model.hparams;
+    const int    n_ctx   = ctx->n_ctx;
+
+    // all the chunks are checked before anything is written to the context
+    std::vector<const uint8_t *> chunks;
+    size_t n_tokens = 0;
+    llama_session_state state = {}; // the state after the last chunk
+
+    size_t offs = offs_chunks;
+    while (offs + sizeof(uint64_t) <= file.size) {
+        uint64_t chunk_size;
+        memcpy(&chunk_size, data + offs, sizeof(chunk_size));
+        if (chunk_size > file.size - offs - sizeof(chunk_size)) {
+            break;
         }
 
-        llama_hparams session_hparams;
-        file.read_raw(&session_hparams, sizeof(llama_hparams));
+        const uint8_t * in  = data + offs + sizeof(chunk_size);
+        const uint8_t * end = in + chunk_size;
 
-        if (session_hparams != ctx->model.hparams) {
-            fprintf(stderr, "%s : model hparams didn't match from session file!\n", __func__);
-            return false;
+        uint32_t n = 0;
+        if (chunk_size >= sizeof(n)) {
+            memcpy(&n, in, sizeof(n));
         }
-    }
 
-    // load the prompt
-    {
-        const uint32_t n_token_count = file.read_u32();
+        const size_t kv_size = sizeof(n) + n*sizeof(llama_token) + llama_kv_state_size(ctx, n);
+        if (kv_size > chunk_size || !llama_session_read_state(in + kv_size, end, state)) {
+            fprintf(stderr, "%s : invalid chunk of %u tokens in session file\n", __func__, n);
+            return false;
+        }
 
-        if (n_token_count > n_token_capacity) {
-            fprintf(stderr, "%s : token count in session file exceeded capacity! %u > %zu\n", __func__, n_token_count, n_token_capacity);
+        if (n_tokens + n > n_token_capacity || n_tokens + n > (size_t) n_ctx) {
+            fprintf(stderr, "%s : token count in session file exceeded capacity! %zu > %zu\n", __func__,
+                    n_tokens + n, std::min(n_token_capacity, (size_t) n_ctx));
             return false;
         }
 
-        file.read_raw(tokens_out, sizeof(llama_token) * n_token_count);
-        *n_token_count_out = n_token_count;
+        chunks.push_back(in);
+        n_tokens += n;
+        offs += sizeof(chunk_size) + chunk_size;
     }
 
-    // restore the context state
-    {
-        const size_t n_state_size_cur = file.size - file.tell();
-        const size_t n_state_size_max = llama_get_state_size(ctx);
+    std::mt19937 rng = ctx->rng;
+    if (!chunks.empty()) {
+        std::stringstream rng_ss;
+        rng_ss.str(std::string(state.rng, state.rng_size));
+        rng_ss >> rng;
 
-        if (n_state_size_cur > n_state_size_max) {
-            fprintf(stderr, "%s : the state size in session file is too big! max %zu, got %zu\n", __func__, n_state_size_max, n_state_size_cur);
+        if (rng_ss.fail()) {
+            fprintf(stderr, "%s : invalid rng state in session file\n", __func__);
             return false;
         }
 
-        std::vector<uint8_t> state_data(n_state_size_max);
-        file.read_raw(state_data.data(), n_state_size_cur);
+        if (state.n_logits > ctx->logits.capacity()) {
+            fprintf(stderr, "%s : the session file has more logits than the context can hold\n", __func__);
+            return false;
+        }
 
-        llama_set_state_data(ctx, state_data.data());
+        if (state.n_embedding != ctx->embedding.size()) {
+            fprintf(stderr, "%s : the session file does not have the embedding size of the context\n", __func__);
+            return false;
+        }
+    }
+
+    if (!kv_cache_alloc(kv_self, 0, n_tokens)) {
+        // the cells keep their K and V, only the blocks allocated for free cells go back to the pool
+        kv_cache_release(kv_self);
+        return false;
+    }
+
+    n_tokens = 0;
+    for (const uint8_t * in : chunks) {
+        uint32_t n;
+        memcpy(&n, in, sizeof(n)); in += sizeof(n);
+
+        memcpy(tokens_out + n_tokens, in, n*sizeof(llama_token));
+        in += n*sizeof(llama_token);
+
+        kv_cache_visit(kv_self, hparams, n_tokens, n, n, 0, [&](uint8_t * data, size_t offs, size_t size) {
+            memcpy(data, in + offs, size);
+        });
+
+        n_tokens += n;
     }
 
+    if (!chunks.empty()) {
+        ctx->rng = rng;
+
+        ctx->logits.resize(state.n_logits);
+        memcpy(ctx->logits.data(), state.logits, state.n_logits*sizeof(float));
+
+        memcpy(ctx->embedding.data(), state.embedding, state.n_embedding*sizeof(float));
+    }
+
+    kv_self.n = n_tokens;
+    kv_cache_reset_cells(kv_self, n_tokens);
+
+    *n_token_count_out = n_tokens;
+
     return true;
 }
 
+bool llama_load_session_file(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    try {
+        return llama_load_session_file_internal(ctx, path_session, tokens_out, n_token_capacity, n_token_count_out);
+    } catch (const std::string & err) {
+        fprintf(stderr, "%s: failed to load session file '%s': %s\n", __func__, path_session, err.c_str());
+        return false;
+    }
+}
+
 bool llama_save_session_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count) {
-    llama_file file(path_session, "wb");
+    try {
+        llama_file file(path_session, "wb");
 
-    file.write_u32(LLAMA_SESSION_MAGIC);
-    file.write_u32(LLAMA_SESSION_VERSION);
+        llama_session_write_header(file, ctx);
+        llama_session_write_chunk(file, ctx, tokens, 0, n_token_count);
+    } catch (const std::string & err) {
+        fprintf(stderr, "%s: failed to save session file '%s': %s\n", __func__, path_session, err.c_str());
+        return false;
+    }
 
-    file.write_raw(&ctx->model.hparams, sizeof(llama_hparams));
+    return true;
+}
 
-    // save the prompt
-    file.write_u32((uint32_t) n_token_count);
-    file.write_raw(tokens, sizeof(llama_token) * n_token_count);
+// returns the number of tokens of the session file, or -1 if it has to be written again:
+// it does not exist, does not fit the context, its tokens are not a prefix of tokens or it ends with a partial chunk
+static int llama_session_count_tokens(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count) {
+    FILE * fp = std::fopen(path_session, "rb");
+    if (!fp) {
+        return -1;
+    }
+    std::fclose(fp);
 
-    // save the context state
-    {
-        const size_t n_state_size_max = llama_get_state_size(ctx);
+    llama_file file(path_session, "rb");
+
+    if (!llama_session_read_header(file, ctx)) {
+        return -1;
+    }
+
+    std::vector<llama_token> chunk_tokens;
+
+    size_t n_tokens = 0;
+    size_t offs = file.tell();
+    while (offs + sizeof(uint64_t) <= file.size) {
+        uint64_t chunk_size;
+        file.read_raw(&chunk_size, sizeof(chunk_size));
+        if (chunk_size > file.size - offs - sizeof(chunk_size)) {
+            break;
+        }
+
+        const uint32_t n = file.read_u32();
+        if (n_tokens + n > n_token_count) {
+            return -1;
+        }
+
+        chunk_tokens.resize(n);
+        file.read_raw(chunk_tokens.data(), n*sizeof(llama_token));
+        if (!std::equal(chunk_tokens.begin(), chunk_tokens.end(), tokens + n_tokens)) {
+            return -1;
+        }
+
+        n_tokens += n;
+        offs += sizeof(chunk_size) + chunk_size;
+        file.seek(offs, SEEK_SET);
+    }
+
+    return offs == file.size ? (int) n_tokens : -1;
+}
+
+bool llama_append_session_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count) {
+    try {
+        const int n_saved = llama_session_count_tokens(ctx, path_session, tokens, n_token_count);
+        if (n_saved < 0) {
+            return llama_save_session_file(ctx, path_session, tokens, n_token_count);
+        }
+
+        // the K and V in the file are those of the context, the state after them is only saved with new tokens
+        if (n_saved == (int) n_token_count) {
+            return true;
+        }
+
+        llama_file file(path_session, "ab");
+        llama_session_write_chunk(file, ctx, tokens, n_saved, n_token_count);
+    } catch (const std::string & err) {
+        fprintf(stderr, "%s: failed to append to session file '%s': %s\n", __func__, path_session, err.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+//
+// prompt cache
+//
+
+// a node of the radix tree of the cached prompts: the tokens of the edge from its parent and their K and V,
+// the tokens of a node start at the position that is the sum of the token counts of its ancestors
+struct llama_prompt_cache_node {
+    std::vector<llama_token> tokens;
+
+    std::vector<uint8_t> k; // [n_layer][tokens.size()] rows of K
+    std::vector<uint8_t> v; // [n_layer][n_head][tokens.size()] rows of V
+
+    int64_t last_used = 0; // never older than the last use of a descendant
+
+    llama_prompt_cache_node * parent = nullptr;
+
+    // keyed by their first token
+    std::map<llama_token, std::unique_ptr<llama_prompt_cache_node>> children;
+};
+
+struct llama_prompt_cache {
+    size_t max_bytes;
+    size_t n_bytes = 0;
+
+    int64_t n_uses = 0;
+
+    // the layout of the KV caches, taken from the first context that stores a prompt
+    const llama_model * model = nullptr;
+    ggml_type ktype;
+    ggml_type vtype;
+
+    llama_prompt_cache_node root;
+};
+
+// copies the K and V of n cells between the buffers of two nodes, with n_dst and n_src cells per layer
+static void llama_prompt_cache_copy(
+        const llama_hparams & hparams,
+                     size_t   k_row_size,
+                     size_t   v_row_size,
+                    uint8_t * k_dst,
+                    uint8_t * v_dst,
+                        int   n_dst,
+                        int   i_dst,
+              const uint8_t * k_src,
+              const uint8_t * v_src,
+                        int   n_src,
+                        int   i_src,
+                        int   n) {
+    const int n_layer = hparams.n_layer;
+    const int n_head  = hparams.n_head;
+
+    for (int il = 0; il < n_layer; ++il) {
+        memcpy(k_dst + ((size_t) il*n_dst + i_dst)*k_row_size, k_src + ((size_t) il*n_src + i_src)*k_row_size, n*k_row_size);
+    }
 
-        std::vector<uint8_t> state_data(n_state_size_max);
-        const size_t n_state_size_cur = llama_copy_state_data(ctx, state_data.data());
+    for (int64_t row = 0; row < (int64_t) n_layer*n_head; ++row) {
+        memcpy(v_dst + (row*n_dst + i_dst)*v_row_size, v_src + (row*n_src + i_src)*v_row_size, n*v_row_size);
+    }
+}
+
+static bool llama_prompt_cache_check(struct llama_prompt_cache & cache, const llama_context & lctx) {
+    if (!cache.model) {
+        cache.model = &lctx.model;
+        cache.ktype = lctx.kv_self.k->type;
+        cache.vtype = lctx.kv_self.v->type;
+    }
 
-        file.write_raw(state_data.data(), n_state_size_cur);
+    if (cache.model != &lctx.model || cache.ktype != lctx.kv_self.k->type || cache.vtype != lctx.kv_self.v->type) {
+        fprintf(stderr, "%s: the context does not have the model and KV cache types of the prompt cache\n", __func__);
+        return false;
     }
 
     return true;
 }
 
+// splits the tokens of node at n, the first n move to a new parent node
+static void llama_prompt_cache_split(
+        struct llama_prompt_cache & cache,
+          llama_prompt_cache_node * node,
+                              int   n) {
+    const auto & hparams = cache.model->hparams;
+
+    const int n_tokens = node->tokens.size();
+    const size_t k_row_size = node->k.size()/(hparams.n_layer*n_tokens);
+    const size_t v_row_size = node->v.size()/(hparams.n_layer*hparams.n_head*n_tokens);
+
+    std::unique_ptr<llama_prompt_cache_node> head(new llama_prompt_cache_node);
+    head->tokens.assign(node->tokens.begin(), node->tokens.begin() + n);
+    head->k.resize(k_row_size*hparams.n_layer*n);
+    head->v.resize(v_row_size*hparams.n_layer*hparams.n_head*n);
+    head->last_used = node->last_used;
+    head->parent    = node->parent;
+
+    std::vector<uint8_t> k(k_row_size*hparams.n_layer*(n_tokens - n));
+    std::vector<uint8_t> v(v_row_size*hparams.n_layer*hparams.n_head*(n_tokens - n));
+
+    llama_prompt_cache_copy(hparams, k_row_size, v_row_size, head->k.data(), head->v.data(), n, 0,
+            node->k.data(), node->v.data(), n_tokens, 0, n);
+    llama_prompt_cache_copy(hparams, k_row_size, v_row_size, k.data(), v.data(), n_tokens - n, 0,
+            node->k.data(), node->v.data(), n_tokens, n, n_tokens - n);
+
+    node->tokens.erase(node->tokens.begin(), node->tokens.begin() + n);
+    node->k.swap(k);
+    node->v.swap(v);
+
+    // hang the new node in place of the old one, with the old one as its only child
+    auto & slot = node->parent->children[head->tokens[0]];
+    node->parent = head.get();
+    head->children[node->tokens[0]] = std::move(slot);
+    slot = std::move(head);
+}
+
+// frees the least recently used prompts until the cache fits in its budget
+static void llama_prompt_cache_evict(struct llama_prompt_cache & cache) {
+    std::vector<llama_prompt_cache_node *> stack;
+
+    while (cache.n_bytes > cache.max_bytes && !cache.root.children.empty()) {
+        // only leaves are freed, their ancestors have been used at least as recently
+        llama_prompt_cache_node * lru = nullptr;
+
+        stack.assign(1, &cache.root);
+        while (!stack.empty()) {
+            llama_prompt_cache_node * node = stack.back();
+            stack.pop_back();
+            if (node->children.empty() && (!lru || node->last_used < lru->last_used)) {
+                lru = node;
+            }
+            for (const auto & child : node->children) {
+                stack.push_back(child.second.get());
+            }
+        }
+
+        cache.n_bytes -= lru->k.size() + lru->v.size();
+        lru->parent->children.erase(lru->tokens[0]);
+    }
+}
+
+struct llama_prompt_cache * llama_prompt_cache_init(size_t max_bytes) {
+    llama_prompt_cache * cache = new llama_prompt_cache;
+    cache->max_bytes = max_bytes;
+    return cache;
+}
+
+void llama_prompt_cache_free(struct llama_prompt_cache * cache) {
+    delete cache;
+}
+
+int llama_prompt_cache_store(
+    struct llama_prompt_cache * cache,
+         struct llama_context * ctx,
+            const llama_token * tokens,
+                          int   n_tokens) {
+    if (!llama_prompt_cache_check(*cache, *ctx)) {
+        return 1;
+    }
+
+    auto & kv_self = ctx->kv_self;
+    const auto & hparams = ctx->model.hparams;
+
+    if (n_tokens > kv_self.n) {
+        fprintf(stderr, "%s: the KV cache holds %d tokens, cannot store %d\n", __func__, kv_self.n, n_tokens);
+        return 1;
+    }
+
+    const size_t k_row_size = kv_cache_nbytes(kv_self.k, hparams.n_embd);
+    const size_t v_row_size = kv_cache_nbytes(kv_self.v, hparams.n_embd/hparams.n_head);
+
+    const int64_t t_use = ++cache->n_uses;
+
+    llama_prompt_cache_node * node = &cache->root;
+    int n_past = 0;
+
+    while (n_past < n_tokens) {
+        auto it = node->children.find(tokens[n_past]);
+        if (it == node->children.end()) {
+            // a new leaf for the tokens that are not in the cache yet
+            const int n = n_tokens - n_past;
+
+            std::unique_ptr<llama_prompt_cache_node> leaf(new llama_prompt_cache_node);
+            leaf->tokens.assign(tokens + n_past, tokens + n_tokens);
+            leaf->k.resize(k_row_size*hparams.n_layer*n);
+            leaf->v.resize(v_row_size*hparams.n_layer*hparams.n_head*n);
+            leaf->last_used = t_use;
+            leaf->parent    = node;
+
+            kv_cache_visit(kv_self, hparams, n_past, n, n, 0, [&](const uint8_t * data, size_t offs, size_t size) {
+                uint8_t * dst = offs < leaf->k.size() ? leaf->k.data() + offs : leaf->v.data() + offs - leaf->k.size();
+                if (data) {
+                    memcpy(dst, data, size);
+                } else {
+                    memset(dst, 0, size);
+                }
+            });
+
+            cache->n_bytes += leaf->k.size() + leaf->v.size();
+            node->children[tokens[n_past]] = std::move(leaf);
+            break;
+        }
+
+        llama_prompt_cache_node * child = it->second.get();
+
+        int n_match = 1;
+        while (n_match < (int) child->tokens.size() && n_past + n_match < n_tokens &&
+               child->tokens[n_match] == tokens[n_past + n_match]) {
+            n_match++;
+        }
+
+        if (n_match < (int) child->tokens.size()) {
+            llama_prompt_cache_split(*cache, child, n_match);
+            child = child->parent;
+        }
+
+        child->last_used = t_use;
+        node = child;
+        n_past += n_match;
+    }
+
+    llama_prompt_cache_evict(*cache);
+
+    return 0;
+}
+
+int llama_prompt_cache_restore(
+    struct llama_prompt_cache * cache,
+         struct llama_context * ctx,
+            const llama_token * tokens,
+                          int   n_tokens) {
+    if (!cache->model || !llama_prompt_cache_check(*cache, *ctx)) {
+        return 0;
+    }
+
+    auto & kv_self = ctx->kv_self;
+    const auto & hparams = ctx->model.hparams;
+
+    const int64_t t_use = ++cache->n_uses;
+
+    // the last token is always left to evaluate, so that the context has its logits
+    const int n_max = std::min(n_tokens - 1, ctx->n_ctx);
+
+    llama_prompt_cache_node * node = &cache->root;
+    int n_past = 0;
+
+    while (n_past < n_max) {
+        auto it = node->children.find(tokens[n_past]);
+        if (it == node->children.end()) {
+            break;
+        }
+
+        llama_prompt_cache_node * child = it->second.get();
+
+        int n_match = 1;
+        while (n_match < (int) child->tokens.size() && n_past + n_match < n_max &&
+               child->tokens[n_match] == tokens[n_past + n_match]) {
+            n_match++;
+        }
+
+        if (!kv_cache_alloc(kv_self, n_past, n_past + n_match)) {
+            break;
+        }
+
+        // the K and V of a prefix of the node are valid on their own
+        kv_cache_visit(kv_self, hparams, n_past, n_match, child->tokens.size(), 0, [&](uint8_t * data, size_t offs, size_t size) {
+            memcpy(data, offs < child->k.size() ? child->k.data() + offs : child->v.data() + offs - child->k.size(), size);
+        });
+
+        child->last_used = t_use;
+        node = child;
+        n_past += n_match;
+
+        if (n_match < (int) child->tokens.size()) {
+            break;
+        }
+    }
+
+    kv_self.n = n_past;
+    kv_cache_reset_cells(kv_self, n_past);
+
+    return n_past;
+}
+
 int llama_eval(
         struct llama_context * ctx,
            const llama_token * tokens,
                          int   n_tokens,
                          int   n_past,
                          int   n_threads) {
-    if (!llama_eval_internal(*ctx, tokens, n_tokens, n_past, n_threads)) {
+    if (!llama_eval_internal(*ctx, tokens, n_tokens, n_past, n_threads, nullptr, nullptr, nullptr)) {
+        fprintf(stderr, "%s: failed to eval\n", __func__);
+        return 1;
+    }
+    // get a more accurate load time, upon first eval
+    if (!ctx->has_evaluated_once) {
+        ctx->t_load_us = ggml_time_us() - ctx->t_start_us;
+        ctx->has_evaluated_once = true;
+    }
+    return 0;
+}
+
+int llama_eval_masked(
+        struct llama_context * ctx,
+           const llama_token * tokens,
+                         int   n_tokens,
+                         int   n_past,
+                         int   n_threads,
+                  const bool * need_logits) {
+    if (!llama_eval_internal(*ctx, tokens, n_tokens, n_past, n_threads, nullptr, nullptr, need_logits)) {
+        fprintf(stderr, "%s: failed to eval\n", __func__);
+        return 1;
+    }
+    // get a more accurate load time, upon first eval
+    if (!ctx->has_evaluated_once) {
+        ctx->t_load_us = ggml_time_us() - ctx->t_start_us;
+        ctx->has_evaluated_once = true;
+    }
+    return 0;
+}
+
+int llama_eval_batch(
+        struct llama_context * ctx,
+           const llama_token * tokens,
+                   const int * pos,
+          const llama_seq_id * seq_id,
+                         int   n_tokens,
+                         int   n_threads) {
+    if (!llama_eval_internal(*ctx, tokens, n_tokens, 0, n_threads, pos, seq_id, nullptr)) {
         fprintf(stderr, "%s: failed to eval\n", __func__);
         return 1;
     }
@@ -2735,13 +4371,78 @@ int llama_eval(
     return 0;
 }
 
+int llama_kv_cache_shift(struct llama_context * ctx, int n_keep, int n_discard, int n_threads) {
+    if (!llama_kv_cache_shift_internal(*ctx, n_keep, n_discard, n_threads)) {
+        fprintf(stderr, "%s: failed to shift the KV cache\n", __func__);
+        return 1;
+    }
+    return 0;
+}
+
+void llama_kv_cache_seq_rm(struct llama_context * ctx, llama_seq_id seq_id, int p0) {
+    auto & kv_self = ctx->kv_self;
+
+    for (auto & cell : kv_self.cells) {
+        if (cell.seq_id == seq_id && cell.pos >= p0) {
+            cell.pos    = -1;
+            cell.seq_id = -1;
+        }
+    }
+
+    // the attention only needs to span the cells up to the last used one
+    while (kv_self.n > 0 && kv_self.cells[kv_self.n - 1].seq_id < 0) {
+        kv_self.n--;
+    }
+
+    kv_cache_release(kv_self);
+}
+
+int llama_kv_cache_fork(struct llama_context * dst, struct llama_context * src) {
+    if (dst == src) {
+        return 0;
+    }
+
+    if (!dst->kv_self.pool || dst->kv_self.pool != src->kv_self.pool) {
+        fprintf(stderr, "%s: the contexts do not have the same model and KV cache types\n", __func__);
+        return 1;
+    }
+
+    auto & kv_dst = dst->kv_self;
+    auto & kv_src = src->kv_self;
+
+    kv_cache_reset_cells(kv_dst, 0);
+
+    // the blocks are shared until one of the contexts writes to them
+    for (int b = 0; b < (int) kv_src.blocks.size(); ++b) {
+        if (kv_src.blocks[b] >= 0) {
+            kv_pool_ref(*kv_src.pool, kv_src.blocks[b]);
+        }
+    }
+
+    kv_dst.blocks = kv_src.blocks;
+    kv_dst.cells  = kv_src.cells;
+    kv_dst.n      = kv_src.n;
+
+    dst->rng        = src->rng;
+    dst->logits     = src->logits;
+    dst->output_ids = src->output_ids;
+    dst->embedding  = src->embedding;
+
+    return 0;
+}
+
 int llama_tokenize(
         struct llama_context * ctx,
                   const char * text,
                  llama_token * tokens,
                          int   n_max_tokens,
                         bool   add_bos) {
-    auto res = llama_tokenize(ctx->vocab, text, add_bos);
+    if (!ctx->tokenizer) {
+        ctx->tokenizer = new llama_tokenizer(ctx->vocab);
+    }
+
+    auto & res = ctx->tokenize_out;
+    llama_tokenize(*ctx->tokenizer, text, add_bos, res);
 
     if (n_max_tokens < (int) res.size()) {
         fprintf(stderr, "%s: too many tokens\n", __func__);
@@ -2755,12 +4456,100 @@ int llama_tokenize(
     return res.size();
 }
 
+int llama_tokenize_batch(
+        struct llama_context * ctx,
+           const char * const * texts,
+                         int   n_texts,
+                 llama_token * tokens,
+                         int   n_max_tokens,
+                         int * offsets,
+                        bool   add_bos,
+                         int   n_threads) {
+    const llama_trie & trie = ctx->vocab.trie;
+
+    // the pieces of all the texts in order, every text has at least one
+    struct piece {
+        int          text;
+        const char * begin;
+        size_t       len;
+    };
+
+    std::vector<piece> pieces;
+    {
+        std::vector<std::pair<size_t, size_t>> split;
+        for (int i = 0; i < n_texts; ++i) {
+            split.clear();
+            llama_tokenize_split(trie, texts[i], strlen(texts[i]), LLAMA_TOKENIZE_CHUNK_SIZE, split);
+            for (const auto & p : split) {
+                pieces.push_back({ i, texts[i] + p.first, p.second - p.first });
+            }
+        }
+    }
+
+    const size_t n_pieces = pieces.size();
+    n_threads = std::max(1, std::min(n_threads, (int) n_pieces));
+
+    std::vector<std::vector<llama_vocab::id>> out(n_pieces);
+    std::atomic<size_t> next_piece(0);
+
+    // every thread needs its own symbols and work queue, the calling thread uses the one of the context
+    if (!ctx->tokenizer) {
+        ctx->tokenizer = new llama_tokenizer(ctx->vocab);
+    }
+
+    auto tokenize_pieces = [&](llama_tokenizer * tokenizer) {
+        for (size_t i; (i = next_piece++) < n_pieces; ) {
+            tokenizer->tokenize(pieces[i].begin, pieces[i].len, out[i]);
+        }
+    };
+
+    std::vector<llama_tokenizer> tokenizers(n_threads - 1, llama_tokenizer(ctx->vocab));
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(tokenize_pieces, &tokenizers[i - 1]);
+    }
+    tokenize_pieces(ctx->tokenizer);
+    for (std::thread & worker : workers) {
+        worker.join();
+    }
+
+    // the BOS token is only added to non-empty texts, as llama_tokenize does
+    size_t n_tokens = 0;
+    for (int i = 0; i < n_texts; ++i) {
+        n_tokens += add_bos && texts[i][0] != '\0';
+    }
+    for (const auto & o : out) {
+        n_tokens += o.size();
+    }
+
+    if (n_max_tokens < (int) n_tokens) {
+        fprintf(stderr, "%s: too many tokens\n", __func__);
+        return -((int) n_tokens);
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < n_pieces; ++i) {
+        const int t = pieces[i].text;
+        if (i == 0 || pieces[i - 1].text != t) {
+            offsets[t] = n;
+            if (add_bos && texts[t][0] != '\0') {
+                tokens[n++] = llama_token_bos();
+            }
+        }
+        std::copy(out[i].begin(), out[i].end(), tokens + n);
+        n += out[i].size();
+    }
+    offsets[n_texts] = n;
+
+    return n;
+}
+
 int llama_n_vocab(const struct llama_context * ctx) {
     return ctx->vocab.id_to_token.size();
 }
 
 int llama_n_ctx(const struct llama_context * ctx) {
-    return ctx->model.hparams.n_ctx;
+    return ctx->n_ctx;
 }
 
 int llama_n_embd(const struct llama_context * ctx) {
@@ -2808,6 +4597,23 @@ void llama_print_timings(struct llama_context * ctx) {
     fprintf(stderr, "%s:      sample time = %8.2f ms / %5d runs   (%8.2f ms per run)\n",   __func__, 1e-3 * ctx->t_sample_us, n_sample, 1e-3 * ctx->t_sample_us / n_sample);
     fprintf(stderr, "%s: prompt eval time = %8.2f ms / %5d tokens (%8.2f ms per token)\n", __func__, 1e-3 * ctx->t_p_eval_us, n_p_eval, 1e-3 * ctx->t_p_eval_us / n_p_eval);
     fprintf(stderr, "%s:        eval time = %8.2f ms / %5d runs   (%8.2f ms per run)\n",   __func__, 1e-3 * ctx->t_eval_us,   n_eval,   1e-3 * ctx->t_eval_us   / n_eval);
+
+    // building the single-token graph is skipped when it can be reused, each reuse saves about the time of one build
+    const int32_t n_graph_build = std::max(1, ctx->n_graph_build);
+    const double  t_graph_build = 1e-3 * ctx->t_graph_build_us / n_graph_build;
+
+    fprintf(stderr, "%s:  graph build time = %8.2f ms / %5d builds (%8.2f ms per build, reused %5d times, saved %8.2f ms per run)\n",
+            __func__, 1e-3 * ctx->t_graph_build_us, ctx->n_graph_build, t_graph_build, ctx->n_graph_reuse, t_graph_build * ctx->n_graph_reuse / n_eval);
+    if (ctx->kv_self.pool) {
+        const auto & pool = *ctx->kv_self.pool;
+
+        const int n_blocks = std::count_if(ctx->kv_self.blocks.begin(), ctx->kv_self.blocks.end(), [](int32_t ib) { return ib >= 0; });
+
+        fprintf(stderr, "%s:    kv cache size = %8.2f MB / %5d blocks (%d cells per block, %d blocks used by the model)\n", __func__,
+                n_blocks*(pool.k_stride + pool.v_stride)/1024.0/1024.0, n_blocks, LLAMA_KV_BLOCK_SIZE, pool.n_used);
+    }
+    fprintf(stderr, "%s:   compute buffer = %8.2f MB (%8.2f MB used at most by the graphs)\n", __func__,
+            ctx->buf_alloc.size/1024.0/1024.0, ctx->alloc_peak/1024.0/1024.0);
     fprintf(stderr, "%s:       total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0);
 }
 
@@ -2816,6 +4622,8 @@ void llama_reset_timings(struct llama_context * ctx) {
     ctx->t_sample_us = ctx->n_sample = 0;
     ctx->t_eval_us   = ctx->n_eval   = 0;
     ctx->t_p_eval_us = ctx->n_p_eval = 0;
+
+    ctx->t_graph_build_us = ctx->n_graph_build = ctx->n_graph_reuse = 0;
 }
 
 const char * llama_print_system_info(void) {
@@ -2841,6 +4649,6 @@ const char * llama_print_system_info(void) {
 }
 
 // For internal test use
-std::vector<std::pair<std::string, struct ggml_tensor *>>& llama_internal_get_tensor_map(struct llama_context * ctx) {
+const std::vector<std::pair<std::string, struct ggml_tensor *>>& llama_internal_get_tensor_map(struct llama_context * ctx) {
     return ctx->model.tensors_by_name;
 }
@@ -23,7 +23,7 @@
 #define LLAMA_FILE_MAGIC             'ggjt'
 #define LLAMA_FILE_MAGIC_UNVERSIONED 'ggml'
 #define LLAMA_SESSION_MAGIC          'ggsn'
-#define LLAMA_SESSION_VERSION        1
+#define LLAMA_SESSION_VERSION        4
 
 #ifdef __cplusplus
 extern "C" {
@@ -35,9 +35,12 @@ extern "C" {
     // TODO: show sample usage
     //
 
+    struct llama_model;
     struct llama_context;
+    struct llama_prompt_cache;
 
     typedef int llama_token;
+    typedef int llama_seq_id;
 
     typedef struct llama_token_data {
         llama_token id;  // token id
@@ -53,6 +56,13 @@ extern "C" {
 
     typedef void (*llama_progress_callback)(float progress, void *ctx);
 
+    // storage type of the K half of the KV cache
+    enum llama_kv_type {
+        LLAMA_KV_TYPE_DEFAULT = 0, // same as V: F16 if f16_kv is set, else F32
+        LLAMA_KV_TYPE_Q8_0    = 1, // requires a head size that is a multiple of 32
+        LLAMA_KV_TYPE_Q4_0    = 2, // requires a head size that is a multiple of 32
+    };
+
     struct llama_context_params {
         int n_ctx;   // text context
         int n_parts; // -1 for default
@@ -69,6 +79,22 @@ extern "C" {
         llama_progress_callback progress_callback;
         // context pointer passed to the progress callback
         void * progress_callback_user_data;
+
+        enum llama_kv_type kv_type_k; // quantize the K cache to cut its memory for long contexts
+        bool numa;       // spread the threads over the NUMA nodes, the weights are placed on the nodes that use them
+    };
+
+    // parameters of llama_sample_chain()
+    struct llama_sampling_params {
+        float temp;            // <= 0.0 to select the most likely token
+        int   top_k;           // <= 0 to use vocab size
+        float top_p;           // 1.0 = disabled
+        float tfs_z;           // 1.0 = disabled
+        float typical_p;       // 1.0 = disabled
+        float repeat_penalty;  // 1.0 = disabled
+        float alpha_frequency; // 0.0 = disabled
+        float alpha_presence;  // 0.0 = disabled
+        bool  penalize_nl;     // also apply the penalties to the newline token
     };
 
     // model file types
@@ -86,12 +112,35 @@ extern "C" {
     };
 
     LLAMA_API struct llama_context_params llama_context_default_params();
+    LLAMA_API struct llama_sampling_params llama_sampling_default_params();
 
     LLAMA_API bool llama_mmap_supported();
     LLAMA_API bool llama_mlock_supported();
 
+    // Load the weights and vocabulary of a model, to be shared by any number of contexts
+    // Uses n_ctx, f16_kv, use_mmap, use_mlock, numa, vocab_only and the progress callback of params,
+    // n_ctx is the largest context size of the contexts created from the model
+    // Return NULL on failure
+    LLAMA_API struct llama_model * llama_load_model_from_file(
+                             const char * path_model,
+            struct llama_context_params   params);
+
+    // Frees the model - all the contexts using it must be freed first
+    LLAMA_API void llama_free_model(struct llama_model * model);
+
+    // Create a context over a loaded model, with its own KV cache, compute buffers, RNG and logits
+    // Uses n_ctx, seed, f16_kv, kv_type_k, logits_all, vocab_only and embedding of params,
+    // n_ctx is at most the n_ctx of the model (<= 0 for the same), its KV cache and buffers are sized for it
+    // The KV caches of all the contexts of a model share a pool that holds 64 times the n_ctx of the model
+    // tokens (n_ctx tokens where the address space cannot be reserved up front), an eval fails once it is full
+    // Return NULL on failure
+    LLAMA_API struct llama_context * llama_new_context_with_model(
+                     struct llama_model * model,
+            struct llama_context_params   params);
+
     // Various functions for loading a ggml llama model.
     // Allocate (almost) all memory needed for the model.
+    // The model is owned by the context and freed with it
     // Return NULL on failure
     LLAMA_API struct llama_context * llama_init_from_file(
                              const char * path_model,
@@ -121,14 +170,21 @@ extern "C" {
                       const char * path_base_model,
                              int   n_threads);
 
+    // Same as llama_apply_lora_from_file(), the adapter is seen by all the contexts of the model
+    LLAMA_API int llama_model_apply_lora_from_file(
+       const struct llama_model * model,
+                      const char * path_lora,
+                      const char * path_base_model,
+                             int   n_threads);
+
     // Returns the number of tokens in the KV cache
     LLAMA_API int llama_get_kv_cache_token_count(const struct llama_context * ctx);
 
     // Sets the current rng seed.
     LLAMA_API void llama_set_rng_seed(struct llama_context * ctx, int seed);
 
-    // Returns the maximum size in bytes of the state (rng, logits, embedding
-    // and kv_cache) - will often be smaller after compacting tokens
+    // Returns the size in bytes of the state (rng, logits, embedding and kv_cache) as of the last eval,
+    // it grows with the number of tokens in the KV cache and the logits returned by the last eval
     LLAMA_API size_t llama_get_state_size(const struct llama_context * ctx);
 
     // Copies the state to the specified destination address.
@@ -141,9 +197,40 @@ extern "C" {
     LLAMA_API size_t llama_set_state_data(struct llama_context * ctx, const uint8_t * src);
 
     // Save/load session file
+    // The file is mapped on load and the K and V of its tokens are copied from it into the KV cache
     LLAMA_API bool llama_load_session_file(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out);
     LLAMA_API bool llama_save_session_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count);
 
+    // Same as llama_save_session_file(), but if the tokens of the session file are a prefix of tokens only the K and V
+    // of the new tokens and the current rng and logits are appended to it, so a session can be saved after every turn
+    // Falls back to rewriting the whole file if it does not exist or does not match
+    LLAMA_API bool llama_append_session_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count);
+
+    // In-process cache of the KV caches of evaluated prompts, shared by the contexts of a model
+    // The prompts are kept in a radix tree over their tokens, so a common prefix like a system prompt is stored once,
+    // and the least recently used ones are dropped to stay under max_bytes
+    // The prompt cache functions use the KV cache of a context as llama_eval() does, as a single sequence
+    // The cached prompts are no longer valid once a LoRA adapter is applied to the model, free the cache then
+    LLAMA_API struct llama_prompt_cache * llama_prompt_cache_init(size_t max_bytes);
+    LLAMA_API void llama_prompt_cache_free(struct llama_prompt_cache * cache);
+
+    // Stores the K and V of tokens[0, n_tokens) from the KV cache of ctx, which must hold these tokens from position 0
+    // All the contexts using a prompt cache must have the same model and KV cache types
+    // Returns 0 on success
+    LLAMA_API int llama_prompt_cache_store(
+       struct llama_prompt_cache * cache,
+            struct llama_context * ctx,
+               const llama_token * tokens,
+                             int   n_tokens);
+
+    // Restores into the KV cache of ctx the longest cached prefix of tokens, but never the last token
+    // Returns the number of restored tokens n: continue with llama_eval(ctx, tokens + n, n_tokens - n, n, n_threads)
+    LLAMA_API int llama_prompt_cache_restore(
+       struct llama_prompt_cache * cache,
+            struct llama_context * ctx,
+               const llama_token * tokens,
+                             int   n_tokens);
+
     // Run the llama inference to obtain the logits and probabilities for the next token.
     // tokens + n_tokens is the provided batch of new tokens to process
     // n_past is the number of tokens to use from previous eval calls
@@ -155,6 +242,54 @@ extern "C" {
                              int   n_past,
                              int   n_threads);
 
+    // Same as llama_eval(), but the logits are computed only for the tokens with need_logits[i] set
+    // (need_logits has n_tokens entries), which skips the output layer for the other tokens
+    // llama_get_logits() returns one row per selected token, in order; logits_all is ignored
+    LLAMA_API int llama_eval_masked(
+            struct llama_context * ctx,
+               const llama_token * tokens,
+                             int   n_tokens,
+                             int   n_past,
+                             int   n_threads,
+                      const bool * need_logits);
+
+    // Run the llama inference on a batch of tokens that may belong to different sequences.
+    // tokens[i] is the token at position pos[i] of the sequence seq_id[i] (seq_id >= 0)
+    // All sequences share the KV cache: each new token is stored in a free cell and attends only to
+    // the tokens of its own sequence with a position <= pos[i], so a single pass over the weights
+    // evaluates the next token of many sequences
+    // When the free cells are scattered by llama_kv_cache_seq_rm(), the used cells are moved together first
+    // The logits of all tokens of the batch are returned by llama_get_logits(), row i for tokens[i]
+    // Do not mix with llama_eval() on the same context - it treats the whole cache as one sequence
+    // Returns 0 on success, 1 if fewer than n_tokens cells of the KV cache are free
+    LLAMA_API int llama_eval_batch(
+            struct llama_context * ctx,
+               const llama_token * tokens,
+                       const int * pos,
+              const llama_seq_id * seq_id,
+                             int   n_tokens,
+                             int   n_threads);
+
+    // Removes the tokens of sequence seq_id with a position >= p0 from the KV cache, freeing their cells and the
+    // memory of the blocks of cells left empty
+    // Use p0 = 0 to drop the whole sequence once it is finished
+    // The tokens of llama_eval() are sequence 0: llama_kv_cache_seq_rm(ctx, 0, n) keeps the first n, e.g. to roll back
+    // rejected draft tokens, and llama_get_kv_cache_token_count() returns n after it
+    LLAMA_API void llama_kv_cache_seq_rm(struct llama_context * ctx, llama_seq_id seq_id, int p0);
+
+    // Removes the tokens [n_keep, n_keep + n_discard) of the llama_eval() sequence from the KV cache and moves
+    // the following tokens down by n_discard, re-rotating their keys to the new positions in place
+    // Continue with n_past reduced by n_discard - used to slide the context window without re-evaluating it
+    // Returns 0 on success
+    LLAMA_API int llama_kv_cache_shift(struct llama_context * ctx, int n_keep, int n_discard, int n_threads);
+
+    // Makes the KV cache of dst a copy of the one of src, with the logits, embeddings and RNG state of src
+    // The cache is stored in blocks of cells that the two contexts share until one of them writes to a block,
+    // so forking a long prompt costs no memory up front - e.g. to sample several continuations of a prompt
+    // The contexts must be created from the same model with the same KV cache types
+    // Returns 0 on success
+    LLAMA_API int llama_kv_cache_fork(struct llama_context * dst, struct llama_context * src);
+
     // Convert the provided text into tokens.
     // The tokens pointer must be large enough to hold the resulting tokens.
     // Returns the number of tokens on success, no more than n_max_tokens
@@ -167,14 +302,29 @@ extern "C" {
                              int   n_max_tokens,
                             bool   add_bos);
 
+    // Tokenizes n_texts texts on up to n_threads threads, with the same result as calling llama_tokenize on each
+    // Long texts are split at spaces that no token spans and the pieces are tokenized in parallel
+    // The tokens of texts[i] are written to tokens[offsets[i], offsets[i + 1]), offsets must hold n_texts + 1 entries
+    // Returns the total number of tokens on success, no more than n_max_tokens
+    // Returns a negative number on failure - the number of tokens that would have been returned
+    LLAMA_API int llama_tokenize_batch(
+            struct llama_context * ctx,
+               const char * const * texts,
+                             int   n_texts,
+                     llama_token * tokens,
+                             int   n_max_tokens,
+                             int * offsets,
+                            bool   add_bos,
+                             int   n_threads);
+
     LLAMA_API int llama_n_vocab(const struct llama_context * ctx);
     LLAMA_API int llama_n_ctx  (const struct llama_context * ctx);
     LLAMA_API int llama_n_embd (const struct llama_context * ctx);
 
-    // Token logits obtained from the last call to llama_eval()
+    // Token logits obtained from the last call to llama_eval(), llama_eval_masked() or llama_eval_batch()
     // The logits for the last token are stored in the last row
     // Can be mutated in order to change the probabilities of the next token
-    // Rows: n_tokens
+    // Rows: n_tokens (1 for llama_eval() without logits_all, the selected tokens for llama_eval_masked())
     // Cols: n_vocab
     LLAMA_API float * llama_get_logits(struct llama_context * ctx);
 
@@ -235,6 +385,12 @@ extern "C" {
     /// @details Randomly selects a token from the candidates based on their probabilities.
     LLAMA_API llama_token llama_sample_token(struct llama_context * ctx, llama_token_data_array * candidates);
 
+    /// @details Samples a token from a row of n_vocab logits (e.g. llama_get_logits()) with the repetition, frequency and presence penalties,
+    /// top-k, tail free, typical, top-p and temperature, in that order - the same result as calling the functions above on a candidate
+    /// array of the whole vocabulary, without building and sorting that array: the top-k tokens are selected with a heap into storage
+    /// kept in the context. The logits are not modified.
+    LLAMA_API llama_token llama_sample_chain(struct llama_context * ctx, const float * logits, const struct llama_sampling_params * params, const llama_token * last_tokens, size_t last_tokens_size);
+
     // Performance information
     LLAMA_API void llama_print_timings(struct llama_context * ctx);
     LLAMA_API void llama_reset_timings(struct llama_context * ctx);
@@ -253,7 +409,7 @@ extern "C" {
 #include <string>
 struct ggml_tensor;
 
-std::vector<std::pair<std::string, struct ggml_tensor *>>& llama_internal_get_tensor_map(struct llama_context * ctx);
+const std::vector<std::pair<std::string, struct ggml_tensor *>>& llama_internal_get_tensor_map(struct llama_context * ctx);
 
 #endif
 
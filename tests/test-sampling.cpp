@@ -7,6 +7,7 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <random>
 
 
 void dump(const llama_token_data_array * candidates) {
@@ -170,7 +171,85 @@ void test_frequency_presence_penalty(
     }
 }
 
-int main(void) {
+// the old sequence of calls of the examples, from the llama_token_data array of all tokens
+llama_token sample_sequence(
+                llama_context * ctx,
+                const std::vector<float> & logits,
+                const llama_sampling_params & params,
+                const std::vector<llama_token> & last_tokens) {
+    const int n_vocab = logits.size();
+
+    std::vector<llama_token_data> candidates;
+    candidates.reserve(n_vocab);
+    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+        candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    }
+
+    llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
+
+    const float nl_logit = candidates[llama_token_nl()].logit;
+    llama_sample_repetition_penalty(ctx, &candidates_p, last_tokens.data(), last_tokens.size(), params.repeat_penalty);
+    llama_sample_frequency_and_presence_penalties(ctx, &candidates_p, last_tokens.data(), last_tokens.size(), params.alpha_frequency, params.alpha_presence);
+    if (!params.penalize_nl) {
+        candidates[llama_token_nl()].logit = nl_logit;
+    }
+
+    if (params.temp <= 0) {
+        return llama_sample_token_greedy(ctx, &candidates_p);
+    }
+
+    llama_sample_top_k(ctx, &candidates_p, params.top_k <= 0 ? n_vocab : params.top_k);
+    llama_sample_tail_free(ctx, &candidates_p, params.tfs_z);
+    llama_sample_typical(ctx, &candidates_p, params.typical_p);
+    llama_sample_top_p(ctx, &candidates_p, params.top_p);
+    llama_sample_temperature(ctx, &candidates_p, params.temp);
+    return llama_sample_token(ctx, &candidates_p);
+}
+
+
+// llama_sample_chain picks the same tokens as the sequence of calls with the same logits, history and seed
+// returns the number of rows where they differ, the tests above rely on assert and do not run in release builds
+int test_sample_chain(llama_context * ctx, const llama_sampling_params & params, int n_rows) {
+    const int n_vocab = llama_n_vocab(ctx);
+
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> dist_logit(-10.0f, 10.0f);
+    std::uniform_int_distribution<int>    dist_token(0, n_vocab - 1);
+
+    std::vector<float> logits(n_vocab);
+    std::vector<llama_token> last_tokens(64);
+
+    int n_fail = 0;
+
+    for (int row = 0; row < n_rows; row++) {
+        for (float & logit : logits) {
+            logit = dist_logit(rng);
+        }
+        // on every other row the newline is the most likely token unless it is penalized
+        if (row % 2 == 0) {
+            logits[llama_token_nl()] = 10.5f;
+        }
+        for (llama_token & token : last_tokens) {
+            token = dist_token(rng) % 8 == 0 ? llama_token_nl() : dist_token(rng);
+        }
+
+        llama_set_rng_seed(ctx, row);
+        const llama_token expected = sample_sequence(ctx, logits, params, last_tokens);
+
+        llama_set_rng_seed(ctx, row);
+        const llama_token result = llama_sample_chain(ctx, logits.data(), &params, last_tokens.data(), last_tokens.size());
+
+        if (result != expected) {
+            printf("%s: row %d: got token %d, expected %d\n", __func__, row, result, expected);
+            n_fail++;
+        }
+        assert(result == expected);
+    }
+
+    return n_fail;
+}
+
+int main(int argc, char ** argv) {
     ggml_time_init();
 
     test_top_k({0.1, 0.2, 0.3, 0.4}, {0.4}, 1);
@@ -195,5 +274,53 @@ int main(void) {
     test_frequency_presence_penalty({0.2, 0.2, 0.2, 0.2, 0.2}, {0, 1, 2},       {0.499966, 0.499966, 0.000023, 0.000023, 0.000023}, 5.0, 5.0);
     test_frequency_presence_penalty({0.2, 0.2, 0.2, 0.2, 0.2}, {0, 1, 2, 0, 0}, {0.499977, 0.499977, 0.000023, 0.000023, 0.000000}, 5.0, 5.0);
 
+    int n_fail = 0;
+
+    // the chain needs a context for the vocabulary and the RNG
+    if (argc > 1) {
+        auto lparams = llama_context_default_params();
+        lparams.vocab_only = true;
+
+        llama_context * ctx = llama_init_from_file(argv[1], lparams);
+        assert(ctx != NULL);
+
+        llama_sampling_params params = llama_sampling_default_params();
+        params.alpha_frequency = 0.5f;
+        params.alpha_presence  = 0.5f;
+        n_fail += test_sample_chain(ctx, params, 200);
+
+        params.tfs_z     = 0.95f;
+        params.typical_p = 0.9f;
+        n_fail += test_sample_chain(ctx, params, 200);
+
+        params.top_k = 0;
+        n_fail += test_sample_chain(ctx, params, 50);
+
+        params.top_k = -1;
+        params.temp  = 1.5f;
+        n_fail += test_sample_chain(ctx, params, 50);
+
+        params.top_k = 40;
+        params.temp  = 0.0f;
+        n_fail += test_sample_chain(ctx, params, 200);
+
+        params.temp = -1.0f;
+        n_fail += test_sample_chain(ctx, params, 50);
+
+        params.temp        = 0.8f;
+        params.penalize_nl = false;
+        n_fail += test_sample_chain(ctx, params, 200);
+
+        params.temp = 0.0f;
+        n_fail += test_sample_chain(ctx, params, 200);
+
+        llama_free(ctx);
+    }
+
+    if (n_fail > 0) {
+        printf("FAILED\n");
+        return 1;
+    }
+
     printf("OK\n");
 }
@@ -1,6 +1,8 @@
 #include "llama.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <chrono>
 #include <string>
 #include <map>
 #include <vector>
@@ -81,6 +83,54 @@ int main(int argc, char **argv) {
         }
     }
 
+    // the batch tokenizer splits the texts into pieces, the tokens must not change
+    {
+        std::vector<std::string> texts;
+        for (const auto & test_kv : k_tests()) {
+            texts.push_back(test_kv.first);
+        }
+        texts.push_back("");
+        while (texts.back().size() < 1024*1024) {
+            for (const auto & test_kv : k_tests()) {
+                texts.back() += test_kv.first;
+                texts.back() += "\n";
+            }
+        }
+
+        std::vector<const char *> ptrs;
+        size_t n_max = 0;
+        for (const auto & text : texts) {
+            ptrs.push_back(text.c_str());
+            n_max += text.size() + 1;
+        }
+
+        std::vector<llama_token> res(n_max);
+        std::vector<int> offsets(texts.size() + 1);
+
+        const auto t_start = std::chrono::high_resolution_clock::now();
+        const int n = llama_tokenize_batch(ctx, ptrs.data(), ptrs.size(), res.data(), res.size(), offsets.data(), true, 4);
+        const auto t_end = std::chrono::high_resolution_clock::now();
+
+        if (n <= 0 || offsets[texts.size()] != n) {
+            fprintf(stderr, "%s : batch tokenization failed\n", __func__);
+            return 5;
+        }
+
+        for (size_t i = 0; i < texts.size(); ++i) {
+            std::vector<llama_token> expected(texts[i].size() + 1);
+            expected.resize(llama_tokenize(ctx, texts[i].c_str(), expected.data(), expected.size(), true));
+
+            if ((int) expected.size() != offsets[i + 1] - offsets[i] ||
+                !std::equal(expected.begin(), expected.end(), res.begin() + offsets[i])) {
+                fprintf(stderr, "%s : batch tokenization differs for text %zu\n", __func__, i);
+                return 6;
+            }
+        }
+
+        const double us = std::chrono::duration<double, std::micro>(t_end - t_start).count();
+        fprintf(stderr, "%s : batch tokenized %d texts into %d tokens in %.2f ms\n", __func__, (int) texts.size(), n, us/1000.0);
+    }
+
     llama_free(ctx);
 
     return 0;
@@ -0,0 +1,81 @@
+// Benchmark llama_tokenize on ~1 MB of text
+
+#include "llama.h"
+
+#include <cstdio>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#define ITERATIONS 3
+
+static const char * k_texts[] = {
+    "Hello World",
+    " Hello World!",
+    " this is 🦙.cpp",
+    "w048 7tuijk dsdfhu",
+    "нещо на Български",
+};
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = argv[1];
+
+    fprintf(stderr, "%s : reading vocab from: '%s'\n", __func__, fname.c_str());
+
+    llama_context * ctx;
+
+    // load the vocab
+    {
+        auto lparams = llama_context_default_params();
+
+        lparams.vocab_only = true;
+
+        ctx = llama_init_from_file(fname.c_str(), lparams);
+
+        if (ctx == NULL) {
+            fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+            return 1;
+        }
+    }
+
+    std::string text;
+    while (text.size() < 1024*1024) {
+        for (const char * t : k_texts) {
+            text += t;
+            text += "\n";
+        }
+    }
+
+    std::vector<llama_token> res(text.size() + 1);
+
+    double best_us = 0.0;
+    int n_tokens = 0;
+
+    for (int i = 0; i < ITERATIONS; ++i) {
+        const auto t_start = std::chrono::high_resolution_clock::now();
+        n_tokens = llama_tokenize(ctx, text.c_str(), res.data(), res.size(), true);
+        const auto t_end = std::chrono::high_resolution_clock::now();
+
+        const double us = std::chrono::duration<double, std::micro>(t_end - t_start).count();
+        if (i == 0 || us < best_us) {
+            best_us = us;
+        }
+    }
+
+    if (n_tokens <= 0) {
+        fprintf(stderr, "%s : failed to tokenize %zu bytes\n", __func__, text.size());
+        return 2;
+    }
+
+    printf("tokenized %zu bytes into %d tokens in %.2f ms (%.2f MB/s)\n",
+            text.size(), n_tokens, best_us/1000.0, text.size()/best_us);
+
+    llama_free(ctx);
+
+    return 0;
+}